@@ -22,6 +22,8 @@ zincr      = 1.05;                                            % dz increment (re
 simdir     = 'input';                                         % Path to the directory containing .dat files converted from .SUM
 simname    = 'CAMPI-FLEGREI-2D';                              % Name of the MUFITS simulation
 outdir     = 'output';                                        % Path to the directory where the output files will be stored
+extlayout  = false;                                           % true if .dat files were converted with --grid and --extend
+mfseries   = false;                                           % true if time steps were converted with --format series
 %% Preprocessing
 mfrvs      = refined_grid(Or,Lr,mfnr+1,rincr);                % R nodal coordinates
 mfzvs      = Oz-flip(refined_grid(Oz,Lz,mfnz+1,zincr));       % Z nodal coordinates
@@ -65,10 +67,19 @@ Vr         = zeros(nr+1,nz  );                                % Velocity in r di
 Vz         = zeros(nr  ,nz+1);                                % Velocity in z direction
 Mu_vrz     = zeros(nr+1,nz+1);                                % Node centered shear modulus
 Uzcevol    = nan*ones(1,itend-itstart+1);                     % Vertical displacement at observation point
-filepath   = sprintf('%s/%s.%04d.dat',simdir,simname,itref);  % File containing reference parameters        
+if mfseries
+    stepfile = @(it) sprintf('%s/%s.series',simdir,simname);      % Single container holding all time steps
+else
+    stepfile = @(it) sprintf('%s/%s.%04d.dat',simdir,simname,it); % One file per time step
+end
+filepath   = stepfile(itref);                                 % File containing reference parameters
 Pf0        = zeros(nr,nz); Pf = Pf0;                          % Fluid pressure (loaded from external files)
 T0         = zeros(nr,nz); T  = T0;                           % Temperature    (loaded from external files)
-[Pf0(mfri,mfzi),T0(mfri,mfzi)] = load_mufits(filepath,[mfnr,mfnz]);                      
+if extlayout
+    [Pf0,T0] = load_mufits(filepath,[nr,nz],true,itref);
+else
+    [Pf0(mfri,mfzi),T0(mfri,mfzi)] = load_mufits(filepath,[mfnr,mfnz],false,itref);
+end
 outfile = sprintf('%s/%s.grid.mat',outdir,simname);
 save(outfile,'Rc','Zc','Rr','Zr','Rz','Zz','Rrz','Zrz');
 outfile = sprintf('%s/%s.ref.mat',outdir,simname);
@@ -77,8 +88,12 @@ it         = itref;
 %% Action
 while it <= itend
     %% Load fluid pressure and temperature from MUFITS
-    filepath                     = sprintf('%s/%s.%04d.dat',simdir,simname,it);
-    [Pf(mfri,mfzi),T(mfri,mfzi)] = load_mufits(filepath,[mfnr,mfnz]);
+    filepath                     = stepfile(it);
+    if extlayout
+        [Pf,T]                   = load_mufits(filepath,[nr,nz],true,it);
+    else
+        [Pf(mfri,mfzi),T(mfri,mfzi)] = load_mufits(filepath,[mfnr,mfnz],false,it);
+    end
     Mui                          = griddedInterpolant(Rc,Zc,Mu,'linear');
     Mu_vrz                       = Mui(Rrz,Zrz);
     %% Pseudo-transient iterations
@@ -0,0 +1,24 @@
+function [A,C,V,names] = load_conn_graph(filepath)
+    % Reads a .conn file written by mufits2matlab with --conn. A is the sparse
+    % adjacency of the cells in the order of the fields (A(i,j) is the
+    % connection joining cells i and j), C holds the cells of every connection,
+    % V its values, one column per CONNDATA property
+    fid = fopen(filepath,'rb');
+    if ~strcmp(fread(fid,[1 8],'*char'),'MFCONN  ')
+        fclose(fid);
+        error('load_conn_graph: %s is not a connectivity graph',filepath);
+    end
+    hdr     = fread(fid,4,'int32');
+    nrows   = hdr(2);
+    nconns  = hdr(3);
+    names   = cellstr(fread(fid,[8 hdr(4)],'*char')');
+    offsets = fread(fid,nrows+1,'int64');
+    cols    = fread(fid,offsets(end),'int32')+1;
+    conns   = fread(fid,offsets(end),'int32')+1;
+    C       = fread(fid,[2 nconns],'int32')'+1;
+    V       = fread(fid,[nconns hdr(4)],'double');
+    fclose(fid);
+    % Entries of row i are offsets(i)+1:offsets(i+1)
+    rows    = repelem((1:nrows)',diff(offsets));
+    A       = sparse(rows,cols,conns,nrows,nrows);
+end
@@ -0,0 +1,35 @@
+function [H,t,names] = load_history(filepath,cells)
+    % Reads the history of cells from a .history file written by mufits2matlab
+    % with --format history. cells are linear indices into the fields, e.g.
+    % sub2ind([nr nz],ir,iz) for files converted with --grid. H(k,f,c) is field
+    % f of cell cells(c) at the k-th time step, t holds the simulation times of
+    % the steps and names the fields. Only steps of complete chunks are read,
+    % each cell costs one contiguous read per chunk
+    fid = fopen(filepath,'rb');
+    if ~strcmp(fread(fid,[1 8],'*char'),'MFHISTRY')
+        fclose(fid);
+        error('load_history: %s is not a history file',filepath);
+    end
+    hdr     = fread(fid,4,'int32');
+    nfields = hdr(2);
+    % Steps, first step, steps per chunk, offsets of time table and data, bytes between chunks, steps written
+    hdr     = fread(fid,7,'int64');
+    chunk   = hdr(3);
+    nsteps  = hdr(7);
+    fseek(fid,96,'bof');
+    desc    = fread(fid,[32 nfields],'*uint8');
+    names   = cellstr(char(desc(1:8,:)'));
+    fseek(fid,hdr(4),'bof');
+    t       = fread(fid,nsteps,'double');
+    H       = zeros(nsteps,nfields,numel(cells));
+    for first = 0:chunk:nsteps-1
+        % All chunks but the last one hold chunk steps
+        count  = min(chunk,hdr(1)-first);
+        offset = hdr(5)+first/chunk*hdr(6);
+        for c = 1:numel(cells)
+            fseek(fid,offset+8*(cells(c)-1)*nfields*count,'bof');
+            H(first+1:first+count,:,c) = fread(fid,[count nfields],'double');
+        end
+    end
+    fclose(fid);
+end
@@ -1,6 +1,34 @@
-function [Pf,T] = load_mufits(filepath,sz)
+function [Pf,T] = load_mufits(filepath,sz,solverlayout,it)
+    % Files written by mufits2matlab with --grid are already flipped along z
+    if nargin < 3, solverlayout = false; end
     fid = fopen(filepath,'rb');
-    Pf  = fliplr(fread(fid,sz,'double'));
-    T   = fliplr(fread(fid,sz,'double'));
+    [~,~,ext] = fileparts(filepath);
+    if strcmp(ext,'.series')
+        % Locate time step it through the step table of the container
+        if readat(fid,8,'int32') ~= 1
+            fclose(fid);
+            error('load_mufits: compressed series must be decoded with mf_decode_field from mufitsio');
+        end
+        fseek(fid,24,'bof');
+        hdr     = fread(fid,5,'int64');
+        itfirst = readat(fid,hdr(2),'int64');
+        offset  = readat(fid,hdr(2)+64*(it-itfirst)+8,'int64');
+        fseek(fid,offset,'bof');
+        Pf  = fread(fid,sz,'double');
+        fseek(fid,offset+hdr(5),'bof');
+        T   = fread(fid,sz,'double');
+    else
+        Pf  = fread(fid,sz,'double');
+        T   = fread(fid,sz,'double');
+    end
     fclose(fid);
+    if ~solverlayout
+        Pf = fliplr(Pf);
+        T  = fliplr(T);
+    end
+end
+
+function v = readat(fid,offset,precision)
+    fseek(fid,offset,'bof');
+    v = fread(fid,1,precision);
 end
@@ -1,10 +1,31 @@
+#define _POSIX_C_SOURCE 200809L
+#define _FILE_OFFSET_BITS 64
+
 #include "mufitsio.h"
 
 #include <errno.h>
+#include <math.h>
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#ifdef __linux__
+#define HAVE_INOTIFY 1
+#include <sys/inotify.h>
+#endif
+
+typedef enum { FORMAT_DAT, FORMAT_SERIES, FORMAT_HISTORY } output_format;
+
+// Base of the XOR delta applied before compression: the previous time step or the first converted one
+typedef enum { COMPRESS_NONE, COMPRESS_PREV, COMPRESS_REF } compress_mode;
 
 typedef struct {
   const char *sim_name;
@@ -12,24 +33,375 @@ typedef struct {
   const char *out_dir;
   long id_start;
   long id_end;
+  long num_jobs;
+  // Dimensions of the MUFITS grid, zero unless --grid is given
+  long grid_nr;
+  long grid_nz;
+  // Dimensions of the extended solver grid, zero unless --extend is given
+  long ext_nr;
+  long ext_nz;
+  output_format format;
+  compress_mode compress;
+  bool follow;
+  // Comma-separated CELLDATA properties and number of phases written for properties defined per phase
+  const char *props;
+  long num_phases;
+  // JSON file receiving timings of every stage, NULL unless --stats is given
+  const char *stats_path;
+  // Comma-separated CONNDATA properties written into connectivity graphs, NULL unless --conn is given, and the
+  // property holding the cell IDs of every connection
+  const char *conn_props;
+  const char *conn_ids;
+  // CSV file receiving statistics of every field of every time step, NULL unless --field-stats is given
+  const char *field_stats_path;
 } app_config;
 
+// Placement of converted values in the output fields. Sorted cell k lies in row k % nr and column k / nr of the
+// MUFITS grid; in solver layout columns are flipped and the grid is embedded into the top-left corner of the
+// extended grid, cells outside of it stay zero
+typedef struct {
+  int32_t num_cells;
+  bool solver_layout;
+  int32_t nr;
+  int32_t nz;
+  int32_t ext_nr;
+  int32_t ext_nz;
+  // Number of values in every output field
+  int64_t num_values;
+} output_layout;
+
+// Position of every CELLDATA record in the output fields, i.e. its rank in ascending CELLID order placed according to
+// the output layout. The ordering is the same for all time steps of a run, so it is built once and later files only
+// compare the hash of their CELLID column. Records that do not belong to the grid go to the extra slot past the end
+// of the output fields
+typedef struct {
+  int32_t num_cells;
+  uint64_t hash;
+  int32_t *dst;
+} cell_permutation;
+
+// CELLDATA property read from every file. STATE1 properties keep num_phases values per object, missing phases of
+// objects with fewer phases are written as NaN
+typedef struct {
+  mf_data_type_t data_type;
+  mf_output_mode_t output_mode;
+  mf_phase_state_t phase_state;
+  int element_size;
+  int num_phases;
+} query_item;
+
+// Output field: one component of one phase of a query item converted to double
+typedef struct {
+  char name[9];
+  char unit[9];
+  double scale;
+  int item;
+  int component;
+  // Phase of a STATE1 property, -1 otherwise
+  int phase;
+} field_spec;
+
+// All properties are decoded in a single traversal of CELLDATA. Every name is queried once: CELLID comes first,
+// then requested properties, then PHST if a STATE1 property needs it and it was not requested
+typedef struct {
+  char (*names)[9];
+  query_item *items;
+  int num_items;
+  int phst_item;
+  field_spec *fields;
+  int num_fields;
+  // With --conn, the CONNDATA property holding cell IDs followed by the properties written for every connection
+  char (*conn_names)[9];
+  int num_conn_values;
+} property_query;
+
+// Time spent on every stage of converting one time step and bytes read and written. Reading the SUM file is measured
+// by the library, stages of the converter are timed around their calls
+typedef struct {
+  double wait_seconds;
+  mf_sum_file_stats_t sum;
+  double permute_seconds;
+  double scatter_seconds;
+  double encode_seconds;
+  double write_seconds;
+  int64_t output_bytes;
+} step_stats;
+
+// Statistics of one field of one time step over the cells of the MUFITS grid, i.e. without the cells added by
+// --extend and without NaN of missing phases. Deltas are the largest absolute differences to the same field of the
+// first converted step and of the previous step, NaN if there is nothing to compare with
+typedef struct {
+  int64_t count;
+  double min;
+  double max;
+  double sum;
+  double sum_squares;
+  double ref_delta;
+  double prev_delta;
+} field_stats;
+
+// Buffers owned by a single worker and reused for every file it converts
+typedef struct {
+  int32_t capacity;
+  // Raw values of every query item, the second buffer of each pair is used only by DOUBLE properties
+  char **raw;
+  double **out;
+  // Without compression, fields of the previous step which the writer thread may still be writing; swapped with
+  // `out` after every step unless `prev` is kept
+  double **spare;
+  // With --compress prev or --field-stats, fields of the previously converted step, and the encoded payload with
+  // compression
+  bool encode;
+  bool keep_previous;
+  double **prev;
+  char *encoded;
+  // Step whose fields are XORed with the converted ones before encoding, -1 - none
+  long base_id;
+  const double **base;
+  // With --field-stats, statistics of the fields of the step being converted and the fields they are compared with,
+  // NULL if there are none; `prev` holds step prev_id, -1 - none
+  field_stats *field_stats;
+  const double *const *reference;
+  const double *const *previous;
+  long prev_id;
+  // Used only for files whose cell ordering differs from the one of the run
+  cell_permutation local_perm;
+  bool has_time;
+  mf_time_t time;
+  bool has_date;
+  mf_date_t date;
+  char *sum_file_path;
+  // Step following the one being converted, its file is read ahead
+  char *next_file_path;
+  char *out_file_path;
+  // Connectivity graph of the step, NULL unless --conn is given
+  char *conn_file_path;
+  int num_items;
+  int num_fields;
+  step_stats stats;
+} worker_state;
+
+// Destination of converted time steps: either one headerless .dat file per step or a single series container. The
+// container starts with a fixed header and a table of time steps, followed by field payloads aligned to 64 bytes,
+// so that any step can be located in O(1) and mapped with memmapfile:
+//
+//   0   char[8]  "MFSERIES"          24  int64  number of steps        48  int64  bytes between steps
+//   8   int32    format version      32  int64  offset of step table   56  int64  bytes between fields
+//   12  int32    number of fields    40  int64  offset of first step
+//   16  int32    rows of a field
+//   20  int32    columns of a field
+//   64  char[8]  name, char[8] unit, int32 component (0 or 1), int32 phase (-1 - not per phase) of every field,
+//                padded to 32 bytes
+//
+// Every entry of the step table takes 64 bytes: int64 step id, int64 payload offset, double time, char[8] time unit,
+// int32 day, char[8] month, int32 year, int32 flags (1 - converted, 2 - time is set, 4 - date is set), int32 index of
+// the base step in the table (-1 - none) and int64 payload size.
+//
+// Version 1 stores raw fields. In version 2 (--compress) both strides are zero and payloads of variable size follow
+// each other in step order; a payload holds every field as int64 size and the output of mf_encode_field, with the
+// fields of the base step as base. Steps are grouped into chunks of CHUNK_SIZE: the first converted step has no
+// base, the first step of every chunk is based on it, and with --compress prev later steps of a chunk are based on
+// their predecessor, so restoring any step decodes at most one chunk
+#define CHUNK_SIZE 16
+
+// With --conn every time step also gets a file <sim-name>.<id>.conn holding the connectivity graph of the grid in
+// compressed sparse row form, rows being positions in the output fields:
+//
+//   0   char[8]  "MFCONN  "          16  int32  number of connections
+//   8   int32    format version      20  int32  number of values
+//   12  int32    number of rows      24  char[8] name of every value
+//
+// followed by int64 offsets of the rows (rows + 1), int32 columns and int32 connections of all entries (2 per
+// connection each), int32 rows of the first and second cell of every connection and one double array per value.
+// Entries of a row are ordered by connection, connections to cells outside of the grid are left out
+#define CONN_VERSION 1
+
+// With --format history the fields of all time steps are transposed into <sim-name>.history, so that the history of
+// every value of every field is contiguous. Steps are grouped into chunks of as many steps as fit into
+// HISTORY_CHUNK_BYTES, chunk k holds steps [k * C, min((k + 1) * C, steps)) as doubles indexed by value, field and
+// step of the chunk, the last one varying fastest:
+//
+//   0   char[8]  "MFHISTRY"          24  int64  number of steps        56  int64  offset of first chunk
+//   8   int32    format version      32  int64  id of first step       64  int64  bytes between chunks
+//   12  int32    number of fields    40  int64  steps per chunk (C)    72  int64  steps written
+//   16  int32    rows of a field     48  int64  offset of time table   80  char[8] time unit
+//   20  int32    columns of a field
+//   96  field descriptors as in the series container
+//
+// The time table holds the simulation time of every step, NaN for steps without TIME record. Only steps of the chunk
+// being assembled are converted, and the writer of its last step transposes it tile by tile and appends it, so memory
+// stays bounded for any number of steps. Steps written ends at the last complete chunk
+#define HISTORY_VERSION 1
+#define HISTORY_CHUNK_BYTES ((int64_t)256 << 20)
+// Steps and values transposed at once, and the size of the buffer chunks are written from
+#define HISTORY_TILE 32
+#define HISTORY_WRITE_BYTES (4 << 20)
+
+typedef struct {
+  const app_config *cfg;
+  const output_layout *layout;
+  const field_spec *fields;
+  int num_fields;
+  int nd;
+  // Series or history container
+  FILE *series;
+  pthread_mutex_t lock;
+  int64_t table_offset;
+  int64_t data_offset;
+  int64_t step_stride;
+  int64_t field_stride;
+  // History only: fields of the steps of the chunk being assembled, indexed by step, field and value, the number of
+  // them received so far, and times of all steps
+  int64_t chunk_steps;
+  int64_t chunk_stride;
+  double *staging;
+  int64_t num_staged;
+  int64_t steps_written;
+  double *times;
+  char time_unit[9];
+  // Encoded steps waiting for their predecessors to be appended
+  char **pending;
+  long next_append;
+  int64_t append_offset;
+} output_sink;
+
+// Converted time step ready to be written
+typedef struct {
+  long it;
+  const double *const *values;
+  // Value is NaN if the SUM file has no TIME record
+  mf_time_t time;
+  // Table entry of the series followed by the encoded payload with --compress, NULL for .dat files
+  char *record;
+  // Bytes written for the step
+  int64_t size;
+} step_output;
+
+// Wakes up workers waiting for SUM files in --follow mode. A background thread watches the SUM directory with inotify
+// and bumps the generation counter whenever a file there is closed after writing or moved into it. Waiting workers
+// recheck their file at least once per second, so a missed event, or a platform without inotify, only delays
+// conversion
+typedef struct {
+  pthread_mutex_t lock;
+  pthread_cond_t changed;
+  uint64_t generation;
+  bool cancelled;
+  int fd;
+  int wd;
+  pthread_t thread;
+} dir_watcher;
+
+// Time steps are handed out to workers in increasing order. Completed steps are reported in order, and after a
+// failure no later steps are started, so the failing step reported is always the first one, as in a sequential run
+typedef struct {
+  const app_config *cfg;
+  output_sink *sink;
+  const property_query *query;
+  const mf_sum_decode_plan_t *plan;
+  const cell_permutation *perm;
+  dir_watcher *watcher;
+  const double *const *reference;
+  long chunk_size;
+  int nd;
+  pthread_mutex_t lock;
+  // Signalled whenever a step is finished
+  pthread_cond_t changed;
+  long next_id;
+  long report_id;
+  long failed_id;
+  // With --format history steps of a chunk are started only once all earlier chunks are written, 0 otherwise
+  long history_chunk;
+  bool *done;
+  // Statistics of every step with --stats, NULL otherwise
+  step_stats *stats;
+  // Statistics of every field of every step and times of the steps with --field-stats, NULL otherwise
+  field_stats *field_stats;
+  double *times;
+  // With --field-stats, fields of steps next to the start of a chunk that another worker converts: whichever of the
+  // two steps is converted first leaves a copy of its fields at the index of the later step, and the other one
+  // computes prev_delta of the later step from it. NULL otherwise
+  double **boundary;
+} job_queue;
+
+// Every worker writes its converted steps on a thread of its own, so that writing step N-1, decoding step N and
+// reading ahead step N+1 overlap. The writer holds at most one step, so the worker's spare fields are free whenever
+// the writer is idle
+typedef struct {
+  job_queue *queue;
+  pthread_mutex_t lock;
+  pthread_cond_t changed;
+  bool busy;
+  bool closing;
+  bool running;
+  step_output step;
+  char *out_file_path;
+  pthread_t thread;
+} step_writer;
+
 static void print_help();
 static bool parse_arguments(int argc, const char **argv, app_config *cfg);
+static const char *option_value(int argc, const char **argv, int *arg_idx);
+static bool parse_long(const char *str, const char *name, long *value);
+static bool parse_dims(const char *str, const char *name, long *nr, long *nz);
 static int num_digits(long n);
 static bool run(const app_config *cfg);
+static bool prepare_and_convert(const app_config *cfg, int nd, const char *first_file_path, dir_watcher *watcher);
+static void *convert_worker(void *arg);
+static void meet_at_boundary(job_queue *queue, long id, bool later, const double *const *fields);
+static void finish_step(job_queue *queue, long it, bool ok);
+static bool timed_write(output_sink *sink, step_output *step, char *out_file_path, step_stats *stats);
+static double monotonic_seconds(void);
+static void add_stats(step_stats *dst, const step_stats *src);
+static bool write_stats(const app_config *cfg, const job_queue *queue, long num_workers, double setup_seconds,
+                        double wall_seconds, double cpu_seconds);
+static bool write_field_stats(const app_config *cfg, const job_queue *queue, const property_query *query);
+static void start_writer(step_writer *writer, job_queue *queue);
+static void hand_over_step(step_writer *writer, const step_output *step);
+static void stop_writer(step_writer *writer);
+static void *write_worker(void *arg);
+static void prefetch_file(const char *path);
+static void init_worker_state(worker_state *state, const app_config *cfg, const property_query *query, int nd);
+static void free_worker_state(worker_state *state);
+static void start_watcher(dir_watcher *watcher, const char *dir);
+static void stop_watcher(dir_watcher *watcher);
+static void cancel_watcher(dir_watcher *watcher);
+static bool wait_for_sum_file(dir_watcher *watcher, const char *sum_file_path);
 static bool read_num_cells(const char *mvs_file_path, int32_t *num_cells);
-static void remap_ids(int32_t *ids, const int32_t num_cells);
-static void sort_field(double *field, const int32_t *ids, const int32_t num_cells);
-static bool convert_sum_file(const char *sum_file_path, const char *out_file_path, const int32_t num_cells);
+static bool read_first_file(const char *sum_file_path, const app_config *cfg, property_query *query,
+                            mf_sum_decode_plan_t **plan, int32_t **cell_id, int32_t *num_cells);
+static bool build_query(const app_config *cfg, const mf_arrays_t *celldata, property_query *query);
+static bool build_conn_names(const app_config *cfg, property_query *query);
+static bool add_query_item(property_query *query, const mf_arrays_t *celldata, const char *name, int num_phases);
+static bool check_query(const property_query *query, const mf_arrays_t *celldata);
+static void free_query(property_query *query);
+static uint64_t hash_ids(const int32_t *ids, int32_t num_cells);
+static bool build_permutation(const int32_t *ids, int32_t num_cells, const output_layout *layout,
+                              cell_permutation *perm);
+static bool remap_ids(const int32_t *ids, int32_t *dst, const int32_t num_cells);
+static int64_t output_index(const output_layout *layout, int32_t rank);
+static void scatter_field(double *dst, const char *src, size_t stride, mf_data_type_t type, const int32_t *perm,
+                          const int32_t num_cells, const double scale);
+static void mark_missing_phases(double *dst, const int8_t *phst, int phase, const int32_t *perm,
+                                const int32_t num_cells);
+static void reduce_field(field_stats *stats, const double *values, const double *reference, const double *previous,
+                         const output_layout *layout);
+static bool reserve_buffers(worker_state *state, const property_query *query, int32_t num_cells, int64_t num_values);
+static bool write_conn_file(mf_sum_file_t *sum, const property_query *query, const int32_t *cell_id,
+                            int32_t num_cells, const cell_permutation *perm, const output_layout *layout,
+                            worker_state *state);
+static bool convert_sum_file(const char *sum_file_path, const property_query *query, const mf_sum_decode_plan_t *plan,
+                             output_sink *sink, const cell_permutation *perm, worker_state *state);
+static bool open_sink(output_sink *sink);
+static bool open_history(output_sink *sink);
+static bool prepare_step(output_sink *sink, long it, const double *const *values, worker_state *state,
+                         step_output *step);
+static bool write_step(output_sink *sink, step_output *step, char *out_file_path);
+static bool stage_history_step(output_sink *sink, const step_output *step);
+static bool write_history_chunk(output_sink *sink, int64_t first_idx, int64_t count);
+static bool flush_pending(output_sink *sink);
+static bool close_sink(output_sink *sink);
 
 int main(int argc, const char **argv) {
-  if (argc < 6) {
-    fprintf(stderr, "Error: not enough arguments\n");
-    print_help();
-    return EXIT_FAILURE;
-  }
-
   app_config cfg;
   if (!parse_arguments(argc, argv, &cfg)) {
     return EXIT_FAILURE;
@@ -44,38 +416,168 @@ int main(int argc, const char **argv) {
 
 void print_help() {
   printf("Usage:\n"
-         "  mufits2matlab <sim-name> <path-to-sum-dir> <path-to-out-dir> <id-start> <id-end>\n\n"
+         "  mufits2matlab [options] <sim-name> <path-to-sum-dir> <path-to-out-dir> <id-start> <id-end>\n\n"
          "    <sim-name>        : name of the RUN file without extension\n"
          "    <path-to-sum-dir> : path to the directory containing SUM files and MVS file\n"
          "    <path-to-out-dir> : path to the directory where files for MATLAB will be written\n"
          "    <id-start>        : first time step\n"
-         "    <id-end>          : last time step\n");
+         "    <id-end>          : last time step\n\n"
+         "Options:\n"
+         "    -j <N>            : convert N time steps in parallel (default 1)\n"
+         "    --grid <NR>x<NZ>  : MUFITS grid has NR cells in r and NZ cells in z direction; fields are written\n"
+         "                        with flipped z axis, i.e. in the layout used by the solver\n"
+         "    --extend <NR>x<NZ>: embed fields into the extended solver grid of NR x NZ cells (requires --grid)\n"
+         "    --format <FORMAT> : 'dat' writes one file per time step (default), 'series' writes all time steps\n"
+         "                        into a single indexed container <sim-name>.series, 'history' writes the history\n"
+         "                        of every cell contiguously into <sim-name>.history\n"
+         "    --follow          : wait for SUM files that do not exist yet and convert each one as soon as MUFITS\n"
+         "                        finishes writing it\n"
+         "    --compress <MODE> : compress fields of the series container losslessly; MODE 'ref' encodes every\n"
+         "                        step as difference to the first one, 'prev' encodes the first step of every\n"
+         "                        chunk of 16 steps as difference to the first one and the other steps as\n"
+         "                        difference to the previous one\n"
+         "    --props <LIST>    : comma-separated CELLDATA properties to write (default PRES,TEMP); properties\n"
+         "                        with two components give two fields, pressure is converted to Pa\n"
+         "    --phases <N>      : number of phases written for properties defined per phase (default 2); every\n"
+         "                        phase is a separate field, phases missing in a cell are NaN\n"
+         "    --stats <PATH>    : write time spent on reading, decoding, reordering, encoding and writing every time\n"
+         "                        step and totals of the run to PATH as JSON\n"
+         "    --conn <LIST>     : write the connectivity graph of every time step into <sim-name>.<id>.conn with\n"
+         "                        the comma-separated CONNDATA properties as values of connections, e.g. FLUX\n"
+         "    --conn-ids <NAME> : CONNDATA property holding the cell IDs of connections (default CONNID)\n"
+         "    --field-stats <PATH>: write minimum, maximum, mean, L2 norm and largest change against the first and\n"
+         "                        the previous time step of every field of every time step to PATH as CSV\n");
 }
 
 bool parse_arguments(int argc, const char **argv, app_config *cfg) {
-  cfg->sim_name = argv[1];
-  cfg->sum_dir = argv[2];
-  cfg->out_dir = argv[3];
-
-  char *str_end;
+  const char *positional[5];
+  int num_positional = 0;
+  cfg->num_jobs = 1;
+  cfg->grid_nr = cfg->grid_nz = 0;
+  cfg->ext_nr = cfg->ext_nz = 0;
+  cfg->format = FORMAT_DAT;
+  cfg->compress = COMPRESS_NONE;
+  cfg->follow = false;
+  cfg->props = "PRES,TEMP";
+  cfg->num_phases = 2;
+  cfg->stats_path = NULL;
+  cfg->conn_props = NULL;
+  cfg->conn_ids = "CONNID";
+  cfg->field_stats_path = NULL;
 
-  cfg->id_start = strtol(argv[4], &str_end, 10);
-  if (str_end == argv[4] || *str_end != '\0') {
-    fprintf(stderr, "Error: id-start must be valid integer\n");
-    return false;
+  for (int arg_idx = 1; arg_idx < argc; ++arg_idx) {
+    const char *arg = argv[arg_idx];
+    if (!strcmp(arg, "-j")) {
+      const char *value = option_value(argc, argv, &arg_idx);
+      if (!value || !parse_long(value, "number of jobs", &cfg->num_jobs)) {
+        return false;
+      }
+      if (cfg->num_jobs < 1) {
+        fprintf(stderr, "Error: number of jobs must be positive\n");
+        return false;
+      }
+    } else if (!strcmp(arg, "--grid")) {
+      const char *value = option_value(argc, argv, &arg_idx);
+      if (!value || !parse_dims(value, "grid size", &cfg->grid_nr, &cfg->grid_nz)) {
+        return false;
+      }
+    } else if (!strcmp(arg, "--format")) {
+      const char *value = option_value(argc, argv, &arg_idx);
+      if (!value) {
+        return false;
+      }
+      if (!strcmp(value, "dat")) {
+        cfg->format = FORMAT_DAT;
+      } else if (!strcmp(value, "series")) {
+        cfg->format = FORMAT_SERIES;
+      } else if (!strcmp(value, "history")) {
+        cfg->format = FORMAT_HISTORY;
+      } else {
+        fprintf(stderr, "Error: unknown output format '%s'\n", value);
+        return false;
+      }
+    } else if (!strcmp(arg, "--compress")) {
+      const char *value = option_value(argc, argv, &arg_idx);
+      if (!value) {
+        return false;
+      }
+      if (!strcmp(value, "prev")) {
+        cfg->compress = COMPRESS_PREV;
+      } else if (!strcmp(value, "ref")) {
+        cfg->compress = COMPRESS_REF;
+      } else {
+        fprintf(stderr, "Error: unknown compression mode '%s'\n", value);
+        return false;
+      }
+    } else if (!strcmp(arg, "--props")) {
+      cfg->props = option_value(argc, argv, &arg_idx);
+      if (!cfg->props) {
+        return false;
+      }
+    } else if (!strcmp(arg, "--phases")) {
+      const char *value = option_value(argc, argv, &arg_idx);
+      if (!value || !parse_long(value, "number of phases", &cfg->num_phases)) {
+        return false;
+      }
+      // PHST is a signed byte
+      if (cfg->num_phases < 1 || cfg->num_phases > 127) {
+        fprintf(stderr, "Error: number of phases must be between 1 and 127\n");
+        return false;
+      }
+    } else if (!strcmp(arg, "--stats")) {
+      cfg->stats_path = option_value(argc, argv, &arg_idx);
+      if (!cfg->stats_path) {
+        return false;
+      }
+    } else if (!strcmp(arg, "--conn")) {
+      cfg->conn_props = option_value(argc, argv, &arg_idx);
+      if (!cfg->conn_props) {
+        return false;
+      }
+    } else if (!strcmp(arg, "--conn-ids")) {
+      cfg->conn_ids = option_value(argc, argv, &arg_idx);
+      if (!cfg->conn_ids) {
+        return false;
+      }
+    } else if (!strcmp(arg, "--field-stats")) {
+      cfg->field_stats_path = option_value(argc, argv, &arg_idx);
+      if (!cfg->field_stats_path) {
+        return false;
+      }
+    } else if (!strcmp(arg, "--follow")) {
+      cfg->follow = true;
+    } else if (!strcmp(arg, "--extend")) {
+      const char *value = option_value(argc, argv, &arg_idx);
+      if (!value || !parse_dims(value, "extended grid size", &cfg->ext_nr, &cfg->ext_nz)) {
+        return false;
+      }
+    } else if (arg[0] == '-' && arg[1] != '\0') {
+      fprintf(stderr, "Error: unknown option '%s'\n", arg);
+      print_help();
+      return false;
+    } else if (num_positional < 5) {
+      positional[num_positional++] = arg;
+    } else {
+      fprintf(stderr, "Error: too many arguments\n");
+      print_help();
+      return false;
+    }
   }
-  if (errno == ERANGE) {
-    fprintf(stderr, "Error: id-start out of range\n");
+
+  if (num_positional < 5) {
+    fprintf(stderr, "Error: not enough arguments\n");
+    print_help();
     return false;
   }
 
-  cfg->id_end = strtol(argv[5], &str_end, 10);
-  if (str_end == argv[5] || *str_end != '\0') {
-    fprintf(stderr, "Error: id-end must be valid integer\n");
+  cfg->sim_name = positional[0];
+  cfg->sum_dir = positional[1];
+  cfg->out_dir = positional[2];
+
+  if (!parse_long(positional[3], "id-start", &cfg->id_start)) {
     return false;
   }
-  if (errno == ERANGE) {
-    fprintf(stderr, "Error: id-end out of range\n");
+  if (!parse_long(positional[4], "id-end", &cfg->id_end)) {
     return false;
   }
 
@@ -92,7 +594,63 @@ bool parse_arguments(int argc, const char **argv, app_config *cfg) {
     fprintf(stderr, "Error: id-start must not exceed id-end\n");
     return false;
   }
+  if (cfg->ext_nr > 0 && cfg->grid_nr == 0) {
+    fprintf(stderr, "Error: --extend requires --grid\n");
+    return false;
+  }
+  if (cfg->ext_nr > 0 && (cfg->ext_nr < cfg->grid_nr || cfg->ext_nz < cfg->grid_nz)) {
+    fprintf(stderr, "Error: extended grid must not be smaller than MUFITS grid\n");
+    return false;
+  }
+  if (cfg->compress != COMPRESS_NONE && cfg->format != FORMAT_SERIES) {
+    fprintf(stderr, "Error: --compress requires --format series\n");
+    return false;
+  }
+
+  return true;
+}
+
+const char *option_value(int argc, const char **argv, int *arg_idx) {
+  if (*arg_idx + 1 == argc) {
+    fprintf(stderr, "Error: option %s requires a value\n", argv[*arg_idx]);
+    return NULL;
+  }
+  return argv[++*arg_idx];
+}
+
+bool parse_long(const char *str, const char *name, long *value) {
+  char *str_end;
+  errno = 0;
+  *value = strtol(str, &str_end, 10);
+  if (str_end == str || *str_end != '\0') {
+    fprintf(stderr, "Error: %s must be valid integer\n", name);
+    return false;
+  }
+  if (errno == ERANGE) {
+    fprintf(stderr, "Error: %s out of range\n", name);
+    return false;
+  }
+  return true;
+}
 
+bool parse_dims(const char *str, const char *name, long *nr, long *nz) {
+  char *str_end;
+  errno = 0;
+  *nr = strtol(str, &str_end, 10);
+  if (str_end == str || *str_end != 'x' || errno == ERANGE) {
+    fprintf(stderr, "Error: %s must be given as <NR>x<NZ>\n", name);
+    return false;
+  }
+  const char *nz_str = str_end + 1;
+  *nz = strtol(nz_str, &str_end, 10);
+  if (str_end == nz_str || *str_end != '\0' || errno == ERANGE) {
+    fprintf(stderr, "Error: %s must be given as <NR>x<NZ>\n", name);
+    return false;
+  }
+  if (*nr <= 0 || *nz <= 0 || *nr > INT32_MAX / *nz) {
+    fprintf(stderr, "Error: %s out of range\n", name);
+    return false;
+  }
   return true;
 }
 
@@ -106,6 +664,39 @@ int num_digits(long n) {
 }
 
 bool run(const app_config *cfg) {
+  // Time step ids are zero-padded to at least 4 digits, a long has at most 19
+  int nd = num_digits(cfg->id_end);
+  if (nd < 4) {
+    nd = 4;
+  } else if (nd > 19) {
+    nd = 19;
+  }
+
+  // 1 for '/', 1 for '.', 4 for '.SUM', 1 for '\0'
+  char *first_file_path = malloc(strlen(cfg->sum_dir) + 1 + strlen(cfg->sim_name) + 1 + nd + 4 + 1);
+  sprintf(first_file_path, "%s/%s.%0*ld.SUM", cfg->sum_dir, cfg->sim_name, nd, cfg->id_start);
+
+  // MUFITS writes the MVS file before the first SUM file, so both are complete once the latter is
+  dir_watcher watcher;
+  if (cfg->follow) {
+    start_watcher(&watcher, cfg->sum_dir);
+    if (mf_probe_sum_file(first_file_path) != MF_OK) {
+      printf("  Waiting for file '%s'\n", first_file_path);
+      fflush(stdout);
+    }
+    wait_for_sum_file(&watcher, first_file_path);
+  }
+
+  bool ok = prepare_and_convert(cfg, nd, first_file_path, cfg->follow ? &watcher : NULL);
+  free(first_file_path);
+  if (cfg->follow) {
+    stop_watcher(&watcher);
+  }
+  return ok;
+}
+
+bool prepare_and_convert(const app_config *cfg, int nd, const char *first_file_path, dir_watcher *watcher) {
+  double start = monotonic_seconds();
   int32_t num_cells;
   // 4 for '.MVS', 1 for '\0'
   char *mvs_file_path = malloc(strlen(cfg->sum_dir) + 1 + strlen(cfg->sim_name) + 4 + 1);
@@ -121,147 +712,1925 @@ bool run(const app_config *cfg) {
   }
   free(mvs_file_path);
 
-  int nd = num_digits(cfg->id_end);
-  if (nd < 4) {
-    nd = 4;
-  }
-  // 1 for '/', 1 for '.', 4 for '.SUM' or '.dat', 1 for '\0'
-  char *sum_file_path = malloc(strlen(cfg->sum_dir) + 1 + strlen(cfg->sim_name) + 1 + nd + 4 + 1);
-  char *out_file_path = malloc(strlen(cfg->out_dir) + 1 + strlen(cfg->sim_name) + 1 + nd + 4 + 1);
-  for (long it = cfg->id_start; it <= cfg->id_end; ++it) {
-    sprintf(sum_file_path, "%s/%s.%0*ld.SUM", cfg->sum_dir, cfg->sim_name, nd, it);
-    sprintf(out_file_path, "%s/%s.%0*ld.dat", cfg->out_dir, cfg->sim_name, nd, it);
-    printf("  Converting file '%s'\n", sum_file_path);
-    if (!convert_sum_file(sum_file_path, out_file_path, num_cells)) {
-      free(out_file_path);
-      free(sum_file_path);
+  output_layout layout = {.num_cells = num_cells, .num_values = num_cells};
+  if (cfg->grid_nr > 0) {
+    if (cfg->grid_nr * cfg->grid_nz != num_cells) {
+      fprintf(stderr, "Error: grid of %ldx%ld cells does not match %d cells in MVS file\n", cfg->grid_nr,
+              cfg->grid_nz, num_cells);
       return false;
     }
+    layout.solver_layout = true;
+    layout.nr = layout.ext_nr = (int32_t)cfg->grid_nr;
+    layout.nz = layout.ext_nz = (int32_t)cfg->grid_nz;
+    if (cfg->ext_nr > 0) {
+      layout.ext_nr = (int32_t)cfg->ext_nr;
+      layout.ext_nz = (int32_t)cfg->ext_nz;
+    }
+    layout.num_values = (int64_t)layout.ext_nr * layout.ext_nz;
   }
-  free(out_file_path);
-  free(sum_file_path);
-  return true;
-}
 
-bool read_num_cells(const char *mvs_file_path, int32_t *num_cells) {
-  mf_mvs_file_t *mvs;
-  if (mf_open_mvs_file(&mvs, mvs_file_path) != MF_OK) {
+  property_query query = {0};
+  mf_sum_decode_plan_t *plan;
+  int32_t *first_cell_id;
+  int32_t first_num_cells;
+  bool ok = read_first_file(first_file_path, cfg, &query, &plan, &first_cell_id, &first_num_cells);
+  if (!ok) {
+    return false;
+  }
+  cell_permutation perm = {0};
+  ok = build_permutation(first_cell_id, first_num_cells, &layout, &perm);
+  free(first_cell_id);
+  if (!ok) {
+    mf_free_sum_plan(plan);
+    free_query(&query);
     return false;
   }
 
-  mf_mvs_description_t *desc = mf_get_mvs_description(mvs);
-  *num_cells = desc->num_cells;
+  double setup_seconds = monotonic_seconds() - start;
 
-  mf_close_mvs_file(mvs);
+  output_sink sink = {
+      .cfg = cfg, .layout = &layout, .fields = query.fields, .num_fields = query.num_fields, .nd = nd};
+  if (!open_sink(&sink)) {
+    free(perm.dst);
+    mf_free_sum_plan(plan);
+    free_query(&query);
+    return false;
+  }
+
+  long num_steps = cfg->id_end - cfg->id_start + 1;
+  step_stats *stats = cfg->stats_path ? calloc(num_steps, sizeof(step_stats)) : NULL;
+  field_stats *fstats = cfg->field_stats_path ? calloc(num_steps * query.num_fields, sizeof(field_stats)) : NULL;
+  double *times = cfg->field_stats_path ? malloc(num_steps * sizeof(double)) : NULL;
+
+  // With compression or field statistics the first step is the base of all others, so it is converted before the
+  // workers start; it is compared with itself
+  long first_id = cfg->id_start;
+  bool first_ok = true;
+  worker_state first_state;
+  init_worker_state(&first_state, cfg, &query, nd);
+  bool has_reference = cfg->compress != COMPRESS_NONE || fstats;
+  if (has_reference) {
+    step_output step;
+    if (first_state.conn_file_path) {
+      sprintf(first_state.conn_file_path, "%s/%s.%0*ld.conn", cfg->out_dir, cfg->sim_name, nd, first_id);
+    }
+    first_state.field_stats = fstats;
+    first_state.reference = (const double *const *)first_state.out;
+    first_ok = convert_sum_file(first_file_path, &query, plan, &sink, &perm, &first_state) &&
+               prepare_step(&sink, first_id, (const double *const *)first_state.out, &first_state, &step);
+    if (stats) {
+      stats[0] = first_state.stats;
+    }
+    if (times) {
+      times[0] = first_state.has_time ? first_state.time.value : NAN;
+    }
+    first_ok = first_ok && timed_write(&sink, &step, first_state.out_file_path, stats);
+    if (first_ok) {
+      printf("  Converted file '%s'\n", first_file_path);
+      fflush(stdout);
+    }
+    first_id++;
+  }
+
+  long num_workers = cfg->num_jobs < num_steps ? cfg->num_jobs : num_steps;
+#ifdef _SC_NPROCESSORS_ONLN
+  // Workers share the processors with the decoding threads of the library
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  mf_set_max_threads(cpus / num_workers > 1 ? (int)(cpus / num_workers) : 1);
+#endif
+
+  job_queue queue;
+  queue.cfg = cfg;
+  queue.sink = &sink;
+  queue.query = &query;
+  queue.plan = plan;
+  queue.perm = &perm;
+  queue.watcher = watcher;
+  queue.reference = has_reference ? (const double *const *)first_state.out : NULL;
+  // Consecutive steps of a chunk are converted by one worker, so their predecessors are at hand
+  queue.chunk_size = cfg->compress == COMPRESS_PREV || fstats ? CHUNK_SIZE : 1;
+  queue.nd = nd;
+  queue.next_id = first_id;
+  queue.report_id = first_id;
+  queue.failed_id = first_ok ? cfg->id_end + 1 : cfg->id_start;
+  queue.done = calloc(num_steps, sizeof(bool));
+  if (first_ok && first_id > cfg->id_start) {
+    queue.done[0] = true;
+  }
+  queue.history_chunk = cfg->format == FORMAT_HISTORY ? (long)sink.chunk_steps : 0;
+  queue.stats = stats;
+  queue.field_stats = fstats;
+  queue.times = times;
+  queue.boundary = fstats ? calloc(num_steps, sizeof(double *)) : NULL;
+  pthread_mutex_init(&queue.lock, NULL);
+  pthread_cond_init(&queue.changed, NULL);
+
+  // The calling thread is always one of the workers
+  pthread_t *threads = malloc((num_workers - 1) * sizeof(pthread_t));
+  long num_threads = 0;
+  for (; num_threads < num_workers - 1; ++num_threads) {
+    if (pthread_create(&threads[num_threads], NULL, convert_worker, &queue) != 0) {
+      fprintf(stderr, "Warning: failed to start worker thread, continuing with %ld workers\n", num_threads + 1);
+      break;
+    }
+  }
+  convert_worker(&queue);
+  for (long thread_idx = 0; thread_idx < num_threads; ++thread_idx) {
+    pthread_join(threads[thread_idx], NULL);
+  }
+  free(threads);
+
+  pthread_cond_destroy(&queue.changed);
+  pthread_mutex_destroy(&queue.lock);
+  free(perm.dst);
+  free_worker_state(&first_state);
+  mf_free_sum_plan(plan);
+
+  ok = close_sink(&sink);
+  if (fstats) {
+    ok &= write_field_stats(cfg, &queue, &query);
+  }
+  free_query(&query);
+  if (stats) {
+    double cpu_seconds = -1.0;
+#ifdef CLOCK_PROCESS_CPUTIME_ID
+    struct timespec cpu_time;
+    if (clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &cpu_time) == 0) {
+      cpu_seconds = cpu_time.tv_sec + 1e-9 * cpu_time.tv_nsec;
+    }
+#endif
+    ok &= write_stats(cfg, &queue, num_threads + 1, setup_seconds, monotonic_seconds() - start, cpu_seconds);
+  }
+  if (queue.boundary) {
+    // Fields whose neighbour failed or was never converted are left over
+    for (long step_idx = 0; step_idx < num_steps; ++step_idx) {
+      free(queue.boundary[step_idx]);
+    }
+  }
+  free(queue.boundary);
+  free(queue.done);
+  free(stats);
+  free(fstats);
+  free(times);
+  if (!ok) {
+    return false;
+  }
+  if (queue.failed_id <= cfg->id_end) {
+    fprintf(stderr, "Error: failed to convert time step %ld\n", queue.failed_id);
+    return false;
+  }
   return true;
 }
 
-static int int32_pair_cmp(const void *v1, const void *v2) { return *((int32_t *)v1) - *((int32_t *)v2); }
+void *convert_worker(void *arg) {
+  job_queue *queue = arg;
+  const app_config *cfg = queue->cfg;
+  int nd = queue->nd;
 
-void remap_ids(int32_t *ids, const int32_t num_cells) {
-  int32_t *sorter = malloc(2 * num_cells * sizeof(int32_t));
-  for (int32_t idx = 0; idx < num_cells; ++idx) {
-    sorter[2 * idx + 0] = ids[idx];
-    sorter[2 * idx + 1] = idx;
+  worker_state state;
+  init_worker_state(&state, cfg, queue->query, nd);
+  step_writer writer;
+  start_writer(&writer, queue);
+
+  bool stop = false;
+  while (!stop) {
+    pthread_mutex_lock(&queue->lock);
+    // Steps of the next history chunk wait until all steps of the current one are written
+    while (queue->history_chunk > 0 && queue->next_id <= cfg->id_end && queue->next_id <= queue->failed_id &&
+           (queue->next_id - cfg->id_start) / queue->history_chunk >
+               (queue->report_id - cfg->id_start) / queue->history_chunk) {
+      pthread_cond_wait(&queue->changed, &queue->lock);
+    }
+    if (queue->next_id > cfg->id_end || queue->next_id > queue->failed_id) {
+      pthread_mutex_unlock(&queue->lock);
+      break;
+    }
+    // Chunks end at fixed positions, so every step is encoded against the same base for any number of workers
+    long first_id = queue->next_id;
+    long last_id = first_id + queue->chunk_size - 1 - (first_id - cfg->id_start) % queue->chunk_size;
+    if (queue->history_chunk > 0) {
+      long chunk_end = first_id + queue->history_chunk - 1 - (first_id - cfg->id_start) % queue->history_chunk;
+      last_id = chunk_end < last_id ? chunk_end : last_id;
+    }
+    if (last_id > cfg->id_end) {
+      last_id = cfg->id_end;
+    }
+    queue->next_id = last_id + 1;
+    pthread_mutex_unlock(&queue->lock);
+
+    // Another worker converts the step following the kept one
+    if (queue->boundary && state.prev_id >= 0 && state.prev_id + 1 != first_id && state.prev_id < cfg->id_end) {
+      meet_at_boundary(queue, state.prev_id + 1, false, (const double *const *)state.prev);
+      state.prev_id = -1;
+    }
+
+    for (long it = first_id; it <= last_id && !stop; ++it) {
+      sprintf(state.sum_file_path, "%s/%s.%0*ld.SUM", cfg->sum_dir, cfg->sim_name, nd, it);
+      if (state.conn_file_path) {
+        sprintf(state.conn_file_path, "%s/%s.%0*ld.conn", cfg->out_dir, cfg->sim_name, nd, it);
+      }
+      memset(&state.stats, 0, sizeof(step_stats));
+      // Waiting is cancelled only after another step has failed, then this step is simply abandoned
+      if (queue->watcher) {
+        double wait_start = monotonic_seconds();
+        if (!wait_for_sum_file(queue->watcher, state.sum_file_path)) {
+          stop = true;
+          break;
+        }
+        state.stats.wait_seconds = monotonic_seconds() - wait_start;
+      }
+
+      // The predecessor of a chunk converted by another worker is compared with once both are converted
+      bool boundary = false;
+      if (queue->field_stats) {
+        state.field_stats = &queue->field_stats[(it - cfg->id_start) * queue->query->num_fields];
+        state.reference = queue->reference;
+        if (it - 1 == cfg->id_start) {
+          state.previous = queue->reference;
+        } else if (it - 1 == state.prev_id) {
+          state.previous = (const double *const *)state.prev;
+        } else {
+          state.previous = NULL;
+          boundary = true;
+        }
+      }
+
+      state.base_id = -1;
+      if (state.encode) {
+        bool from_previous = cfg->compress == COMPRESS_PREV && it != first_id;
+        state.base_id = from_previous ? it - 1 : cfg->id_start;
+        for (int field_idx = 0; field_idx < queue->query->num_fields; ++field_idx) {
+          state.base[field_idx] = from_previous ? state.prev[field_idx] : queue->reference[field_idx];
+        }
+      }
+      if (it < cfg->id_end) {
+        sprintf(state.next_file_path, "%s/%s.%0*ld.SUM", cfg->sum_dir, cfg->sim_name, nd, it + 1);
+        prefetch_file(state.next_file_path);
+      }
+      step_output step;
+      bool ok = convert_sum_file(state.sum_file_path, queue->query, queue->plan, queue->sink, queue->perm, &state) &&
+                prepare_step(queue->sink, it, (const double *const *)state.out, &state, &step);
+      // The writer adds its time to the entry after the hand-over
+      if (queue->stats) {
+        queue->stats[it - cfg->id_start] = state.stats;
+      }
+      if (queue->times) {
+        queue->times[it - cfg->id_start] = state.has_time ? state.time.value : NAN;
+      }
+      if (ok) {
+        hand_over_step(&writer, &step);
+        // The writer is done with the previous step, so kept fields can take its place
+        if (!state.encode && !state.keep_previous) {
+          double **tmp = state.spare;
+          state.spare = state.out;
+          state.out = tmp;
+        }
+      }
+
+      pthread_mutex_lock(&queue->lock);
+      if (!ok) {
+        finish_step(queue, it, false);
+      }
+      // Rest of the chunk is abandoned after a failure of this or an earlier step
+      stop = it >= queue->failed_id;
+      pthread_mutex_unlock(&queue->lock);
+
+      if (state.keep_previous) {
+        double **tmp = state.prev;
+        state.prev = state.out;
+        state.out = tmp;
+        state.prev_id = ok ? it : -1;
+      }
+      if (boundary && ok) {
+        meet_at_boundary(queue, it, true, (const double *const *)state.prev);
+      }
+    }
   }
-  qsort(sorter, num_cells, 2 * sizeof(int32_t), int32_pair_cmp);
-  int32_t *map = calloc((sorter[2 * (num_cells - 1)] + 1), sizeof(int32_t));
-  for (int32_t idx = 0; idx < num_cells; ++idx) {
-    map[sorter[2 * idx]] = idx;
+  if (queue->boundary && state.prev_id >= 0 && state.prev_id < cfg->id_end) {
+    meet_at_boundary(queue, state.prev_id + 1, false, (const double *const *)state.prev);
   }
-  for (int32_t idx = 0; idx < num_cells; ++idx) {
-    ids[idx] = map[ids[idx]];
+
+  stop_writer(&writer);
+  free_worker_state(&state);
+  return NULL;
+}
+
+// Brings together the fields of step `id`, the first one of a chunk, and of its predecessor, converted by different
+// workers; `later` tells whether `fields` belong to step `id`. The worker that comes second computes prev_delta of
+// step `id` as reduce_field does, copying fields takes much less than converting the predecessor again
+void meet_at_boundary(job_queue *queue, long id, bool later, const double *const *fields) {
+  const app_config *cfg = queue->cfg;
+  const property_query *query = queue->query;
+  const output_layout *layout = queue->sink->layout;
+  double **slot = &queue->boundary[id - cfg->id_start];
+  pthread_mutex_lock(&queue->lock);
+  double *other = *slot;
+  *slot = NULL;
+  pthread_mutex_unlock(&queue->lock);
+
+  double *copy = NULL;
+  if (!other) {
+    copy = malloc(query->num_fields * layout->num_values * sizeof(double));
+    if (!copy) {
+      fprintf(stderr, "Warning: failed to keep fields of time step %ld, its neighbour is not compared with it\n",
+              later ? id : id - 1);
+      return;
+    }
+    for (int field_idx = 0; field_idx < query->num_fields; ++field_idx) {
+      memcpy(copy + field_idx * layout->num_values, fields[field_idx], layout->num_values * sizeof(double));
+    }
+    // The other worker may have arrived in the meantime
+    pthread_mutex_lock(&queue->lock);
+    other = *slot;
+    *slot = other ? NULL : copy;
+    pthread_mutex_unlock(&queue->lock);
+    if (!other) {
+      return;
+    }
   }
-  free(map);
-  free(sorter);
+
+  field_stats *stats = &queue->field_stats[(id - cfg->id_start) * query->num_fields];
+  for (int field_idx = 0; field_idx < query->num_fields; ++field_idx) {
+    const query_item *item = &query->items[query->fields[field_idx].item];
+    if (item->data_type == MF_CHAR4 || item->data_type == MF_CHAR8) {
+      continue;
+    }
+    const double *kept = other + field_idx * layout->num_values;
+    field_stats delta;
+    reduce_field(&delta, later ? fields[field_idx] : kept, NULL, later ? kept : fields[field_idx], layout);
+    stats[field_idx].prev_delta = delta.prev_delta;
+  }
+  free(other);
+  free(copy);
 }
 
-void sort_field(double *field, const int32_t *ids, const int32_t num_cells) {
-  double *tmp = malloc(num_cells * sizeof(double));
-  memcpy(tmp, field, num_cells * sizeof(double));
-  for (int32_t idx = 0; idx < num_cells; ++idx) {
-    field[ids[idx]] = tmp[idx];
+// Records the outcome of a step and reports completed steps in order; called with the lock of the queue held
+void finish_step(job_queue *queue, long it, bool ok) {
+  const app_config *cfg = queue->cfg;
+  pthread_cond_broadcast(&queue->changed);
+  if (!ok) {
+    if (it < queue->failed_id) {
+      queue->failed_id = it;
+    }
+    if (queue->watcher) {
+      cancel_watcher(queue->watcher);
+    }
+    return;
+  }
+  queue->done[it - cfg->id_start] = true;
+  while (queue->report_id < queue->failed_id && queue->report_id <= cfg->id_end &&
+         queue->done[queue->report_id - cfg->id_start]) {
+    printf("  Converted file '%s/%s.%0*ld.SUM'\n", cfg->sum_dir, cfg->sim_name, queue->nd, queue->report_id);
+    queue->report_id++;
   }
-  free(tmp);
+  fflush(stdout);
 }
 
-bool convert_sum_file(const char *sum_file_path, const char *out_file_path, const int32_t num_cells) {
-  mf_sum_file_t *sum;
-  if (mf_open_sum_file(&sum, sum_file_path) != MF_OK) {
-    return false;
+// Writes a step and adds the time spent and bytes written to its statistics, if they are collected
+bool timed_write(output_sink *sink, step_output *step, char *out_file_path, step_stats *stats) {
+  double start = monotonic_seconds();
+  int64_t size = step->size;
+  bool ok = write_step(sink, step, out_file_path);
+  if (stats) {
+    stats->write_seconds += monotonic_seconds() - start;
+    stats->output_bytes += ok ? size : 0;
   }
+  return ok;
+}
 
-  mf_sum_description_t *desc = mf_get_sum_description(sum);
+double monotonic_seconds(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec + 1e-9 * now.tv_nsec;
+}
 
-  if (desc->celldata == NULL) {
-    fprintf(stderr, "Error: CELLDATA is missing\n");
-    mf_close_sum_file(sum);
-    return false;
+void start_writer(step_writer *writer, job_queue *queue) {
+  const app_config *cfg = queue->cfg;
+  memset(writer, 0, sizeof(step_writer));
+  writer->queue = queue;
+  // 1 for '/', 1 for '.', 4 for '.dat', 1 for '\0'
+  writer->out_file_path = malloc(strlen(cfg->out_dir) + 1 + strlen(cfg->sim_name) + 1 + queue->nd + 4 + 1);
+  pthread_mutex_init(&writer->lock, NULL);
+  pthread_cond_init(&writer->changed, NULL);
+  // Without the thread steps are written by the worker itself
+  writer->running = pthread_create(&writer->thread, NULL, write_worker, writer) == 0;
+}
+
+void hand_over_step(step_writer *writer, const step_output *step) {
+  if (!writer->running) {
+    job_queue *queue = writer->queue;
+    step_output own_step = *step;
+    bool ok = timed_write(queue->sink, &own_step, writer->out_file_path,
+                          queue->stats ? &queue->stats[step->it - queue->cfg->id_start] : NULL);
+    pthread_mutex_lock(&queue->lock);
+    finish_step(queue, step->it, ok);
+    pthread_mutex_unlock(&queue->lock);
+    return;
+  }
+  pthread_mutex_lock(&writer->lock);
+  while (writer->busy) {
+    pthread_cond_wait(&writer->changed, &writer->lock);
+  }
+  writer->step = *step;
+  writer->busy = true;
+  pthread_cond_broadcast(&writer->changed);
+  pthread_mutex_unlock(&writer->lock);
+}
+
+void stop_writer(step_writer *writer) {
+  if (writer->running) {
+    pthread_mutex_lock(&writer->lock);
+    writer->closing = true;
+    pthread_cond_broadcast(&writer->changed);
+    pthread_mutex_unlock(&writer->lock);
+    pthread_join(writer->thread, NULL);
   }
+  pthread_cond_destroy(&writer->changed);
+  pthread_mutex_destroy(&writer->lock);
+  free(writer->out_file_path);
+}
 
-  int32_t file_num_cells = desc->celldata->num_objects;
+void *write_worker(void *arg) {
+  step_writer *writer = arg;
+  job_queue *queue = writer->queue;
+  pthread_mutex_lock(&writer->lock);
+  while (true) {
+    while (!writer->busy && !writer->closing) {
+      pthread_cond_wait(&writer->changed, &writer->lock);
+    }
+    // The last step is written before closing
+    if (!writer->busy) {
+      break;
+    }
+    pthread_mutex_unlock(&writer->lock);
+
+    bool ok = timed_write(queue->sink, &writer->step, writer->out_file_path,
+                          queue->stats ? &queue->stats[writer->step.it - queue->cfg->id_start] : NULL);
+    pthread_mutex_lock(&queue->lock);
+    finish_step(queue, writer->step.it, ok);
+    pthread_mutex_unlock(&queue->lock);
+
+    pthread_mutex_lock(&writer->lock);
+    writer->busy = false;
+    pthread_cond_broadcast(&writer->changed);
+  }
+  pthread_mutex_unlock(&writer->lock);
+  return NULL;
+}
 
-  int32_t *cell_id = malloc(file_num_cells * sizeof(int32_t));
-  double *pressure = malloc(file_num_cells * sizeof(double));
-  double *temperature = malloc(file_num_cells * sizeof(double));
+// Asks the kernel to start reading a file in the background, so that it is already cached when it is opened. Files
+// that do not exist yet are ignored
+void prefetch_file(const char *path) {
+#ifdef POSIX_FADV_WILLNEED
+  int fd = open(path, O_RDONLY);
+  if (fd >= 0) {
+    posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+    close(fd);
+  }
+#else
+  (void)path;
+#endif
+}
 
-  mf_sum_block_query_t celldata_query;
-  char celldata_names[][9] = {"CELLID  ", "PRES    ", "TEMP    "};
+void init_worker_state(worker_state *state, const app_config *cfg, const property_query *query, int nd) {
+  memset(state, 0, sizeof(worker_state));
+  state->raw = calloc(2 * query->num_items, sizeof(char *));
+  state->out = calloc(query->num_fields, sizeof(double *));
+  state->spare = calloc(query->num_fields, sizeof(double *));
+  state->prev = calloc(query->num_fields, sizeof(double *));
+  state->base = calloc(query->num_fields, sizeof(double *));
+  state->encode = cfg->compress != COMPRESS_NONE;
+  state->keep_previous = cfg->compress == COMPRESS_PREV || cfg->field_stats_path;
+  state->base_id = -1;
+  state->prev_id = -1;
+  // 1 for '/', 1 for '.', 4 for '.SUM' or '.dat', 1 for '\0'
+  state->sum_file_path = malloc(strlen(cfg->sum_dir) + 1 + strlen(cfg->sim_name) + 1 + nd + 4 + 1);
+  state->next_file_path = malloc(strlen(cfg->sum_dir) + 1 + strlen(cfg->sim_name) + 1 + nd + 4 + 1);
+  state->out_file_path = malloc(strlen(cfg->out_dir) + 1 + strlen(cfg->sim_name) + 1 + nd + 4 + 1);
+  // 5 for '.conn'
+  state->conn_file_path =
+      cfg->conn_props ? malloc(strlen(cfg->out_dir) + 1 + strlen(cfg->sim_name) + 1 + nd + 5 + 1) : NULL;
+  state->num_items = query->num_items;
+  state->num_fields = query->num_fields;
+}
 
-  celldata_query.names = celldata_names;
-  celldata_query.num_items = 3;
+void free_worker_state(worker_state *state) {
+  free(state->conn_file_path);
+  free(state->out_file_path);
+  free(state->next_file_path);
+  free(state->sum_file_path);
+  for (int buf_idx = 0; buf_idx < 2 * state->num_items; ++buf_idx) {
+    free(state->raw[buf_idx]);
+  }
+  for (int field_idx = 0; field_idx < state->num_fields; ++field_idx) {
+    free(state->out[field_idx]);
+    free(state->spare[field_idx]);
+    free(state->prev[field_idx]);
+  }
+  free(state->raw);
+  free(state->out);
+  free(state->spare);
+  free(state->prev);
+  free(state->base);
+  free(state->encoded);
+  free(state->local_perm.dst);
+}
 
-  mf_data_t celldata_destinations[] = {
-      {.bytes = cell_id, .stride = sizeof(int32_t), .count = file_num_cells},
-      {.bytes = pressure, .stride = sizeof(double), .count = file_num_cells},
-      {.bytes = temperature, .stride = sizeof(double), .count = file_num_cells},
-  };
+#ifdef HAVE_INOTIFY
+static void *watch_directory(void *arg) {
+  dir_watcher *watcher = arg;
+  // Large enough for a batch of events with file names of NAME_MAX characters
+  char buf[16 * (sizeof(struct inotify_event) + 256)];
+  while (true) {
+    ssize_t len = read(watcher->fd, buf, sizeof(buf));
+    if (len < 0 && errno == EINTR) {
+      continue;
+    }
+    if (len <= 0) {
+      break;
+    }
+    bool ignored = false;
+    for (char *pos = buf; pos < buf + len;) {
+      const struct inotify_event *event = (const struct inotify_event *)pos;
+      ignored |= (event->mask & IN_IGNORED) != 0;
+      pos += sizeof(struct inotify_event) + event->len;
+    }
+    pthread_mutex_lock(&watcher->lock);
+    watcher->generation++;
+    pthread_cond_broadcast(&watcher->changed);
+    pthread_mutex_unlock(&watcher->lock);
+    // The watch is removed by stop_watcher, or the directory itself is gone
+    if (ignored) {
+      break;
+    }
+  }
+  return NULL;
+}
+#endif
 
-  mf_sum_attachment_t sum_attachment = {0};
-  sum_attachment.celldata = celldata_destinations;
+void start_watcher(dir_watcher *watcher, const char *dir) {
+  pthread_mutex_init(&watcher->lock, NULL);
+  pthread_cond_init(&watcher->changed, NULL);
+  watcher->generation = 0;
+  watcher->cancelled = false;
+  watcher->fd = watcher->wd = -1;
+#ifdef HAVE_INOTIFY
+  watcher->fd = inotify_init();
+  if (watcher->fd >= 0) {
+    watcher->wd = inotify_add_watch(watcher->fd, dir, IN_CLOSE_WRITE | IN_MOVED_TO);
+  }
+  if (watcher->wd >= 0 && pthread_create(&watcher->thread, NULL, watch_directory, watcher) == 0) {
+    return;
+  }
+  if (watcher->wd >= 0) {
+    inotify_rm_watch(watcher->fd, watcher->wd);
+    watcher->wd = -1;
+  }
+  if (watcher->fd >= 0) {
+    close(watcher->fd);
+    watcher->fd = -1;
+  }
+#endif
+  fprintf(stderr, "Warning: failed to watch directory '%s', polling it every second\n", dir);
+}
 
-  mf_sum_read_request_t sum_request = {0};
-  sum_request.celldata = &celldata_query;
+void stop_watcher(dir_watcher *watcher) {
+#ifdef HAVE_INOTIFY
+  if (watcher->wd >= 0) {
+    // Removing the watch queues IN_IGNORED, which wakes up and terminates the watching thread
+    inotify_rm_watch(watcher->fd, watcher->wd);
+    pthread_join(watcher->thread, NULL);
+    close(watcher->fd);
+  }
+#endif
+  pthread_cond_destroy(&watcher->changed);
+  pthread_mutex_destroy(&watcher->lock);
+}
 
-  if (mf_read_sum_file(sum, &sum_request, &sum_attachment) != MF_OK) {
-    mf_close_sum_file(sum);
-    free(cell_id);
-    free(pressure);
-    free(temperature);
+void cancel_watcher(dir_watcher *watcher) {
+  pthread_mutex_lock(&watcher->lock);
+  watcher->cancelled = true;
+  pthread_cond_broadcast(&watcher->changed);
+  pthread_mutex_unlock(&watcher->lock);
+}
+
+bool wait_for_sum_file(dir_watcher *watcher, const char *sum_file_path) {
+  pthread_mutex_lock(&watcher->lock);
+  while (!watcher->cancelled) {
+    uint64_t generation = watcher->generation;
+    pthread_mutex_unlock(&watcher->lock);
+    if (mf_probe_sum_file(sum_file_path) == MF_OK) {
+      return true;
+    }
+
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += 1;
+    pthread_mutex_lock(&watcher->lock);
+    while (!watcher->cancelled && watcher->generation == generation) {
+      if (pthread_cond_timedwait(&watcher->changed, &watcher->lock, &deadline) == ETIMEDOUT) {
+        break;
+      }
+    }
+  }
+  pthread_mutex_unlock(&watcher->lock);
+  return false;
+}
+
+bool read_num_cells(const char *mvs_file_path, int32_t *num_cells) {
+  mf_mvs_file_t *mvs;
+  if (mf_open_mvs_file(&mvs, mvs_file_path) != MF_OK) {
     return false;
   }
 
-  mf_close_sum_file(sum);
+  mf_mvs_description_t *desc = mf_get_mvs_description(mvs);
+  *num_cells = desc->num_cells;
 
-  for (int32_t idx = 0; idx < file_num_cells; ++idx) {
-    cell_id[idx]--;
-  }
+  mf_close_mvs_file(mvs);
+  return true;
+}
 
-  remap_ids(cell_id, file_num_cells);
-  sort_field(pressure, cell_id, file_num_cells);
-  sort_field(temperature, cell_id, file_num_cells);
+bool read_first_file(const char *sum_file_path, const app_config *cfg, property_query *query,
+                     mf_sum_decode_plan_t **plan, int32_t **cell_id, int32_t *num_cells) {
+  mf_sum_file_t *sum;
+  if (mf_open_sum_file(&sum, sum_file_path) != MF_OK) {
+    return false;
+  }
 
-  // Convert pressure to Pa
-  for (int32_t idx = 0; idx < file_num_cells; ++idx) {
-    pressure[idx] *= 1e5;
+  mf_sum_description_t *desc = mf_get_sum_description(sum);
+  if (desc->celldata == NULL) {
+    fprintf(stderr, "Error: CELLDATA is missing\n");
+    mf_close_sum_file(sum);
+    return false;
   }
 
-  FILE *fid = fopen(out_file_path, "wb");
-  if (fid == NULL) {
-    printf("Failed to open file %s\n", out_file_path);
-    perror("System error");
-    free(cell_id);
-    free(pressure);
-    free(temperature);
+  if (!build_query(cfg, desc->celldata, query)) {
+    mf_close_sum_file(sum);
+    free_query(query);
+    return false;
+  }
+  if (cfg->conn_props && desc->conndata == NULL) {
+    fprintf(stderr, "Error: CONNDATA is missing\n");
+    mf_close_sum_file(sum);
+    free_query(query);
     return false;
   }
 
-  fwrite(pressure, sizeof(double), num_cells, fid);
-  fwrite(temperature, sizeof(double), num_cells, fid);
-  fclose(fid);
+  *num_cells = desc->celldata->num_objects;
+  *cell_id = malloc(*num_cells * sizeof(int32_t));
 
-  free(cell_id);
-  free(pressure);
-  free(temperature);
+  char celldata_names[][9] = {"CELLID  "};
+  mf_sum_block_query_t celldata_query = {.names = celldata_names, .num_items = 1};
+  mf_data_t celldata_destination = {.bytes = *cell_id, .stride = sizeof(int32_t), .count = *num_cells};
+
+  mf_sum_attachment_t sum_attachment = {0};
+  sum_attachment.celldata = &celldata_destination;
+  mf_sum_read_request_t sum_request = {0};
+  sum_request.celldata = &celldata_query;
+
+  mf_status_t err = mf_read_sum_file(sum, &sum_request, &sum_attachment);
+  if (err == MF_OK) {
+    // Every later file is decoded with the plan compiled here
+    mf_sum_block_query_t plan_query = {.names = query->names, .num_items = query->num_items};
+    mf_sum_read_request_t plan_request = {.celldata = &plan_query};
+    err = mf_compile_sum_plan(plan, sum, &plan_request);
+  }
+  mf_close_sum_file(sum);
+  if (err != MF_OK) {
+    free(*cell_id);
+    free_query(query);
+    return false;
+  }
+  return true;
+}
+
+static const mf_property_t *find_property(const mf_arrays_t *celldata, const char *name) {
+  for (int32_t prop_idx = 0; prop_idx < celldata->num_properties; ++prop_idx) {
+    if (!memcmp(celldata->properties[prop_idx].name, name, 8)) {
+      return &celldata->properties[prop_idx];
+    }
+  }
+  return NULL;
+}
+
+bool build_query(const app_config *cfg, const mf_arrays_t *celldata, property_query *query) {
+  // Upper bounds: every comma separates two names, every name gives at most 2 components of num_phases phases
+  int max_names = 1;
+  for (const char *pos = cfg->props; *pos; ++pos) {
+    max_names += *pos == ',';
+  }
+  query->names = calloc(max_names + 2, sizeof(*query->names));
+  query->items = calloc(max_names + 2, sizeof(query_item));
+  query->fields = calloc(2 * cfg->num_phases * max_names, sizeof(field_spec));
+  query->num_items = query->num_fields = 0;
+  query->phst_item = -1;
+
+  if (!add_query_item(query, celldata, "CELLID  ", 1)) {
+    return false;
+  }
+  if (query->items[0].data_type != MF_INT4 || query->items[0].output_mode != MF_SINGLE) {
+    fprintf(stderr, "Error: CELLID must be a single 4-byte integer\n");
+    return false;
+  }
+
+  bool need_phst = false;
+  for (const char *pos = cfg->props; *pos;) {
+    size_t len = strcspn(pos, ",");
+    if (len == 0 || len > 8) {
+      fprintf(stderr, "Error: invalid property name '%.*s'\n", (int)len, pos);
+      return false;
+    }
+    char name[9];
+    memset(name, ' ', 8);
+    memcpy(name, pos, len);
+    name[8] = '\0';
+    pos += len + (pos[len] == ',');
+
+    for (int field_idx = 0; field_idx < query->num_fields; ++field_idx) {
+      if (!memcmp(query->fields[field_idx].name, name, 8)) {
+        fprintf(stderr, "Error: property '%s' is requested twice\n", name);
+        return false;
+      }
+    }
+    int item = 0;
+    while (item < query->num_items && memcmp(query->names[item], name, 8)) {
+      item++;
+    }
+    if (item == query->num_items && !add_query_item(query, celldata, name, (int)cfg->num_phases)) {
+      return false;
+    }
+
+    const query_item *qi = &query->items[item];
+    const mf_property_t *prop = find_property(celldata, name);
+    need_phst |= qi->phase_state == MF_STATE1;
+    int num_components = qi->output_mode == MF_DOUBLE ? 2 : 1;
+    for (int phase = 0; phase < qi->num_phases; ++phase) {
+      for (int component = 0; component < num_components; ++component) {
+        field_spec *field = &query->fields[query->num_fields++];
+        memcpy(field->name, name, 9);
+        memcpy(field->unit, prop->dimension, 9);
+        field->scale = 1.0;
+        field->item = item;
+        field->component = component;
+        field->phase = qi->phase_state == MF_STATE1 ? phase : -1;
+        // Pressure is converted to Pa
+        if (!strcmp(name, "PRES    ")) {
+          memcpy(field->unit, "PA      ", 9);
+          field->scale = 1e5;
+        }
+      }
+    }
+  }
+  if (query->num_fields == 0) {
+    fprintf(stderr, "Error: no properties requested\n");
+    return false;
+  }
+
+  if (need_phst) {
+    int item = 0;
+    while (item < query->num_items && memcmp(query->names[item], "PHST    ", 8)) {
+      item++;
+    }
+    if (item == query->num_items && !add_query_item(query, celldata, "PHST    ", 1)) {
+      return false;
+    }
+    if (query->items[item].data_type != MF_INT1 || query->items[item].phase_state != MF_STATE0) {
+      fprintf(stderr, "Error: PHST must be a single 1-byte integer\n");
+      return false;
+    }
+    query->phst_item = item;
+  }
+  return !cfg->conn_props || build_conn_names(cfg, query);
+}
+
+// An empty list of CONNDATA properties gives graphs without values
+bool build_conn_names(const app_config *cfg, property_query *query) {
+  int max_names = 2;
+  for (const char *pos = cfg->conn_props; *pos; ++pos) {
+    max_names += *pos == ',';
+  }
+  query->conn_names = calloc(max_names, sizeof(*query->conn_names));
+  query->num_conn_values = 0;
+
+  const char *pos = cfg->conn_ids;
+  for (int name_idx = 0; *pos || name_idx == 0; ++name_idx) {
+    size_t len = strcspn(pos, ",");
+    if (len == 0 || len > 8 || (name_idx == 0 && pos[len] == ',')) {
+      fprintf(stderr, "Error: invalid CONNDATA property name '%.*s'\n", (int)(name_idx == 0 ? strlen(pos) : len), pos);
+      return false;
+    }
+    char *name = query->conn_names[name_idx];
+    memset(name, ' ', 8);
+    memcpy(name, pos, len);
+    name[8] = '\0';
+    pos = name_idx == 0 ? cfg->conn_props : pos + len + (pos[len] == ',');
+
+    for (int prev_idx = 0; prev_idx < name_idx; ++prev_idx) {
+      if (!memcmp(query->conn_names[prev_idx], name, 8)) {
+        fprintf(stderr, "Error: CONNDATA property '%s' is requested twice\n", name);
+        return false;
+      }
+    }
+    query->num_conn_values = name_idx;
+  }
+  return true;
+}
+
+bool add_query_item(property_query *query, const mf_arrays_t *celldata, const char *name, int num_phases) {
+  const mf_property_t *prop = find_property(celldata, name);
+  if (!prop) {
+    fprintf(stderr, "Error: file doesn't contain property '%s'\n", name);
+    return false;
+  }
+  query_item *item = &query->items[query->num_items];
+  memcpy(query->names[query->num_items], name, 9);
+  item->data_type = prop->data_type;
+  item->output_mode = prop->output_mode;
+  item->phase_state = prop->phase_state;
+  switch (prop->data_type) {
+  case MF_INT1:
+    item->element_size = 1;
+    break;
+  case MF_INT2:
+    item->element_size = 2;
+    break;
+  case MF_INT4:
+  case MF_REAL4:
+  case MF_CHAR4:
+    item->element_size = 4;
+    break;
+  case MF_REAL8:
+  case MF_CHAR8:
+    item->element_size = 8;
+    break;
+  }
+  item->num_phases = prop->phase_state == MF_STATE1 ? num_phases : 1;
+  query->num_items++;
+  return true;
+}
+
+// Buffers are sized by the first file, so later files must declare the same types
+bool check_query(const property_query *query, const mf_arrays_t *celldata) {
+  for (int item_idx = 0; item_idx < query->num_items; ++item_idx) {
+    const query_item *item = &query->items[item_idx];
+    const mf_property_t *prop = find_property(celldata, query->names[item_idx]);
+    if (prop && (prop->data_type != item->data_type || prop->output_mode != item->output_mode ||
+                 prop->phase_state != item->phase_state)) {
+      fprintf(stderr, "Error: property '%s' differs in type from the first file\n", query->names[item_idx]);
+      return false;
+    }
+  }
+  return true;
+}
+
+void free_query(property_query *query) {
+  free(query->names);
+  free(query->items);
+  free(query->fields);
+  free(query->conn_names);
+  query->names = NULL;
+  query->items = NULL;
+  query->fields = NULL;
+  query->conn_names = NULL;
+}
+
+// FNV-1a over the CELLID column
+uint64_t hash_ids(const int32_t *ids, int32_t num_cells) {
+  uint64_t hash = 14695981039346656037ull;
+  for (int32_t idx = 0; idx < num_cells; ++idx) {
+    hash = (hash ^ (uint32_t)ids[idx]) * 1099511628211ull;
+  }
+  return hash;
+}
+
+bool build_permutation(const int32_t *ids, int32_t num_cells, const output_layout *layout,
+                       cell_permutation *perm) {
+  if (num_cells > perm->num_cells || !perm->dst) {
+    free(perm->dst);
+    perm->dst = malloc((num_cells + 1) * sizeof(int32_t));
+    if (!perm->dst) {
+      fprintf(stderr, "Error: failed to allocate permutation of %d cells\n", num_cells);
+      perm->num_cells = 0;
+      return false;
+    }
+  }
+  perm->num_cells = num_cells;
+  perm->hash = hash_ids(ids, num_cells);
+  if (num_cells <= 0) {
+    return true;
+  }
+
+  int32_t min_id = ids[0];
+  int32_t max_id = ids[0];
+  for (int32_t idx = 1; idx < num_cells; ++idx) {
+    min_id = ids[idx] < min_id ? ids[idx] : min_id;
+    max_id = ids[idx] > max_id ? ids[idx] : max_id;
+  }
+
+  // Cell IDs are normally dense, then ranks come from a prefix sum over the range of IDs; sparse IDs fall back to
+  // sorting
+  int64_t range = (int64_t)max_id - min_id + 1;
+  if (range > 4 * (int64_t)num_cells) {
+    if (!remap_ids(ids, perm->dst, num_cells)) {
+      return false;
+    }
+    for (int32_t idx = 0; idx < num_cells; ++idx) {
+      perm->dst[idx] = (int32_t)output_index(layout, perm->dst[idx]);
+    }
+    return true;
+  }
+
+  int32_t *rank = calloc(range, sizeof(int32_t));
+  if (!rank) {
+    fprintf(stderr, "Error: failed to allocate ranks of %lld cell IDs\n", (long long)range);
+    return false;
+  }
+  for (int32_t idx = 0; idx < num_cells; ++idx) {
+    if (rank[ids[idx] - min_id]) {
+      fprintf(stderr, "Error: cell ID %d occurs more than once\n", ids[idx]);
+      free(rank);
+      return false;
+    }
+    rank[ids[idx] - min_id] = 1;
+  }
+  int32_t count = 0;
+  for (int64_t id_idx = 0; id_idx < range; ++id_idx) {
+    int32_t present = rank[id_idx];
+    rank[id_idx] = count;
+    count += present;
+  }
+  for (int32_t idx = 0; idx < num_cells; ++idx) {
+    perm->dst[idx] = (int32_t)output_index(layout, rank[ids[idx] - min_id]);
+  }
+  free(rank);
+  return true;
+}
+
+static int int32_pair_cmp(const void *v1, const void *v2) {
+  int32_t id1 = *((const int32_t *)v1);
+  int32_t id2 = *((const int32_t *)v2);
+  return (id1 > id2) - (id1 < id2);
+}
+
+bool remap_ids(const int32_t *ids, int32_t *dst, const int32_t num_cells) {
+  int32_t *sorter = malloc(2 * (size_t)num_cells * sizeof(int32_t));
+  if (!sorter) {
+    fprintf(stderr, "Error: failed to allocate sorter of %d cell IDs\n", num_cells);
+    return false;
+  }
+  for (int32_t idx = 0; idx < num_cells; ++idx) {
+    sorter[2 * idx + 0] = ids[idx];
+    sorter[2 * idx + 1] = idx;
+  }
+  qsort(sorter, num_cells, 2 * sizeof(int32_t), int32_pair_cmp);
+  for (int32_t idx = 0; idx < num_cells; ++idx) {
+    dst[sorter[2 * idx + 1]] = idx;
+  }
+  free(sorter);
+  return true;
+}
+
+int64_t output_index(const output_layout *layout, int32_t rank) {
+  if (rank >= layout->num_cells) {
+    return layout->num_values;
+  }
+  if (!layout->solver_layout) {
+    return rank;
+  }
+  int32_t r = rank % layout->nr;
+  int32_t z = layout->nz - 1 - rank / layout->nr;
+  return r + (int64_t)layout->ext_nr * (z + layout->ext_nz - layout->nz);
+}
+
+// Permutation, unit conversion and placement into the output layout in a single pass
+// Character properties are not converted, their bytes are stored in the double as they are
+#define scatter_as(type)                                                                                               \
+  do {                                                                                                                 \
+    for (int32_t idx = 0; idx < num_cells; ++idx) {                                                                    \
+      type value;                                                                                                      \
+      memcpy(&value, src + idx * stride, sizeof(type));                                                                \
+      dst[perm[idx]] = scale * (double)value;                                                                          \
+    }                                                                                                                  \
+  } while (0)
+
+void scatter_field(double *dst, const char *src, size_t stride, mf_data_type_t type, const int32_t *perm,
+                   const int32_t num_cells, const double scale) {
+  switch (type) {
+  case MF_INT1:
+    scatter_as(int8_t);
+    break;
+  case MF_INT2:
+    scatter_as(int16_t);
+    break;
+  case MF_INT4:
+    scatter_as(int32_t);
+    break;
+  case MF_REAL4:
+    scatter_as(float);
+    break;
+  case MF_REAL8:
+    scatter_as(double);
+    break;
+  case MF_CHAR4:
+  case MF_CHAR8:
+    for (int32_t idx = 0; idx < num_cells; ++idx) {
+      double value = 0.0;
+      memcpy(&value, src + idx * stride, type == MF_CHAR4 ? 4 : 8);
+      dst[perm[idx]] = value;
+    }
+    break;
+  }
+}
+
+// Cells with PHST not exceeding `phase` (which is positive) do not have it, values of PHST below one stand for a
+// single phase
+void mark_missing_phases(double *dst, const int8_t *phst, int phase, const int32_t *perm, const int32_t num_cells) {
+  for (int32_t idx = 0; idx < num_cells; ++idx) {
+    if (phst[idx] <= phase) {
+      dst[perm[idx]] = NAN;
+    }
+  }
+}
+
+// Partial results of STATS_LANES interleaved sequences of values. Lanes do not depend on each other, so the reduction
+// loop vectorizes without reordering floating-point sums
+#define STATS_LANES 4
+
+typedef struct {
+  double count[STATS_LANES];
+  double min[STATS_LANES];
+  double max[STATS_LANES];
+  double sum[STATS_LANES];
+  double sum_squares[STATS_LANES];
+  double ref_delta[STATS_LANES];
+  double prev_delta[STATS_LANES];
+} lane_stats;
+
+// NaN fails every comparison, so it never becomes a minimum, maximum or delta
+static void reduce_lane(lane_stats *acc, int lane, double value, double reference, double previous) {
+  bool valid = value == value;
+  acc->count[lane] += valid ? 1.0 : 0.0;
+  acc->sum[lane] += valid ? value : 0.0;
+  acc->sum_squares[lane] += valid ? value * value : 0.0;
+  acc->min[lane] = value < acc->min[lane] ? value : acc->min[lane];
+  acc->max[lane] = value > acc->max[lane] ? value : acc->max[lane];
+  double ref_delta = fabs(value - reference);
+  double prev_delta = fabs(value - previous);
+  acc->ref_delta[lane] = ref_delta > acc->ref_delta[lane] ? ref_delta : acc->ref_delta[lane];
+  acc->prev_delta[lane] = prev_delta > acc->prev_delta[lane] ? prev_delta : acc->prev_delta[lane];
+}
+
+static void reduce_run(lane_stats *acc, const double *values, const double *reference, const double *previous,
+                       int64_t count) {
+  int64_t idx = 0;
+  for (; idx + STATS_LANES <= count; idx += STATS_LANES) {
+    for (int lane = 0; lane < STATS_LANES; ++lane) {
+      reduce_lane(acc, lane, values[idx + lane], reference[idx + lane], previous[idx + lane]);
+    }
+  }
+  for (; idx < count; ++idx) {
+    reduce_lane(acc, 0, values[idx], reference[idx], previous[idx]);
+  }
+}
+
+// Reduces the cells of the MUFITS grid: the first num_cells values, or in solver layout nr values of each of the
+// last nz columns. A field without reference or previous step is compared with itself and the delta is dropped
+void reduce_field(field_stats *stats, const double *values, const double *reference, const double *previous,
+                  const output_layout *layout) {
+  lane_stats acc = {0};
+  for (int lane = 0; lane < STATS_LANES; ++lane) {
+    acc.min[lane] = INFINITY;
+    acc.max[lane] = -INFINITY;
+  }
+  const double *ref = reference ? reference : values;
+  const double *prev = previous ? previous : values;
+  if (!layout->solver_layout) {
+    reduce_run(&acc, values, ref, prev, layout->num_cells);
+  } else {
+    for (int64_t z = layout->ext_nz - layout->nz; z < layout->ext_nz; ++z) {
+      int64_t offset = z * layout->ext_nr;
+      reduce_run(&acc, values + offset, ref + offset, prev + offset, layout->nr);
+    }
+  }
+
+  stats->count = 0;
+  stats->min = INFINITY;
+  stats->max = -INFINITY;
+  stats->sum = stats->sum_squares = stats->ref_delta = stats->prev_delta = 0.0;
+  for (int lane = 0; lane < STATS_LANES; ++lane) {
+    stats->count += (int64_t)acc.count[lane];
+    stats->min = acc.min[lane] < stats->min ? acc.min[lane] : stats->min;
+    stats->max = acc.max[lane] > stats->max ? acc.max[lane] : stats->max;
+    stats->sum += acc.sum[lane];
+    stats->sum_squares += acc.sum_squares[lane];
+    stats->ref_delta = acc.ref_delta[lane] > stats->ref_delta ? acc.ref_delta[lane] : stats->ref_delta;
+    stats->prev_delta = acc.prev_delta[lane] > stats->prev_delta ? acc.prev_delta[lane] : stats->prev_delta;
+  }
+  if (!reference) {
+    stats->ref_delta = NAN;
+  }
+  if (!previous) {
+    stats->prev_delta = NAN;
+  }
+}
+
+bool reserve_buffers(worker_state *state, const property_query *query, int32_t num_cells, int64_t num_values) {
+  // Output fields are allocated once: cells outside of the MUFITS grid are never written and stay zero
+  if (!state->out[0]) {
+    bool ok = true;
+    for (int field_idx = 0; field_idx < query->num_fields; ++field_idx) {
+      // One extra slot receives records which do not belong to the grid
+      state->out[field_idx] = calloc(num_values + 1, sizeof(double));
+      ok &= state->out[field_idx] != NULL;
+      if (state->keep_previous) {
+        state->prev[field_idx] = calloc(num_values + 1, sizeof(double));
+        ok &= state->prev[field_idx] != NULL;
+      }
+      if (!state->encode && !state->keep_previous) {
+        state->spare[field_idx] = calloc(num_values + 1, sizeof(double));
+        ok &= state->spare[field_idx] != NULL;
+      }
+    }
+    if (state->encode) {
+      // All fields of a step are encoded into one payload, each preceded by its size
+      state->encoded = malloc(query->num_fields * (8 + mf_field_bound(num_values)));
+      ok &= state->encoded != NULL;
+    }
+    if (!ok) {
+      fprintf(stderr, "Error: failed to allocate output buffers for %lld values\n", (long long)num_values);
+      return false;
+    }
+  }
+  if (num_cells <= state->capacity) {
+    return true;
+  }
+  bool ok = true;
+  for (int item_idx = 0; item_idx < query->num_items; ++item_idx) {
+    const query_item *item = &query->items[item_idx];
+    size_t size = (size_t)num_cells * item->element_size * item->num_phases;
+    for (int component = 0; component < (item->output_mode == MF_DOUBLE ? 2 : 1); ++component) {
+      free(state->raw[2 * item_idx + component]);
+      state->raw[2 * item_idx + component] = malloc(size);
+      ok &= state->raw[2 * item_idx + component] != NULL;
+    }
+  }
+  if (!ok) {
+    fprintf(stderr, "Error: failed to allocate buffers for %d cells\n", num_cells);
+    state->capacity = 0;
+    return false;
+  }
+  state->capacity = num_cells;
+  return true;
+}
+
+bool convert_sum_file(const char *sum_file_path, const property_query *query, const mf_sum_decode_plan_t *plan,
+                      output_sink *sink, const cell_permutation *perm, worker_state *state) {
+  const output_layout *layout = sink->layout;
+  mf_sum_file_t *sum;
+  if (mf_open_sum_file(&sum, sum_file_path) != MF_OK) {
+    return false;
+  }
+
+  mf_sum_description_t *desc = mf_get_sum_description(sum);
+  state->has_time = desc->time != NULL;
+  if (state->has_time) {
+    state->time = *desc->time;
+  }
+  state->has_date = desc->date != NULL;
+  if (state->has_date) {
+    state->date = *desc->date;
+  }
+
+  if (desc->celldata == NULL) {
+    fprintf(stderr, "Error: CELLDATA is missing\n");
+    mf_close_sum_file(sum);
+    return false;
+  }
+
+  int32_t file_num_cells = desc->celldata->num_objects;
+  if (file_num_cells < layout->num_cells) {
+    fprintf(stderr, "Error: file contains %d cells, grid has %d cells\n", file_num_cells, layout->num_cells);
+    mf_close_sum_file(sum);
+    return false;
+  }
+
+  // A file whose property descriptors differ from the first one gets a plan of its own
+  mf_sum_decode_plan_t *local_plan = NULL;
+  if (mf_check_sum_plan(plan, sum) != MF_OK) {
+    fprintf(stderr, "Warning: properties of '%s' differ from the first file\n", sum_file_path);
+    mf_sum_block_query_t plan_query = {.names = query->names, .num_items = query->num_items};
+    mf_sum_read_request_t plan_request = {.celldata = &plan_query};
+    if (!check_query(query, desc->celldata) || mf_compile_sum_plan(&local_plan, sum, &plan_request) != MF_OK) {
+      mf_close_sum_file(sum);
+      return false;
+    }
+    plan = local_plan;
+  }
+
+  if (!reserve_buffers(state, query, file_num_cells, layout->num_values)) {
+    mf_free_sum_plan(local_plan);
+    mf_close_sum_file(sum);
+    return false;
+  }
+
+  mf_data_t *celldata_destinations = malloc(query->num_items * sizeof(mf_data_t));
+  for (int item_idx = 0; item_idx < query->num_items; ++item_idx) {
+    const query_item *item = &query->items[item_idx];
+    mf_data_t *dst = &celldata_destinations[item_idx];
+    // Both buffers of a DOUBLE property are passed as an array of two pointers
+    dst->bytes = item->output_mode == MF_DOUBLE ? (void *)&state->raw[2 * item_idx] : state->raw[2 * item_idx];
+    dst->stride = (size_t)item->element_size * item->num_phases;
+    dst->count = file_num_cells;
+  }
+
+  mf_sum_attachment_t sum_attachment = {0};
+  sum_attachment.celldata = celldata_destinations;
+
+  mf_status_t err = mf_read_sum_file_with_plan(sum, plan, &sum_attachment);
+  free(celldata_destinations);
+  mf_free_sum_plan(local_plan);
+  if (err != MF_OK) {
+    mf_get_sum_file_stats(sum, &state->stats.sum);
+    mf_close_sum_file(sum);
+    return false;
+  }
+
+  double start = monotonic_seconds();
+  const int32_t *cell_id = (const int32_t *)state->raw[0];
+  if (file_num_cells != perm->num_cells || hash_ids(cell_id, file_num_cells) != perm->hash) {
+    fprintf(stderr, "Warning: cell ordering of '%s' differs from the first file\n", sum_file_path);
+    if (!build_permutation(cell_id, file_num_cells, layout, &state->local_perm)) {
+      mf_get_sum_file_stats(sum, &state->stats.sum);
+      mf_close_sum_file(sum);
+      return false;
+    }
+    perm = &state->local_perm;
+  }
+  state->stats.permute_seconds = monotonic_seconds() - start;
+
+  // CONNDATA is read only once the permutation gives the rows of all cells, reading it counts towards the file
+  bool ok = !state->conn_file_path || write_conn_file(sum, query, cell_id, file_num_cells, perm, layout, state);
+  mf_get_sum_file_stats(sum, &state->stats.sum);
+  mf_close_sum_file(sum);
+  if (!ok) {
+    return false;
+  }
+
+  double scatter_start = monotonic_seconds();
+
+  for (int field_idx = 0; field_idx < query->num_fields; ++field_idx) {
+    const field_spec *field = &query->fields[field_idx];
+    const query_item *item = &query->items[field->item];
+    size_t stride = (size_t)item->element_size * item->num_phases;
+    const char *src = state->raw[2 * field->item + field->component];
+    if (field->phase > 0) {
+      src += (size_t)field->phase * item->element_size;
+    }
+    scatter_field(state->out[field_idx], src, stride, item->data_type, perm->dst, file_num_cells, field->scale);
+    if (field->phase > 0) {
+      mark_missing_phases(state->out[field_idx], (const int8_t *)state->raw[2 * query->phst_item], field->phase,
+                          perm->dst, file_num_cells);
+    }
+    // Statistics are reduced while the field is still in cache; character properties have none
+    if (state->field_stats && item->data_type != MF_CHAR4 && item->data_type != MF_CHAR8) {
+      reduce_field(&state->field_stats[field_idx], state->out[field_idx],
+                   state->reference ? state->reference[field_idx] : NULL,
+                   state->previous ? state->previous[field_idx] : NULL, layout);
+    }
+  }
+  state->stats.scatter_seconds = monotonic_seconds() - scatter_start;
+
+  return true;
+}
+
+bool write_conn_file(mf_sum_file_t *sum, const property_query *query, const int32_t *cell_id, int32_t num_cells,
+                     const cell_permutation *perm, const output_layout *layout, worker_state *state) {
+  mf_sum_block_query_t values = {.names = query->conn_names + 1, .num_items = query->num_conn_values};
+  mf_conn_graph_t graph;
+  // Cells outside of the grid are placed past the end of the output fields and thus left out of the graph
+  if (mf_read_conn_graph(sum, query->conn_names[0], &values, cell_id, perm->dst, num_cells,
+                         (int32_t)layout->num_values, &graph) != MF_OK) {
+    return false;
+  }
+
+  FILE *fid = fopen(state->conn_file_path, "wb");
+  if (fid == NULL) {
+    fprintf(stderr, "Error: failed to open file '%s'\n", state->conn_file_path);
+    perror("System error");
+    mf_free_conn_graph(&graph);
+    return false;
+  }
+  int32_t header[4] = {CONN_VERSION, graph.num_rows, graph.num_conns, graph.num_values};
+  fwrite("MFCONN  ", 1, 8, fid);
+  fwrite(header, sizeof(int32_t), 4, fid);
+  for (int value_idx = 0; value_idx < graph.num_values; ++value_idx) {
+    fwrite(values.names[value_idx], 1, 8, fid);
+  }
+  int64_t num_entries = graph.row_offsets[graph.num_rows];
+  fwrite(graph.row_offsets, sizeof(int64_t), (size_t)graph.num_rows + 1, fid);
+  fwrite(graph.columns, sizeof(int32_t), num_entries, fid);
+  fwrite(graph.conns, sizeof(int32_t), num_entries, fid);
+  fwrite(graph.conn_rows, 2 * sizeof(int32_t), graph.num_conns, fid);
+  for (int value_idx = 0; value_idx < graph.num_values; ++value_idx) {
+    fwrite(graph.values[value_idx], sizeof(double), graph.num_conns, fid);
+  }
+  bool ok = !ferror(fid);
+  ok &= fclose(fid) == 0;
+  if (!ok) {
+    fprintf(stderr, "Error: failed to write file '%s'\n", state->conn_file_path);
+    perror("System error");
+  }
+  mf_free_conn_graph(&graph);
+  return ok;
+}
+
+static int64_t align64(int64_t offset) { return (offset + 63) & ~(int64_t)63; }
+
+static void put_bytes(char **pos, const void *src, size_t size) {
+  memcpy(*pos, src, size);
+  *pos += size;
+}
+
+// Descriptors of all fields, 32 bytes each
+static void put_fields(char *dst, const output_sink *sink) {
+  for (int field_idx = 0; field_idx < sink->num_fields; ++field_idx) {
+    char *pos = dst + 32 * field_idx;
+    put_bytes(&pos, sink->fields[field_idx].name, 8);
+    put_bytes(&pos, sink->fields[field_idx].unit, 8);
+    put_bytes(&pos, &sink->fields[field_idx].component, 4);
+    put_bytes(&pos, &sink->fields[field_idx].phase, 4);
+  }
+}
+
+bool open_sink(output_sink *sink) {
+  const app_config *cfg = sink->cfg;
+  if (cfg->format == FORMAT_DAT) {
+    return true;
+  }
+
+  // 1 for '/', 8 for '.series' or '.history', 1 for '\0'
+  char *series_file_path = malloc(strlen(cfg->out_dir) + 1 + strlen(cfg->sim_name) + 8 + 1);
+  sprintf(series_file_path, "%s/%s.%s", cfg->out_dir, cfg->sim_name,
+          cfg->format == FORMAT_HISTORY ? "history" : "series");
+  sink->series = fopen(series_file_path, "wb");
+  if (sink->series == NULL) {
+    fprintf(stderr, "Error: failed to open file '%s'\n", series_file_path);
+    perror("System error");
+    free(series_file_path);
+    return false;
+  }
+  free(series_file_path);
+  if (cfg->format == FORMAT_HISTORY) {
+    return open_history(sink);
+  }
+
+  const output_layout *layout = sink->layout;
+  int64_t num_steps = cfg->id_end - cfg->id_start + 1;
+  sink->table_offset = align64(64 + 32 * sink->num_fields);
+  sink->data_offset = align64(sink->table_offset + 64 * num_steps);
+  if (cfg->compress == COMPRESS_NONE) {
+    sink->field_stride = align64(layout->num_values * (int64_t)sizeof(double));
+    sink->step_stride = sink->num_fields * sink->field_stride;
+  } else {
+    sink->field_stride = sink->step_stride = 0;
+    sink->pending = calloc(num_steps, sizeof(char *));
+    sink->next_append = 0;
+    sink->append_offset = sink->data_offset;
+  }
+
+  char *header = calloc(sink->data_offset, 1);
+  if (!header || (cfg->compress != COMPRESS_NONE && !sink->pending)) {
+    fprintf(stderr, "Error: failed to allocate series header of %lld bytes\n", (long long)sink->data_offset);
+    fclose(sink->series);
+    free(sink->pending);
+    free(header);
+    return false;
+  }
+  char *pos = header;
+  int32_t version = cfg->compress == COMPRESS_NONE ? 1 : 2;
+  int32_t rows = layout->solver_layout ? layout->ext_nr : (int32_t)layout->num_values;
+  int32_t cols = layout->solver_layout ? layout->ext_nz : 1;
+  put_bytes(&pos, "MFSERIES", 8);
+  put_bytes(&pos, &version, 4);
+  put_bytes(&pos, &sink->num_fields, 4);
+  put_bytes(&pos, &rows, 4);
+  put_bytes(&pos, &cols, 4);
+  put_bytes(&pos, &num_steps, 8);
+  put_bytes(&pos, &sink->table_offset, 8);
+  put_bytes(&pos, &sink->data_offset, 8);
+  put_bytes(&pos, &sink->step_stride, 8);
+  put_bytes(&pos, &sink->field_stride, 8);
+  put_fields(header + 64, sink);
+  // Step ids and offsets of raw payloads are known in advance, the rest of the entry is filled in when a step is
+  // converted
+  for (int64_t step_idx = 0; step_idx < num_steps; ++step_idx) {
+    pos = header + sink->table_offset + 64 * step_idx;
+    int64_t id = cfg->id_start + step_idx;
+    int64_t offset = sink->step_stride > 0 ? sink->data_offset + step_idx * sink->step_stride : 0;
+    put_bytes(&pos, &id, 8);
+    put_bytes(&pos, &offset, 8);
+  }
+
+  fwrite(header, sink->data_offset, 1, sink->series);
+  free(header);
+  if (ferror(sink->series)) {
+    fprintf(stderr, "Error: failed to write series header\n");
+    perror("System error");
+    fclose(sink->series);
+    free(sink->pending);
+    return false;
+  }
+  pthread_mutex_init(&sink->lock, NULL);
+  return true;
+}
+
+// Steps per chunk follow from the size of a step; the time table and the number of steps written are filled in when
+// the sink is closed
+bool open_history(output_sink *sink) {
+  const app_config *cfg = sink->cfg;
+  const output_layout *layout = sink->layout;
+  int64_t num_steps = cfg->id_end - cfg->id_start + 1;
+  int64_t step_bytes = sink->num_fields * layout->num_values * (int64_t)sizeof(double);
+  sink->chunk_steps = HISTORY_CHUNK_BYTES / step_bytes;
+  if (sink->chunk_steps < 1) {
+    sink->chunk_steps = 1;
+  } else if (sink->chunk_steps > num_steps) {
+    sink->chunk_steps = num_steps;
+  }
+  sink->chunk_stride = align64(sink->chunk_steps * step_bytes);
+  sink->table_offset = align64(96 + 32 * sink->num_fields);
+  sink->data_offset = align64(sink->table_offset + 8 * num_steps);
+  sink->staging = malloc(sink->chunk_steps * step_bytes);
+  sink->times = malloc(num_steps * sizeof(double));
+  if (!sink->staging || !sink->times) {
+    fprintf(stderr, "Error: failed to allocate %lld bytes for history chunk\n",
+            (long long)(sink->chunk_steps * step_bytes));
+    fclose(sink->series);
+    free(sink->staging);
+    free(sink->times);
+    return false;
+  }
+  for (int64_t step_idx = 0; step_idx < num_steps; ++step_idx) {
+    sink->times[step_idx] = NAN;
+  }
+
+  char *header = calloc(sink->data_offset, 1);
+  if (!header) {
+    fprintf(stderr, "Error: failed to allocate history header of %lld bytes\n", (long long)sink->data_offset);
+    fclose(sink->series);
+    free(sink->staging);
+    free(sink->times);
+    return false;
+  }
+  char *pos = header;
+  int32_t version = HISTORY_VERSION;
+  int32_t rows = layout->solver_layout ? layout->ext_nr : (int32_t)layout->num_values;
+  int32_t cols = layout->solver_layout ? layout->ext_nz : 1;
+  int64_t first_id = cfg->id_start;
+  put_bytes(&pos, "MFHISTRY", 8);
+  put_bytes(&pos, &version, 4);
+  put_bytes(&pos, &sink->num_fields, 4);
+  put_bytes(&pos, &rows, 4);
+  put_bytes(&pos, &cols, 4);
+  put_bytes(&pos, &num_steps, 8);
+  put_bytes(&pos, &first_id, 8);
+  put_bytes(&pos, &sink->chunk_steps, 8);
+  put_bytes(&pos, &sink->table_offset, 8);
+  put_bytes(&pos, &sink->data_offset, 8);
+  put_bytes(&pos, &sink->chunk_stride, 8);
+  put_fields(header + 96, sink);
+  memcpy(header + sink->table_offset, sink->times, num_steps * sizeof(double));
+
+  fwrite(header, sink->data_offset, 1, sink->series);
+  free(header);
+  if (ferror(sink->series)) {
+    fprintf(stderr, "Error: failed to write history header\n");
+    perror("System error");
+    fclose(sink->series);
+    free(sink->staging);
+    free(sink->times);
+    return false;
+  }
+  pthread_mutex_init(&sink->lock, NULL);
+  return true;
+}
+
+// Builds the table entry of a step and, with --compress, encodes its fields; runs on the worker
+bool prepare_step(output_sink *sink, long it, const double *const *values, worker_state *state,
+                  step_output *step) {
+  const app_config *cfg = sink->cfg;
+  const output_layout *layout = sink->layout;
+  step->it = it;
+  step->values = values;
+  step->time = state->has_time ? state->time : (mf_time_t){.value = NAN};
+  step->record = NULL;
+  step->size = sink->num_fields * layout->num_values * (int64_t)sizeof(double);
+  if (cfg->format != FORMAT_SERIES) {
+    return true;
+  }
+
+  char entry[64] = {0};
+  char *pos = entry + 16;
+  int32_t flags = 1;
+  mf_time_t time = {0};
+  mf_date_t date = {0};
+  if (state->has_time) {
+    time = state->time;
+    flags |= 2;
+  }
+  if (state->has_date) {
+    date = state->date;
+    flags |= 4;
+  }
+  put_bytes(&pos, &time.value, 8);
+  put_bytes(&pos, time.dimension, 8);
+  put_bytes(&pos, &date.day, 4);
+  put_bytes(&pos, date.month, 8);
+  put_bytes(&pos, &date.year, 4);
+  put_bytes(&pos, &flags, 4);
+
+  int32_t base_idx = state->base_id >= 0 ? (int32_t)(state->base_id - cfg->id_start) : -1;
+  put_bytes(&pos, &base_idx, 4);
+
+  int64_t payload_size = 0;
+  if (cfg->compress != COMPRESS_NONE) {
+    // Fields are encoded by the workers; payloads are appended in step order, so that the file does not depend on
+    // the number of workers
+    double start = monotonic_seconds();
+    for (int field_idx = 0; field_idx < sink->num_fields; ++field_idx) {
+      const double *base = state->base_id >= 0 ? state->base[field_idx] : NULL;
+      int64_t size = mf_encode_field(values[field_idx], base, layout->num_values, state->encoded + payload_size + 8);
+      memcpy(state->encoded + payload_size, &size, 8);
+      payload_size += 8 + size;
+    }
+    state->stats.encode_seconds = monotonic_seconds() - start;
+    step->size = 64 + payload_size;
+    put_bytes(&pos, &payload_size, 8);
+    int64_t id = it;
+    memcpy(entry, &id, 8);
+  } else {
+    put_bytes(&pos, &sink->step_stride, 8);
+    step->size += 48;
+  }
+
+  step->record = malloc(64 + payload_size);
+  if (!step->record) {
+    fprintf(stderr, "Error: failed to allocate %lld bytes for time step %ld\n", (long long)payload_size, it);
+    return false;
+  }
+  memcpy(step->record, entry, 64);
+  if (payload_size > 0) {
+    memcpy(step->record + 64, state->encoded, payload_size);
+  }
+  return true;
+}
+
+// Writes a prepared step and releases its record; runs on the writer thread of the worker
+bool write_step(output_sink *sink, step_output *step, char *out_file_path) {
+  const app_config *cfg = sink->cfg;
+  const output_layout *layout = sink->layout;
+
+  if (cfg->format == FORMAT_DAT) {
+    sprintf(out_file_path, "%s/%s.%0*ld.dat", cfg->out_dir, cfg->sim_name, sink->nd, step->it);
+    FILE *fid = fopen(out_file_path, "wb");
+    if (fid == NULL) {
+      printf("Failed to open file %s\n", out_file_path);
+      perror("System error");
+      return false;
+    }
+    for (int field_idx = 0; field_idx < sink->num_fields; ++field_idx) {
+      fwrite(step->values[field_idx], sizeof(double), layout->num_values, fid);
+    }
+    fclose(fid);
+    return true;
+  }
+  if (cfg->format == FORMAT_HISTORY) {
+    return stage_history_step(sink, step);
+  }
+
+  int64_t step_idx = step->it - cfg->id_start;
+  bool ok = true;
+  pthread_mutex_lock(&sink->lock);
+  if (cfg->compress != COMPRESS_NONE) {
+    sink->pending[step_idx] = step->record;
+    ok = flush_pending(sink);
+  } else {
+    for (int field_idx = 0; field_idx < sink->num_fields; ++field_idx) {
+      // Gaps between fields are left as holes and read back as zeros
+      fseeko(sink->series, (off_t)(sink->data_offset + step_idx * sink->step_stride + field_idx * sink->field_stride),
+             SEEK_SET);
+      fwrite(step->values[field_idx], sizeof(double), layout->num_values, sink->series);
+    }
+    fseeko(sink->series, (off_t)(sink->table_offset + 64 * step_idx + 16), SEEK_SET);
+    fwrite(step->record + 16, 48, 1, sink->series);
+    ok = !ferror(sink->series);
+    free(step->record);
+  }
+  pthread_mutex_unlock(&sink->lock);
+  step->record = NULL;
+  if (!ok) {
+    fprintf(stderr, "Error: failed to write time step %ld to series\n", step->it);
+    perror("System error");
+  }
+  return ok;
+}
+
+// Appends pending steps that directly follow the ones already in the file and fills in their table entries
+bool flush_pending(output_sink *sink) {
+  int64_t num_steps = sink->cfg->id_end - sink->cfg->id_start + 1;
+  while (sink->next_append < num_steps && sink->pending[sink->next_append]) {
+    char *pending = sink->pending[sink->next_append];
+    int64_t payload_size;
+    memcpy(pending + 8, &sink->append_offset, 8);
+    memcpy(&payload_size, pending + 56, 8);
+    fseeko(sink->series, (off_t)(sink->table_offset + 64 * sink->next_append), SEEK_SET);
+    fwrite(pending, 64, 1, sink->series);
+    fseeko(sink->series, (off_t)sink->append_offset, SEEK_SET);
+    fwrite(pending + 64, payload_size, 1, sink->series);
+    free(pending);
+    sink->pending[sink->next_append++] = NULL;
+    sink->append_offset += payload_size;
+    if (ferror(sink->series)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Only steps of the chunk being assembled are converted, each into a slot of its own, so fields are copied without
+// the lock; the step completing the chunk writes it
+bool stage_history_step(output_sink *sink, const step_output *step) {
+  const app_config *cfg = sink->cfg;
+  int64_t num_values = sink->layout->num_values;
+  int64_t num_steps = cfg->id_end - cfg->id_start + 1;
+  int64_t step_idx = step->it - cfg->id_start;
+  int64_t slot = step_idx % sink->chunk_steps;
+  double *dst = sink->staging + slot * sink->num_fields * num_values;
+  for (int field_idx = 0; field_idx < sink->num_fields; ++field_idx) {
+    memcpy(dst + field_idx * num_values, step->values[field_idx], num_values * sizeof(double));
+  }
+
+  bool ok = true;
+  pthread_mutex_lock(&sink->lock);
+  sink->times[step_idx] = step->time.value;
+  if (!sink->time_unit[0] && !isnan(step->time.value)) {
+    memcpy(sink->time_unit, step->time.dimension, 8);
+  }
+  int64_t first_idx = step_idx - slot;
+  int64_t count = num_steps - first_idx < sink->chunk_steps ? num_steps - first_idx : sink->chunk_steps;
+  if (++sink->num_staged == count) {
+    ok = write_history_chunk(sink, first_idx, count);
+    sink->num_staged = 0;
+    if (ok) {
+      sink->steps_written = first_idx + count;
+    }
+  }
+  pthread_mutex_unlock(&sink->lock);
+  if (!ok) {
+    fprintf(stderr, "Error: failed to write time steps %lld to %lld to history\n",
+            (long long)(cfg->id_start + first_idx), (long long)(cfg->id_start + first_idx + count - 1));
+    perror("System error");
+  }
+  return ok;
+}
+
+// Staged steps are transposed in groups of values that fill the write buffer, tile by tile, so that both the steps
+// read and the histories written stay in cache
+bool write_history_chunk(output_sink *sink, int64_t first_idx, int64_t count) {
+  int64_t num_values = sink->layout->num_values;
+  int num_fields = sink->num_fields;
+  int64_t group = HISTORY_WRITE_BYTES / (count * num_fields * (int64_t)sizeof(double));
+  if (group < HISTORY_TILE) {
+    group = HISTORY_TILE;
+  }
+  if (group > num_values) {
+    group = num_values;
+  }
+  double *buffer = malloc(group * num_fields * count * sizeof(double));
+  if (!buffer) {
+    return false;
+  }
+
+  fseeko(sink->series, (off_t)(sink->data_offset + first_idx / sink->chunk_steps * sink->chunk_stride), SEEK_SET);
+  for (int64_t group_begin = 0; group_begin < num_values; group_begin += group) {
+    int64_t group_end = group_begin + group < num_values ? group_begin + group : num_values;
+    for (int field_idx = 0; field_idx < num_fields; ++field_idx) {
+      for (int64_t tile_value = group_begin; tile_value < group_end; tile_value += HISTORY_TILE) {
+        int64_t value_end = tile_value + HISTORY_TILE < group_end ? tile_value + HISTORY_TILE : group_end;
+        for (int64_t tile_step = 0; tile_step < count; tile_step += HISTORY_TILE) {
+          int64_t step_end = tile_step + HISTORY_TILE < count ? tile_step + HISTORY_TILE : count;
+          for (int64_t step = tile_step; step < step_end; ++step) {
+            const double *src = sink->staging + (step * num_fields + field_idx) * num_values;
+            double *dst = buffer + field_idx * count + step;
+            for (int64_t value = tile_value; value < value_end; ++value) {
+              dst[(value - group_begin) * num_fields * count] = src[value];
+            }
+          }
+        }
+      }
+    }
+    fwrite(buffer, sizeof(double), (group_end - group_begin) * num_fields * count, sink->series);
+  }
+  free(buffer);
+  return !ferror(sink->series);
+}
+
+bool close_sink(output_sink *sink) {
+  if (sink->cfg->format == FORMAT_DAT) {
+    return true;
+  }
+
+  if (sink->staging) {
+    int64_t num_steps = sink->cfg->id_end - sink->cfg->id_start + 1;
+    fseeko(sink->series, 72, SEEK_SET);
+    fwrite(&sink->steps_written, 8, 1, sink->series);
+    fwrite(sink->time_unit, 1, 8, sink->series);
+    fseeko(sink->series, (off_t)sink->table_offset, SEEK_SET);
+    fwrite(sink->times, sizeof(double), num_steps, sink->series);
+    free(sink->staging);
+    free(sink->times);
+  }
+
+  if (sink->pending) {
+    // Steps converted after a failed one are never appended
+    int64_t num_steps = sink->cfg->id_end - sink->cfg->id_start + 1;
+    for (int64_t step_idx = 0; step_idx < num_steps; ++step_idx) {
+      free(sink->pending[step_idx]);
+    }
+    free(sink->pending);
+  }
+
+  // Extend the file to its full size, the payload of the last field may end before the alignment boundary
+  int64_t num_steps = sink->cfg->id_end - sink->cfg->id_start + 1;
+  int64_t file_size = sink->data_offset + num_steps * sink->step_stride;
+  fseeko(sink->series, 0, SEEK_END);
+  if (sink->step_stride > 0 && ftello(sink->series) < file_size) {
+    fseeko(sink->series, (off_t)(file_size - 1), SEEK_SET);
+    fputc(0, sink->series);
+  }
+
+  pthread_mutex_destroy(&sink->lock);
+  if (fclose(sink->series) != 0) {
+    fprintf(stderr, "Error: failed to write series file\n");
+    perror("System error");
+    return false;
+  }
+  return true;
+}
+
+static void put_json_string(FILE *fid, const char *str) {
+  fputc('"', fid);
+  for (; *str; ++str) {
+    if (*str == '"' || *str == '\\') {
+      fprintf(fid, "\\%c", *str);
+    } else if ((unsigned char)*str < 0x20) {
+      fprintf(fid, "\\u%04x", (unsigned char)*str);
+    } else {
+      fputc(*str, fid);
+    }
+  }
+  fputc('"', fid);
+}
+
+static void put_json_stages(FILE *fid, const step_stats *stats) {
+  fprintf(fid,
+          "\"wait_seconds\": %.6f, \"open_seconds\": %.6f, \"arrays_seconds\": %.6f, \"read_seconds\": %.6f, "
+          "\"decode_seconds\": %.6f, \"permute_seconds\": %.6f, \"scatter_seconds\": %.6f, \"encode_seconds\": %.6f, "
+          "\"write_seconds\": %.6f, \"header_bytes\": %lld, \"data_bytes\": %lld, \"output_bytes\": %lld",
+          stats->wait_seconds, stats->sum.open_seconds, stats->sum.arrays_seconds, stats->sum.read_seconds,
+          stats->sum.decode_seconds, stats->permute_seconds, stats->scatter_seconds, stats->encode_seconds,
+          stats->write_seconds, (long long)stats->sum.header_bytes, (long long)stats->sum.data_bytes,
+          (long long)stats->output_bytes);
+}
+
+void add_stats(step_stats *dst, const step_stats *src) {
+  dst->wait_seconds += src->wait_seconds;
+  dst->sum.open_seconds += src->sum.open_seconds;
+  dst->sum.arrays_seconds += src->sum.arrays_seconds;
+  dst->sum.read_seconds += src->sum.read_seconds;
+  dst->sum.decode_seconds += src->sum.decode_seconds;
+  dst->sum.header_bytes += src->sum.header_bytes;
+  dst->sum.data_bytes += src->sum.data_bytes;
+  dst->permute_seconds += src->permute_seconds;
+  dst->scatter_seconds += src->scatter_seconds;
+  dst->encode_seconds += src->encode_seconds;
+  dst->write_seconds += src->write_seconds;
+  dst->output_bytes += src->output_bytes;
+}
+
+// Opening a SUM file reads its record headers and parses ARRAYS records, the latter is counted as computation
+static double io_seconds(const step_stats *stats) {
+  return stats->sum.open_seconds - stats->sum.arrays_seconds + stats->sum.read_seconds + stats->write_seconds;
+}
+
+static double compute_seconds(const step_stats *stats) {
+  return stats->sum.arrays_seconds + stats->sum.decode_seconds + stats->permute_seconds + stats->scatter_seconds +
+         stats->encode_seconds;
+}
+
+// Stage times are summed over all workers, so with several workers they may exceed the wall time of the run.
+// io_seconds and compute_seconds split the time of all stages except waiting for --follow into reading and writing
+// files and work on data in memory; cpu_seconds is the CPU time of the process, -1 if it is unknown
+bool write_stats(const app_config *cfg, const job_queue *queue, long num_workers, double setup_seconds,
+                 double wall_seconds, double cpu_seconds) {
+  FILE *fid = fopen(cfg->stats_path, "w");
+  if (fid == NULL) {
+    fprintf(stderr, "Error: failed to open file '%s'\n", cfg->stats_path);
+    perror("System error");
+    return false;
+  }
+
+  long num_steps = cfg->id_end - cfg->id_start + 1;
+  step_stats total = {0};
+  long num_converted = 0;
+  for (long step_idx = 0; step_idx < num_steps; ++step_idx) {
+    add_stats(&total, &queue->stats[step_idx]);
+    num_converted += queue->done[step_idx];
+  }
+  double read_io_seconds = total.sum.open_seconds - total.sum.arrays_seconds + total.sum.read_seconds;
+  double read_bytes = (double)(total.sum.header_bytes + total.sum.data_bytes);
+
+  fprintf(fid, "{\n  \"sim_name\": ");
+  put_json_string(fid, cfg->sim_name);
+  fprintf(fid, ",\n  \"sum_dir\": ");
+  put_json_string(fid, cfg->sum_dir);
+  fprintf(fid, ",\n  \"steps\": %ld,\n  \"converted\": %ld,\n  \"workers\": %ld,\n", num_steps, num_converted,
+          num_workers);
+  fprintf(fid, "  \"wall_seconds\": %.6f,\n  \"cpu_seconds\": %.6f,\n  \"setup_seconds\": %.6f,\n", wall_seconds,
+          cpu_seconds, setup_seconds);
+  fprintf(fid, "  \"io_seconds\": %.6f,\n  \"compute_seconds\": %.6f,\n", io_seconds(&total),
+          compute_seconds(&total));
+  fprintf(fid, "  \"read_mb_per_second\": %.3f,\n  \"write_mb_per_second\": %.3f,\n",
+          read_io_seconds > 0.0 ? read_bytes / read_io_seconds / 1e6 : 0.0,
+          total.write_seconds > 0.0 ? (double)total.output_bytes / total.write_seconds / 1e6 : 0.0);
+  fprintf(fid, "  \"totals\": {");
+  put_json_stages(fid, &total);
+  fprintf(fid, "},\n  \"files\": [");
+  for (long step_idx = 0; step_idx < num_steps; ++step_idx) {
+    const step_stats *stats = &queue->stats[step_idx];
+    fprintf(fid, "%s\n    {\"step\": %ld, \"converted\": %s, \"io_seconds\": %.6f, \"compute_seconds\": %.6f, ",
+            step_idx > 0 ? "," : "", cfg->id_start + step_idx, queue->done[step_idx] ? "true" : "false",
+            io_seconds(stats), compute_seconds(stats));
+    put_json_stages(fid, stats);
+    fputc('}', fid);
+  }
+  fprintf(fid, "\n  ]\n}\n");
+
+  if (fclose(fid) != 0) {
+    fprintf(stderr, "Error: failed to write file '%s'\n", cfg->stats_path);
+    perror("System error");
+    return false;
+  }
+  return true;
+}
+
+// Values without cells to reduce, e.g. the mean of a field whose phase is missing everywhere, are left empty
+static void put_csv_number(FILE *fid, double value) {
+  if (isfinite(value)) {
+    fprintf(fid, ",%.17g", value);
+  } else {
+    fputc(',', fid);
+  }
+}
+
+// One row per field of every converted step, in step order. Names and units are written without trailing blanks,
+// times are in the unit of the TIME record of the step and empty without it
+bool write_field_stats(const app_config *cfg, const job_queue *queue, const property_query *query) {
+  FILE *fid = fopen(cfg->field_stats_path, "w");
+  if (fid == NULL) {
+    fprintf(stderr, "Error: failed to open file '%s'\n", cfg->field_stats_path);
+    perror("System error");
+    return false;
+  }
+
+  fprintf(fid, "step,time,field,unit,component,phase,count,min,max,mean,l2_norm,max_delta_ref,max_delta_prev\n");
+  long num_steps = cfg->id_end - cfg->id_start + 1;
+  for (long step_idx = 0; step_idx < num_steps; ++step_idx) {
+    if (!queue->done[step_idx]) {
+      continue;
+    }
+    for (int field_idx = 0; field_idx < query->num_fields; ++field_idx) {
+      const field_spec *field = &query->fields[field_idx];
+      const field_stats *stats = &queue->field_stats[step_idx * query->num_fields + field_idx];
+      fprintf(fid, "%ld", cfg->id_start + step_idx);
+      put_csv_number(fid, queue->times[step_idx]);
+      fprintf(fid, ",%.*s,%.*s,%d,%d,%lld", (int)strcspn(field->name, " "), field->name,
+              (int)strcspn(field->unit, " "), field->unit, field->component, field->phase, (long long)stats->count);
+      bool empty = stats->count == 0;
+      put_csv_number(fid, empty ? NAN : stats->min);
+      put_csv_number(fid, empty ? NAN : stats->max);
+      put_csv_number(fid, empty ? NAN : stats->sum / stats->count);
+      put_csv_number(fid, empty ? NAN : sqrt(stats->sum_squares));
+      put_csv_number(fid, empty ? NAN : stats->ref_delta);
+      put_csv_number(fid, empty ? NAN : stats->prev_delta);
+      fputc('\n', fid);
+    }
+  }
+
+  if (fclose(fid) != 0) {
+    fprintf(stderr, "Error: failed to write file '%s'\n", cfg->field_stats_path);
+    perror("System error");
+    return false;
+  }
   return true;
 }
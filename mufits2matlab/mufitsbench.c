@@ -0,0 +1,989 @@
+#define _POSIX_C_SOURCE 200809L
+#define _FILE_OFFSET_BITS 64
+
+#include "mufitsio.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define SIM_NAME "BENCH"
+// Cells alternate between one and two phases
+#define NUM_PHASES 2
+// Cells read by the point-probe benchmark, spread evenly over CELLDATA
+#define NUM_PROBES 256
+// Blocks of the copy checked by --large start behind a hole of this size, past the 4 GB boundary
+#define LARGE_HOLE_SIZE ((int64_t)1 << 32)
+
+typedef struct {
+  const char *work_dir;
+  long nr;
+  long nz;
+  long num_steps;
+  long repeat;
+  bool cold;
+  const char *converter;
+  long num_jobs;
+  bool large;
+} bench_config;
+
+// Synthetic time step: CELLDATA mixes all numeric types, one DOUBLE and one STATE1 property, CONNDATA links
+// neighbouring cells of a structured NR x NZ grid. Cells are stored in shuffled order, as MUFITS does after domain
+// decomposition, so the converter has to permute them
+typedef struct {
+  int32_t num_cells;
+  int32_t num_conns;
+  int32_t *cell_id;
+  int8_t *phst;
+  double *pres;
+  double *temp;
+  // NUM_PHASES values per cell, of which the first PHST are written
+  float *sat;
+  int16_t *rock;
+  double *velo[2];
+  int32_t *conn_id[2];
+  double *flux;
+} bench_data;
+
+// Destinations of the benchmarked reads, allocated once
+typedef struct {
+  int32_t *cell_id;
+  double *pres;
+  double *temp;
+  float *sat;
+  double *velo[2];
+  int32_t *conn_id[2];
+  double *flux;
+} read_buffers;
+
+static void print_help();
+static bool parse_arguments(int argc, const char **argv, bench_config *cfg);
+static const char *option_value(int argc, const char **argv, int *arg_idx);
+static bool parse_long(const char *str, const char *name, long *value);
+static bool parse_dims(const char *str, const char *name, long *nr, long *nz);
+static double now();
+static char *file_path(const bench_config *cfg, long step);
+static void drop_cache(const char *path);
+static bool generate(const bench_config *cfg, int64_t *sum_bytes, int64_t *mvs_bytes);
+static bool write_mvs(const char *path, int32_t nr, int32_t nz);
+static void init_data(bench_data *data, int32_t nr, int32_t nz);
+static void fill_step(bench_data *data, long step);
+static void free_data(bench_data *data);
+static bool bench_open(const bench_config *cfg, bool use_mmap, double *seconds);
+static bool bench_read(const bench_config *cfg, bool use_mmap, bool conndata, read_buffers *buffers, double *seconds,
+                       int64_t *bytes);
+static bool bench_probe(const bench_config *cfg, double *seconds, int64_t *bytes);
+static bool bench_read_mvs(const bench_config *cfg, double *seconds);
+static bool bench_convert(const bench_config *cfg, double *seconds);
+static bool bench_codec(const bench_config *cfg, double *encode_seconds, double *decode_seconds);
+static bool check_codec(const double *values, const double *base, int64_t count, void *encoded, double *decoded);
+static bool check_large(const bench_config *cfg, read_buffers *buffers);
+static bool write_large(const char *src_path, const char *dst_path);
+static bool digest_reads(const bench_config *cfg, const char *path, bool use_mmap, read_buffers *buffers,
+                         uint64_t *digest);
+static uint64_t hash_bytes(uint64_t hash, const void *bytes, size_t size);
+static void report(const char *name, double seconds, int64_t bytes, int64_t objects);
+
+int main(int argc, const char **argv) {
+  bench_config cfg;
+  if (!parse_arguments(argc, argv, &cfg)) {
+    return EXIT_FAILURE;
+  }
+
+  int32_t num_cells = (int32_t)(cfg.nr * cfg.nz);
+  int32_t num_conns = (int32_t)((cfg.nr - 1) * cfg.nz + cfg.nr * (cfg.nz - 1));
+  printf("Generating %ld time steps of %d cells and %d connections in '%s'\n", cfg.num_steps, num_cells, num_conns,
+         cfg.work_dir);
+  fflush(stdout);
+  double start = now();
+  int64_t sum_bytes, mvs_bytes;
+  if (!generate(&cfg, &sum_bytes, &mvs_bytes)) {
+    return EXIT_FAILURE;
+  }
+  double write_seconds = now() - start;
+
+  read_buffers buffers;
+  buffers.cell_id = malloc(num_cells * sizeof(int32_t));
+  buffers.pres = malloc(num_cells * sizeof(double));
+  buffers.temp = malloc(num_cells * sizeof(double));
+  buffers.sat = malloc(num_cells * NUM_PHASES * sizeof(float));
+  buffers.velo[0] = malloc(num_cells * sizeof(double));
+  buffers.velo[1] = malloc(num_cells * sizeof(double));
+  buffers.conn_id[0] = malloc(num_conns * sizeof(int32_t));
+  buffers.conn_id[1] = malloc(num_conns * sizeof(int32_t));
+  buffers.flux = malloc(num_conns * sizeof(double));
+
+  int64_t cells = (int64_t)num_cells * cfg.num_steps;
+  int64_t conns = (int64_t)num_conns * cfg.num_steps;
+
+  printf("\n  %-26s %12s %12s %14s\n", "benchmark", "time, ms", "MB/s", "objects/s");
+  report("mf_write_sum_file", write_seconds, sum_bytes, cells);
+
+  bool ok = true;
+  double seconds;
+  // Rates of reads are given in bytes the reader took from the files, as counted in their statistics
+  int64_t bytes;
+  // Opening parses only the record headers, so its rate is given in files
+  if ((ok = ok && bench_open(&cfg, false, &seconds))) {
+    report("mf_open_sum_file", seconds, 0, cfg.num_steps);
+  }
+  if ((ok = ok && bench_open(&cfg, true, &seconds))) {
+    report("mf_open_sum_file_mmap", seconds, 0, cfg.num_steps);
+  }
+  if ((ok = ok && bench_read(&cfg, false, false, &buffers, &seconds, &bytes))) {
+    report("mf_read_sum_file CELLDATA", seconds, bytes, cells);
+  }
+  if ((ok = ok && bench_read(&cfg, false, true, &buffers, &seconds, &bytes))) {
+    report("mf_read_sum_file CONNDATA", seconds, bytes, conns);
+  }
+  if ((ok = ok && bench_read(&cfg, true, false, &buffers, &seconds, &bytes))) {
+    report("mmap read CELLDATA", seconds, bytes, cells);
+  }
+  if ((ok = ok && bench_read(&cfg, true, true, &buffers, &seconds, &bytes))) {
+    report("mmap read CONNDATA", seconds, bytes, conns);
+  }
+  if ((ok = ok && bench_probe(&cfg, &seconds, &bytes))) {
+    report("mf_read_sum_cells", seconds, bytes, NUM_PROBES * cfg.num_steps);
+  }
+  if ((ok = ok && bench_read_mvs(&cfg, &seconds))) {
+    report("mf_read_mvs_file", seconds, mvs_bytes, num_cells);
+  }
+  double decode_seconds;
+  // Every step is encoded with and without base
+  if ((ok = ok && bench_codec(&cfg, &seconds, &decode_seconds))) {
+    report("mf_encode_field", seconds, 2 * cells * (int64_t)sizeof(double), 2 * cells);
+    report("mf_decode_field", decode_seconds, 2 * cells * (int64_t)sizeof(double), 2 * cells);
+  }
+  if (cfg.converter && (ok = ok && bench_convert(&cfg, &seconds))) {
+    report("mufits2matlab", seconds, sum_bytes, cells);
+  }
+  if (cfg.large) {
+    ok = ok && check_large(&cfg, &buffers);
+  }
+
+  free(buffers.cell_id);
+  free(buffers.pres);
+  free(buffers.temp);
+  free(buffers.sat);
+  free(buffers.velo[0]);
+  free(buffers.velo[1]);
+  free(buffers.conn_id[0]);
+  free(buffers.conn_id[1]);
+  free(buffers.flux);
+
+  return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+void print_help() {
+  printf("Usage:\n"
+         "  mufitsbench [options] <path-to-work-dir>\n\n"
+         "    <path-to-work-dir>: directory where synthetic SUM and MVS files are generated\n\n"
+         "Options:\n"
+         "    --grid <NR>x<NZ>  : size of the synthetic grid (default 1000x1000)\n"
+         "    --steps <N>       : number of generated time steps (default 4)\n"
+         "    --repeat <N>      : every benchmark is repeated N times, the best time is reported (default 3)\n"
+         "    --cold            : evict files from the page cache before every repetition\n"
+         "    --converter <PATH>: also time the mufits2matlab executable at PATH on the generated files\n"
+         "    -j <N>            : number of jobs passed to the converter (default 1)\n"
+         "    --large           : also check reads of a copy of the first step whose blocks start past 4 GB\n");
+}
+
+bool parse_arguments(int argc, const char **argv, bench_config *cfg) {
+  const char *positional[1] = {NULL};
+  int num_positional = 0;
+  cfg->nr = cfg->nz = 1000;
+  cfg->num_steps = 4;
+  cfg->repeat = 3;
+  cfg->cold = false;
+  cfg->converter = NULL;
+  cfg->num_jobs = 1;
+  cfg->large = false;
+
+  for (int arg_idx = 1; arg_idx < argc; ++arg_idx) {
+    const char *arg = argv[arg_idx];
+    if (!strcmp(arg, "--grid")) {
+      const char *value = option_value(argc, argv, &arg_idx);
+      if (!value || !parse_dims(value, "grid size", &cfg->nr, &cfg->nz)) {
+        return false;
+      }
+    } else if (!strcmp(arg, "--steps")) {
+      const char *value = option_value(argc, argv, &arg_idx);
+      if (!value || !parse_long(value, "number of steps", &cfg->num_steps)) {
+        return false;
+      }
+      // Converter names files with at least 4 digits
+      if (cfg->num_steps < 1 || cfg->num_steps > 10000) {
+        fprintf(stderr, "Error: number of steps must be between 1 and 10000\n");
+        return false;
+      }
+    } else if (!strcmp(arg, "--repeat")) {
+      const char *value = option_value(argc, argv, &arg_idx);
+      if (!value || !parse_long(value, "number of repetitions", &cfg->repeat)) {
+        return false;
+      }
+      if (cfg->repeat < 1) {
+        fprintf(stderr, "Error: number of repetitions must be positive\n");
+        return false;
+      }
+    } else if (!strcmp(arg, "--cold")) {
+      cfg->cold = true;
+    } else if (!strcmp(arg, "--large")) {
+      cfg->large = true;
+    } else if (!strcmp(arg, "--converter")) {
+      cfg->converter = option_value(argc, argv, &arg_idx);
+      if (!cfg->converter) {
+        return false;
+      }
+    } else if (!strcmp(arg, "-j")) {
+      const char *value = option_value(argc, argv, &arg_idx);
+      if (!value || !parse_long(value, "number of jobs", &cfg->num_jobs)) {
+        return false;
+      }
+      if (cfg->num_jobs < 1) {
+        fprintf(stderr, "Error: number of jobs must be positive\n");
+        return false;
+      }
+    } else if (arg[0] == '-' && arg[1] != '\0') {
+      fprintf(stderr, "Error: unknown option '%s'\n", arg);
+      print_help();
+      return false;
+    } else if (num_positional < 1) {
+      positional[num_positional++] = arg;
+    } else {
+      fprintf(stderr, "Error: too many arguments\n");
+      print_help();
+      return false;
+    }
+  }
+
+  if (num_positional < 1) {
+    fprintf(stderr, "Error: not enough arguments\n");
+    print_help();
+    return false;
+  }
+  cfg->work_dir = positional[0];
+
+  if (cfg->nr < 2 || cfg->nz < 2) {
+    fprintf(stderr, "Error: grid must have at least 2 cells in every direction\n");
+    return false;
+  }
+  return true;
+}
+
+const char *option_value(int argc, const char **argv, int *arg_idx) {
+  if (*arg_idx + 1 == argc) {
+    fprintf(stderr, "Error: option %s requires a value\n", argv[*arg_idx]);
+    return NULL;
+  }
+  return argv[++*arg_idx];
+}
+
+bool parse_long(const char *str, const char *name, long *value) {
+  char *str_end;
+  errno = 0;
+  *value = strtol(str, &str_end, 10);
+  if (str_end == str || *str_end != '\0') {
+    fprintf(stderr, "Error: %s must be valid integer\n", name);
+    return false;
+  }
+  if (errno == ERANGE) {
+    fprintf(stderr, "Error: %s out of range\n", name);
+    return false;
+  }
+  return true;
+}
+
+bool parse_dims(const char *str, const char *name, long *nr, long *nz) {
+  char *str_end;
+  errno = 0;
+  *nr = strtol(str, &str_end, 10);
+  if (str_end == str || *str_end != 'x' || errno == ERANGE) {
+    fprintf(stderr, "Error: %s must be given as <NR>x<NZ>\n", name);
+    return false;
+  }
+  const char *nz_str = str_end + 1;
+  *nz = strtol(nz_str, &str_end, 10);
+  if (str_end == nz_str || *str_end != '\0' || errno == ERANGE) {
+    fprintf(stderr, "Error: %s must be given as <NR>x<NZ>\n", name);
+    return false;
+  }
+  // Connections of the grid are counted in int32 as well
+  if (*nr <= 0 || *nz <= 0 || *nr > INT32_MAX / 2 / *nz) {
+    fprintf(stderr, "Error: %s out of range\n", name);
+    return false;
+  }
+  return true;
+}
+
+double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + 1e-9 * ts.tv_nsec;
+}
+
+// Returns path of the SUM file of a step, or of the MVS file for step -1; the caller frees it
+char *file_path(const bench_config *cfg, long step) {
+  // 1 for '/', 1 for '.', 4 digits, 4 for '.SUM', 1 for '\0'
+  char *path = malloc(strlen(cfg->work_dir) + 1 + strlen(SIM_NAME) + 1 + 4 + 4 + 1);
+  if (step < 0) {
+    sprintf(path, "%s/%s.MVS", cfg->work_dir, SIM_NAME);
+  } else {
+    sprintf(path, "%s/%s.%04ld.SUM", cfg->work_dir, SIM_NAME, step);
+  }
+  return path;
+}
+
+// Clean pages of a file are dropped from the page cache, so that the next read goes to the storage
+void drop_cache(const char *path) {
+#ifdef POSIX_FADV_DONTNEED
+  int fd = open(path, O_RDONLY);
+  if (fd >= 0) {
+    fdatasync(fd);
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    close(fd);
+  }
+#else
+  (void)path;
+#endif
+}
+
+bool generate(const bench_config *cfg, int64_t *sum_bytes, int64_t *mvs_bytes) {
+  mkdir(cfg->work_dir, 0755);
+
+  char *path = file_path(cfg, -1);
+  bool ok = write_mvs(path, (int32_t)cfg->nr, (int32_t)cfg->nz);
+  struct stat st;
+  *mvs_bytes = ok && stat(path, &st) == 0 ? st.st_size : 0;
+  free(path);
+  if (!ok) {
+    return false;
+  }
+
+  bench_data data;
+  init_data(&data, (int32_t)cfg->nr, (int32_t)cfg->nz);
+
+  mf_property_t cell_props[] = {
+      {"CELLID  ", "        ", MF_INT4, MF_SINGLE, MF_STATE0},
+      {"PHST    ", "        ", MF_INT1, MF_SINGLE, MF_STATE0},
+      {"PRES    ", "BAR     ", MF_REAL8, MF_SINGLE, MF_STATE0},
+      {"TEMP    ", "C       ", MF_REAL8, MF_SINGLE, MF_STATE0},
+      {"SAT     ", "        ", MF_REAL4, MF_SINGLE, MF_STATE1},
+      {"ROCK    ", "        ", MF_INT2, MF_SINGLE, MF_STATE0},
+      {"VELO    ", "M/DAY   ", MF_REAL8, MF_DOUBLE, MF_STATE0},
+  };
+  mf_property_t conn_props[] = {
+      {"CONNID  ", "        ", MF_INT4, MF_DOUBLE, MF_STATE0},
+      {"FLUX    ", "KG/DAY  ", MF_REAL8, MF_SINGLE, MF_STATE0},
+  };
+  mf_arrays_t celldata = {.num_properties = 7, .num_objects = data.num_cells, .properties = cell_props};
+  mf_arrays_t conndata = {.num_properties = 2, .num_objects = data.num_conns, .properties = conn_props};
+  mf_sum_description_t desc = {0};
+  desc.celldata = &celldata;
+  desc.conndata = &conndata;
+
+  mf_data_t cell_data[] = {
+      {data.cell_id, sizeof(int32_t), data.num_cells}, {data.phst, sizeof(int8_t), data.num_cells},
+      {data.pres, sizeof(double), data.num_cells},     {data.temp, sizeof(double), data.num_cells},
+      {data.sat, NUM_PHASES * sizeof(float), data.num_cells}, {data.rock, sizeof(int16_t), data.num_cells},
+      {data.velo, sizeof(double), data.num_cells},
+  };
+  mf_data_t conn_data[] = {
+      {data.conn_id, sizeof(int32_t), data.num_conns},
+      {data.flux, sizeof(double), data.num_conns},
+  };
+  mf_sum_attachment_t attachment = {0};
+  attachment.celldata = cell_data;
+  attachment.conndata = conn_data;
+
+  *sum_bytes = 0;
+  for (long step = 0; step < cfg->num_steps && ok; ++step) {
+    fill_step(&data, step);
+    path = file_path(cfg, step);
+    FILE *stream = fopen(path, "wb");
+    if (stream == NULL) {
+      fprintf(stderr, "Error: failed to open file '%s'\n", path);
+      perror("System error");
+      ok = false;
+    } else {
+      ok = mf_write_sum_file(stream, &desc, &attachment) == MF_OK;
+      *sum_bytes += ftello(stream);
+      ok &= fclose(stream) == 0;
+    }
+    free(path);
+  }
+
+  free_data(&data);
+  return ok;
+}
+
+// The grid is a layer of unit hexahedra
+bool write_mvs(const char *path, int32_t nr, int32_t nz) {
+  FILE *stream = fopen(path, "wb");
+  if (stream == NULL) {
+    fprintf(stderr, "Error: failed to open file '%s'\n", path);
+    perror("System error");
+    return false;
+  }
+
+  mf_mvs_description_t desc = {.num_vertices = 2 * (nr + 1) * (nz + 1), .num_cells = nr * nz};
+  mf_mvs_attachment_t grid;
+  grid.points = malloc(desc.num_vertices * sizeof(*grid.points));
+  grid.cell_ids = malloc(desc.num_cells * sizeof(int32_t));
+  grid.cells = malloc(desc.num_cells * sizeof(*grid.cells));
+
+  int32_t vert_idx = 0;
+  for (int32_t y = 0; y < 2; ++y) {
+    for (int32_t k = 0; k <= nz; ++k) {
+      for (int32_t i = 0; i <= nr; ++i) {
+        grid.points[vert_idx][0] = i;
+        grid.points[vert_idx][1] = y;
+        grid.points[vert_idx++][2] = -k;
+      }
+    }
+  }
+  int32_t layer = (nr + 1) * (nz + 1);
+  for (int32_t k = 0; k < nz; ++k) {
+    for (int32_t i = 0; i < nr; ++i) {
+      int32_t cell_idx = k * nr + i;
+      int32_t v = k * (nr + 1) + i;
+      int32_t cell[8] = {v, v + 1, v + nr + 2, v + nr + 1, v + layer, v + layer + 1, v + layer + nr + 2,
+                         v + layer + nr + 1};
+      grid.cell_ids[cell_idx] = cell_idx + 1;
+      memcpy(grid.cells[cell_idx], cell, sizeof(cell));
+    }
+  }
+
+  bool ok = mf_write_mvs_file(stream, &desc, &grid) == MF_OK;
+  ok &= fclose(stream) == 0;
+  if (!ok) {
+    fprintf(stderr, "Error: failed to write file '%s'\n", path);
+  }
+  free(grid.points);
+  free(grid.cell_ids);
+  free(grid.cells);
+  return ok;
+}
+
+void init_data(bench_data *data, int32_t nr, int32_t nz) {
+  data->num_cells = nr * nz;
+  data->num_conns = (nr - 1) * nz + nr * (nz - 1);
+  data->cell_id = malloc(data->num_cells * sizeof(int32_t));
+  data->phst = malloc(data->num_cells * sizeof(int8_t));
+  data->pres = malloc(data->num_cells * sizeof(double));
+  data->temp = malloc(data->num_cells * sizeof(double));
+  data->sat = malloc(data->num_cells * NUM_PHASES * sizeof(float));
+  data->rock = malloc(data->num_cells * sizeof(int16_t));
+  data->velo[0] = malloc(data->num_cells * sizeof(double));
+  data->velo[1] = malloc(data->num_cells * sizeof(double));
+  data->conn_id[0] = malloc(data->num_conns * sizeof(int32_t));
+  data->conn_id[1] = malloc(data->num_conns * sizeof(int32_t));
+  data->flux = malloc(data->num_conns * sizeof(double));
+
+  // Fisher-Yates shuffle driven by a fixed LCG, so that every run generates the same files
+  uint64_t state = 1;
+  for (int32_t idx = 0; idx < data->num_cells; ++idx) {
+    data->cell_id[idx] = idx + 1;
+  }
+  for (int32_t idx = data->num_cells - 1; idx > 0; --idx) {
+    state = state * 6364136223846793005ULL + 1442695040888963407ULL;
+    int32_t other = (int32_t)((state >> 33) % (uint64_t)(idx + 1));
+    int32_t tmp = data->cell_id[idx];
+    data->cell_id[idx] = data->cell_id[other];
+    data->cell_id[other] = tmp;
+  }
+
+  int32_t conn_idx = 0;
+  for (int32_t k = 0; k < nz; ++k) {
+    for (int32_t i = 0; i < nr; ++i) {
+      int32_t id = k * nr + i + 1;
+      if (i + 1 < nr) {
+        data->conn_id[0][conn_idx] = id;
+        data->conn_id[1][conn_idx++] = id + 1;
+      }
+      if (k + 1 < nz) {
+        data->conn_id[0][conn_idx] = id;
+        data->conn_id[1][conn_idx++] = id + nr;
+      }
+    }
+  }
+}
+
+// Values change smoothly in space and time, like those of a real simulation
+void fill_step(bench_data *data, long step) {
+  for (int32_t idx = 0; idx < data->num_cells; ++idx) {
+    double x = 1e-3 * data->cell_id[idx];
+    data->phst[idx] = (int8_t)(1 + data->cell_id[idx] % NUM_PHASES);
+    data->pres[idx] = 100.0 + 0.5 * x + 0.25 * step;
+    data->temp[idx] = 20.0 + 0.1 * x + 0.05 * step;
+    data->sat[NUM_PHASES * idx] = (float)(0.5 + 0.4 * ((data->cell_id[idx] + step) % 100) / 100.0);
+    for (int phase = 1; phase < NUM_PHASES; ++phase) {
+      data->sat[NUM_PHASES * idx + phase] = (1.0f - data->sat[NUM_PHASES * idx]) / (NUM_PHASES - 1);
+    }
+    data->rock[idx] = (int16_t)(data->cell_id[idx] % 7);
+    data->velo[0][idx] = 1e-3 * x;
+    data->velo[1][idx] = -1e-3 * x + 1e-6 * step;
+  }
+  for (int32_t idx = 0; idx < data->num_conns; ++idx) {
+    data->flux[idx] = 1e-2 * (data->conn_id[1][idx] - data->conn_id[0][idx]) + 1e-4 * step;
+  }
+}
+
+void free_data(bench_data *data) {
+  free(data->cell_id);
+  free(data->phst);
+  free(data->pres);
+  free(data->temp);
+  free(data->sat);
+  free(data->rock);
+  free(data->velo[0]);
+  free(data->velo[1]);
+  free(data->conn_id[0]);
+  free(data->conn_id[1]);
+  free(data->flux);
+}
+
+bool bench_open(const bench_config *cfg, bool use_mmap, double *seconds) {
+  *seconds = 0;
+  for (long rep = 0; rep < cfg->repeat; ++rep) {
+    double elapsed = 0;
+    for (long step = 0; step < cfg->num_steps; ++step) {
+      char *path = file_path(cfg, step);
+      if (cfg->cold) {
+        drop_cache(path);
+      }
+      double start = now();
+      mf_sum_file_t *sum;
+      mf_status_t err = use_mmap ? mf_open_sum_file_mmap(&sum, path) : mf_open_sum_file(&sum, path);
+      free(path);
+      if (err != MF_OK) {
+        return false;
+      }
+      mf_close_sum_file(sum);
+      elapsed += now() - start;
+    }
+    if (rep == 0 || elapsed < *seconds) {
+      *seconds = elapsed;
+    }
+  }
+  return true;
+}
+
+// Reads the properties the converter needs from CELLDATA, or the whole CONNDATA block. CELLDATA holds a STATE1
+// property and is walked record by record, CONNDATA has fixed-size records. Bytes read are summed over all steps
+bool bench_read(const bench_config *cfg, bool use_mmap, bool conndata, read_buffers *buffers, double *seconds,
+                int64_t *bytes) {
+  int32_t num_cells = (int32_t)(cfg->nr * cfg->nz);
+  int32_t num_conns = (int32_t)((cfg->nr - 1) * cfg->nz + cfg->nr * (cfg->nz - 1));
+
+  char cell_names[][9] = {"CELLID  ", "PRES    ", "TEMP    ", "SAT     ", "VELO    "};
+  mf_sum_block_query_t cell_query = {.names = cell_names, .num_items = 5};
+  mf_data_t cell_data[] = {
+      {buffers->cell_id, sizeof(int32_t), num_cells}, {buffers->pres, sizeof(double), num_cells},
+      {buffers->temp, sizeof(double), num_cells},     {buffers->sat, NUM_PHASES * sizeof(float), num_cells},
+      {buffers->velo, sizeof(double), num_cells},
+  };
+  char conn_names[][9] = {"CONNID  ", "FLUX    "};
+  mf_sum_block_query_t conn_query = {.names = conn_names, .num_items = 2};
+  mf_data_t conn_data[] = {
+      {buffers->conn_id, sizeof(int32_t), num_conns},
+      {buffers->flux, sizeof(double), num_conns},
+  };
+
+  mf_sum_read_request_t request = {0};
+  mf_sum_attachment_t attachment = {0};
+  if (conndata) {
+    request.conndata = &conn_query;
+    attachment.conndata = conn_data;
+  } else {
+    request.celldata = &cell_query;
+    attachment.celldata = cell_data;
+  }
+
+  *seconds = 0;
+  for (long rep = 0; rep < cfg->repeat; ++rep) {
+    double elapsed = 0;
+    int64_t read_bytes = 0;
+    for (long step = 0; step < cfg->num_steps; ++step) {
+      char *path = file_path(cfg, step);
+      if (cfg->cold) {
+        drop_cache(path);
+      }
+      double start = now();
+      mf_sum_file_t *sum;
+      mf_status_t err = use_mmap ? mf_open_sum_file_mmap(&sum, path) : mf_open_sum_file(&sum, path);
+      free(path);
+      if (err != MF_OK) {
+        return false;
+      }
+      err = mf_read_sum_file(sum, &request, &attachment);
+      mf_sum_file_stats_t stats;
+      mf_get_sum_file_stats(sum, &stats);
+      mf_close_sum_file(sum);
+      if (err != MF_OK) {
+        return false;
+      }
+      elapsed += now() - start;
+      read_bytes += stats.data_bytes;
+    }
+    if (rep == 0 || elapsed < *seconds) {
+      *seconds = elapsed;
+      *bytes = read_bytes;
+    }
+  }
+  return true;
+}
+
+// Reads the same properties as bench_read for a few cells only. Locating them in CELLDATA needs the record index,
+// so every file is still scanned once, but only one byte of every record is looked at; the bytes read thus include
+// the windows of the scan
+bool bench_probe(const bench_config *cfg, double *seconds, int64_t *bytes) {
+  int32_t num_cells = (int32_t)(cfg->nr * cfg->nz);
+  int32_t objects[NUM_PROBES];
+  for (int32_t idx = 0; idx < NUM_PROBES; ++idx) {
+    objects[idx] = (int32_t)((int64_t)num_cells * idx / NUM_PROBES);
+  }
+
+  int32_t cell_id[NUM_PROBES];
+  double pres[NUM_PROBES], temp[NUM_PROBES], velo[2][NUM_PROBES];
+  float sat[NUM_PROBES * NUM_PHASES];
+  double *velo_components[2] = {velo[0], velo[1]};
+  char names[][9] = {"CELLID  ", "PRES    ", "TEMP    ", "SAT     ", "VELO    "};
+  mf_sum_block_query_t query = {.names = names, .num_items = 5};
+  mf_data_t data[] = {
+      {cell_id, sizeof(int32_t), NUM_PROBES}, {pres, sizeof(double), NUM_PROBES},
+      {temp, sizeof(double), NUM_PROBES},     {sat, NUM_PHASES * sizeof(float), NUM_PROBES},
+      {velo_components, sizeof(double), NUM_PROBES},
+  };
+
+  *seconds = 0;
+  for (long rep = 0; rep < cfg->repeat; ++rep) {
+    double elapsed = 0;
+    int64_t read_bytes = 0;
+    for (long step = 0; step < cfg->num_steps; ++step) {
+      char *path = file_path(cfg, step);
+      if (cfg->cold) {
+        drop_cache(path);
+      }
+      double start = now();
+      mf_sum_file_t *sum;
+      mf_status_t err = mf_open_sum_file(&sum, path);
+      free(path);
+      if (err != MF_OK) {
+        return false;
+      }
+      err = mf_read_sum_cells(sum, &query, objects, NUM_PROBES, data);
+      mf_sum_file_stats_t stats;
+      mf_get_sum_file_stats(sum, &stats);
+      mf_close_sum_file(sum);
+      if (err != MF_OK) {
+        return false;
+      }
+      elapsed += now() - start;
+      read_bytes += stats.data_bytes;
+    }
+    if (rep == 0 || elapsed < *seconds) {
+      *seconds = elapsed;
+      *bytes = read_bytes;
+    }
+  }
+  return true;
+}
+
+bool bench_read_mvs(const bench_config *cfg, double *seconds) {
+  char *path = file_path(cfg, -1);
+  int32_t num_cells = (int32_t)(cfg->nr * cfg->nz);
+  int32_t num_vertices = (int32_t)(2 * (cfg->nr + 1) * (cfg->nz + 1));
+  mf_mvs_attachment_t data;
+  data.points = malloc(num_vertices * sizeof(*data.points));
+  data.cell_ids = malloc(num_cells * sizeof(int32_t));
+  data.cells = malloc(num_cells * sizeof(*data.cells));
+
+  bool ok = true;
+  *seconds = 0;
+  for (long rep = 0; rep < cfg->repeat && ok; ++rep) {
+    if (cfg->cold) {
+      drop_cache(path);
+    }
+    double start = now();
+    mf_mvs_file_t *mvs;
+    ok = mf_open_mvs_file(&mvs, path) == MF_OK;
+    if (ok) {
+      ok = mf_read_mvs_file(mvs, &data) == MF_OK;
+      mf_close_mvs_file(mvs);
+    }
+    double elapsed = now() - start;
+    if (rep == 0 || elapsed < *seconds) {
+      *seconds = elapsed;
+    }
+  }
+
+  free(data.points);
+  free(data.cell_ids);
+  free(data.cells);
+  free(path);
+  return ok;
+}
+
+// Encodes pressure-like fields of all steps without base and with the field of the step before as base, as the
+// converter does with --compress, and checks that decoding restores every bit. Fields hold NaN of missing phases;
+// empty and single-value fields, infinities, signed zeros and NaN payloads are checked once before timing
+bool bench_codec(const bench_config *cfg, double *encode_seconds, double *decode_seconds) {
+  double nan_payload;
+  uint64_t nan_bits = 0x7ff8000000000123ULL;
+  memcpy(&nan_payload, &nan_bits, sizeof(double));
+  double special[] = {NAN, -0.0, INFINITY, nan_payload, 0.0, -INFINITY, 1e-310};
+  double special_base[] = {1.0, 0.0, INFINITY, NAN, -0.0, 2.0, 1e-310};
+  int64_t num_special = sizeof(special) / sizeof(double);
+
+  int64_t count = cfg->nr * cfg->nz;
+  int64_t capacity = count > num_special ? count : num_special;
+  double *fields[2] = {malloc(count * sizeof(double)), malloc(count * sizeof(double))};
+  double *decoded = malloc(capacity * sizeof(double));
+  void *encoded = malloc(mf_field_bound(capacity));
+  bool ok = true;
+  for (int64_t special_count = 0; special_count <= num_special && ok; ++special_count) {
+    ok = check_codec(special, NULL, special_count, encoded, decoded) &&
+         check_codec(special, special_base, special_count, encoded, decoded);
+  }
+  *encode_seconds = *decode_seconds = 0;
+  for (long rep = 0; rep < cfg->repeat && ok; ++rep) {
+    double encode_elapsed = 0, decode_elapsed = 0;
+    for (long step = 0; step < cfg->num_steps && ok; ++step) {
+      double *values = fields[step % 2];
+      for (int64_t idx = 0; idx < count; ++idx) {
+        values[idx] = idx % 7 == 3 ? NAN : 100.0 + 0.5e-3 * idx + 0.25 * step;
+      }
+      for (int with_base = 0; with_base < 2 && ok; ++with_base) {
+        const double *base = with_base && step > 0 ? fields[(step + 1) % 2] : NULL;
+        double start = now();
+        int64_t size = mf_encode_field(values, base, count, encoded);
+        double encoded_at = now();
+        ok = mf_decode_field(encoded, size, base, count, decoded) == MF_OK;
+        encode_elapsed += encoded_at - start;
+        decode_elapsed += now() - encoded_at;
+        if (ok && memcmp(values, decoded, count * sizeof(double))) {
+          fprintf(stderr, "Error: decoded field of step %ld differs from the encoded one\n", step);
+          ok = false;
+        }
+      }
+    }
+    if (rep == 0 || encode_elapsed < *encode_seconds) {
+      *encode_seconds = encode_elapsed;
+    }
+    if (rep == 0 || decode_elapsed < *decode_seconds) {
+      *decode_seconds = decode_elapsed;
+    }
+  }
+
+  free(fields[0]);
+  free(fields[1]);
+  free(decoded);
+  free(encoded);
+  return ok;
+}
+
+// Values are compared bitwise, so that NaN payloads and signed zeros count
+bool check_codec(const double *values, const double *base, int64_t count, void *encoded, double *decoded) {
+  int64_t size = mf_encode_field(values, base, count, encoded);
+  if (size > mf_field_bound(count) || mf_decode_field(encoded, size, base, count, decoded) != MF_OK ||
+      memcmp(values, decoded, count * sizeof(double))) {
+    fprintf(stderr, "Error: field of %lld values %s base is not restored by decoding\n", (long long)count,
+            base ? "with" : "without");
+    return false;
+  }
+  return true;
+}
+
+// Runs the converter on all generated steps, so that the whole path from opening SUM files to writing .dat files
+// is timed, including worker threads of the converter
+bool bench_convert(const bench_config *cfg, double *seconds) {
+  // 4 for '/out', 1 for '\0'
+  char *out_dir = malloc(strlen(cfg->work_dir) + 4 + 1);
+  sprintf(out_dir, "%s/out", cfg->work_dir);
+  mkdir(out_dir, 0755);
+
+  size_t command_size = 2 * strlen(cfg->converter) + 2 * strlen(cfg->work_dir) + 128;
+  char *command = malloc(command_size);
+  snprintf(command, command_size,
+           "'%s' -j %ld --grid %ldx%ld --props PRES,TEMP,SAT --phases %d %s '%s' '%s' 0 %ld > /dev/null",
+           cfg->converter, cfg->num_jobs, cfg->nr, cfg->nz, NUM_PHASES, SIM_NAME, cfg->work_dir, out_dir,
+           cfg->num_steps - 1);
+
+  bool ok = true;
+  *seconds = 0;
+  for (long rep = 0; rep < cfg->repeat && ok; ++rep) {
+    if (cfg->cold) {
+      for (long step = 0; step < cfg->num_steps; ++step) {
+        char *path = file_path(cfg, step);
+        drop_cache(path);
+        free(path);
+      }
+    }
+    double start = now();
+    int status = system(command);
+    double elapsed = now() - start;
+    if (status == -1 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+      fprintf(stderr, "Error: converter failed: %s\n", command);
+      ok = false;
+    }
+    if (rep == 0 || elapsed < *seconds) {
+      *seconds = elapsed;
+    }
+  }
+
+  free(command);
+  free(out_dir);
+  return ok;
+}
+
+// The first step is copied behind a hole that puts all of its records past 4 GB, so that 32-bit offsets anywhere in
+// the reader show up as differences between the reads of both files, with stdio and with mmap. The hole is skipped
+// as an unknown record and takes no disk space on file systems with sparse files
+bool check_large(const bench_config *cfg, read_buffers *buffers) {
+  char *path = file_path(cfg, 0);
+  // 10 for '.LARGE.SUM', 1 for '\0'
+  char *large_path = malloc(strlen(cfg->work_dir) + 1 + strlen(SIM_NAME) + 10 + 1);
+  sprintf(large_path, "%s/%s.LARGE.SUM", cfg->work_dir, SIM_NAME);
+
+  bool ok = write_large(path, large_path);
+  for (int use_mmap = 0; use_mmap < 2 && ok; ++use_mmap) {
+    uint64_t expected, digest;
+    ok = digest_reads(cfg, path, use_mmap, buffers, &expected) &&
+         digest_reads(cfg, large_path, use_mmap, buffers, &digest);
+    if (ok && digest != expected) {
+      fprintf(stderr, "Error: %s reads of '%s' differ from those of '%s'\n", use_mmap ? "mmap" : "stdio", large_path,
+              path);
+      ok = false;
+    }
+  }
+  if (ok) {
+    printf("\n  Reads of blocks past 4 GB match with stdio and mmap\n");
+  }
+
+  remove(large_path);
+  free(large_path);
+  free(path);
+  return ok;
+}
+
+bool write_large(const char *src_path, const char *dst_path) {
+  FILE *src = fopen(src_path, "rb");
+  if (src == NULL) {
+    fprintf(stderr, "Error: failed to open file '%s'\n", src_path);
+    perror("System error");
+    return false;
+  }
+  FILE *dst = fopen(dst_path, "wb");
+  if (dst == NULL) {
+    fprintf(stderr, "Error: failed to open file '%s'\n", dst_path);
+    perror("System error");
+    fclose(src);
+    return false;
+  }
+
+  // The file format record comes first, the hole is a record of its own right after it
+  char record[16];
+  int64_t hole_size = LARGE_HOLE_SIZE;
+  bool ok = fread(record, 1, 16, src) == 16 && fwrite(record, 1, 16, dst) == 16;
+  ok = ok && fwrite("HOLE    ", 1, 8, dst) == 8 && fwrite(&hole_size, 8, 1, dst) == 1;
+  ok = ok && fseeko(dst, (off_t)hole_size, SEEK_CUR) == 0;
+  char buffer[1 << 16];
+  size_t size;
+  while (ok && (size = fread(buffer, 1, sizeof(buffer), src)) > 0) {
+    ok = fwrite(buffer, 1, size, dst) == size;
+  }
+  ok = ok && !ferror(src);
+  ok &= fclose(dst) == 0;
+  fclose(src);
+  if (!ok) {
+    fprintf(stderr, "Error: failed to write file '%s'\n", dst_path);
+    perror("System error");
+  }
+  return ok;
+}
+
+// Reads both blocks as a whole, the second half of CELLDATA with mf_read_sum_block and the probed cells with
+// mf_read_sum_cells, and hashes all values read
+bool digest_reads(const bench_config *cfg, const char *path, bool use_mmap, read_buffers *buffers, uint64_t *digest) {
+  int32_t num_cells = (int32_t)(cfg->nr * cfg->nz);
+  int32_t num_conns = (int32_t)((cfg->nr - 1) * cfg->nz + cfg->nr * (cfg->nz - 1));
+  int32_t first = num_cells / 2;
+  int32_t objects[NUM_PROBES];
+  for (int32_t idx = 0; idx < NUM_PROBES; ++idx) {
+    objects[idx] = (int32_t)((int64_t)num_cells * idx / NUM_PROBES);
+  }
+
+  char cell_names[][9] = {"CELLID  ", "PRES    ", "TEMP    ", "SAT     ", "VELO    "};
+  mf_sum_block_query_t cell_query = {.names = cell_names, .num_items = 5};
+  char conn_names[][9] = {"CONNID  ", "FLUX    "};
+  mf_sum_block_query_t conn_query = {.names = conn_names, .num_items = 2};
+  mf_sum_read_request_t request = {.celldata = &cell_query, .conndata = &conn_query};
+  mf_data_t conn_data[] = {
+      {buffers->conn_id, sizeof(int32_t), num_conns},
+      {buffers->flux, sizeof(double), num_conns},
+  };
+
+  mf_sum_file_t *sum;
+  mf_status_t err = use_mmap ? mf_open_sum_file_mmap(&sum, path) : mf_open_sum_file(&sum, path);
+  if (err != MF_OK) {
+    return false;
+  }
+  *digest = 14695981039346656037ULL;
+  // Whole CELLDATA, its second half and the probed cells, each read to the start of the buffers
+  int32_t counts[3] = {num_cells, num_cells - first, NUM_PROBES};
+  for (int read = 0; read < 3 && err == MF_OK; ++read) {
+    int32_t count = counts[read];
+    // Values of missing phases are not written
+    memset(buffers->sat, 0, (size_t)num_cells * NUM_PHASES * sizeof(float));
+    mf_data_t cell_data[] = {
+        {buffers->cell_id, sizeof(int32_t), count}, {buffers->pres, sizeof(double), count},
+        {buffers->temp, sizeof(double), count},     {buffers->sat, NUM_PHASES * sizeof(float), count},
+        {buffers->velo, sizeof(double), count},
+    };
+    if (read == 0) {
+      mf_sum_attachment_t attachment = {.celldata = cell_data, .conndata = conn_data};
+      err = mf_read_sum_file(sum, &request, &attachment);
+      *digest = hash_bytes(*digest, buffers->conn_id[0], num_conns * sizeof(int32_t));
+      *digest = hash_bytes(*digest, buffers->conn_id[1], num_conns * sizeof(int32_t));
+      *digest = hash_bytes(*digest, buffers->flux, num_conns * sizeof(double));
+    } else if (read == 1) {
+      err = mf_read_sum_block(sum, MF_CELLDATA, &cell_query, first, cell_data);
+    } else {
+      err = mf_read_sum_cells(sum, &cell_query, objects, NUM_PROBES, cell_data);
+    }
+    *digest = hash_bytes(*digest, buffers->cell_id, count * sizeof(int32_t));
+    *digest = hash_bytes(*digest, buffers->pres, count * sizeof(double));
+    *digest = hash_bytes(*digest, buffers->temp, count * sizeof(double));
+    *digest = hash_bytes(*digest, buffers->sat, count * NUM_PHASES * sizeof(float));
+    *digest = hash_bytes(*digest, buffers->velo[0], count * sizeof(double));
+    *digest = hash_bytes(*digest, buffers->velo[1], count * sizeof(double));
+  }
+  mf_close_sum_file(sum);
+  return err == MF_OK;
+}
+
+// FNV-1a
+uint64_t hash_bytes(uint64_t hash, const void *bytes, size_t size) {
+  const unsigned char *pos = bytes;
+  for (size_t idx = 0; idx < size; ++idx) {
+    hash = (hash ^ pos[idx]) * 1099511628211ULL;
+  }
+  return hash;
+}
+
+void report(const char *name, double seconds, int64_t bytes, int64_t objects) {
+  if (bytes > 0) {
+    printf("  %-26s %12.3f %12.1f %14.4g\n", name, 1e3 * seconds, bytes / 1e6 / seconds, objects / seconds);
+  } else {
+    printf("  %-26s %12.3f %12s %14.4g\n", name, 1e3 * seconds, "-", objects / seconds);
+  }
+  fflush(stdout);
+}
@@ -1,9 +1,35 @@
+#define _POSIX_C_SOURCE 200809L
+// SUM files of fine grids exceed 2 GB, so file offsets must be 64-bit on 32-bit platforms as well
+#define _FILE_OFFSET_BITS 64
+
 #include "mufitsio.h"
 
 #include <assert.h>
+#include <errno.h>
 #include <stdbool.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+
+#if defined(__unix__) || defined(__APPLE__)
+#define MF_HAVE_MMAP 1
+#define MF_HAVE_PREAD 1
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#if defined(__unix__) || defined(__APPLE__)
+#define MF_HAVE_THREADS 1
+#include <pthread.h>
+#endif
+
+// Hardware gathers are selected at run time, so the library can be built without -mavx2 and still use them
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define MF_HAVE_X86_SIMD 1
+#include <immintrin.h>
+#endif
 
 #define check_state(stream)                                                                                            \
   do {                                                                                                                 \
@@ -30,9 +56,18 @@
     }                                                                                                                  \
   } while (0)
 
+enum { CELLDATA = MF_CELLDATA, CONNDATA = MF_CONNDATA, SRCDATA = MF_SRCDATA, FPCEDATA = MF_FPCEDATA,
+       FPCODATA = MF_FPCODATA, NUM_BLOCKS };
+
+// Opening fills the handle, afterwards reads only use positional reads of `fd` or the mapping and update statistics
+// and record indexes under `lock`, so that one handle can be read by several threads at once
 typedef struct mf_sum_file {
   mf_file_format_t format;
   FILE *stream;
+  int fd;
+  // Read-only mapping of the whole file when opened with mf_open_sum_file_mmap, NULL otherwise
+  const char *map;
+  int64_t map_size;
   int64_t celldata_offset;
   int64_t celldata_size;
   int64_t conndata_offset;
@@ -43,14 +78,39 @@ typedef struct mf_sum_file {
   int64_t fpcedata_size;
   int64_t fpcodata_offset;
   int64_t fpcodata_size;
+  // Hashes of the property descriptors of every block, equal hashes mean equal record layouts
+  uint64_t celldata_layout;
+  uint64_t conndata_layout;
+  uint64_t srcdata_layout;
+  uint64_t fpcedata_layout;
+  uint64_t fpcodata_layout;
+  // Whole ASCII file, either the mapping or a copy owned by the handle; block offsets and sizes then locate the text
+  // between DATA and ENDDATA. NULL for binary files
+  const char *text;
+  int64_t text_size;
+  char *owned_text;
+  mf_sum_file_stats_t stats;
+  // Offsets of all records of every block with STATE1 properties, built on first use
+  int64_t *record_offsets[NUM_BLOCKS];
+#ifdef MF_HAVE_THREADS
+  pthread_mutex_t lock;
+#endif
   mf_sum_description_t *description;
 } mf_sum_file_t;
 
 typedef struct mf_mvs_file {
   mf_file_format_t format;
   FILE *stream;
-  size_t vertices_offset;
-  size_t cells_offset;
+  const char *map;
+  int64_t map_size;
+  int64_t vertices_offset;
+  int64_t cells_offset;
+  // ASCII files only, same as in mf_sum_file_t; POINTS and CELLS values are located by offsets and sizes in the text
+  const char *text;
+  int64_t text_size;
+  char *owned_text;
+  int64_t vertices_size;
+  int64_t cells_size;
   mf_mvs_description_t *description;
 } mf_mvs_file_t;
 
@@ -59,15 +119,103 @@ typedef struct {
   int64_t size;
 } header_t;
 
-static mf_status_t read_header(header_t *h, FILE *stream);
-static mf_status_t read_file_format(mf_file_format_t *format, FILE *stream);
-static mf_status_t read_time(mf_time_t *t, FILE *stream);
-static mf_status_t read_date(mf_date_t *d, FILE *stream);
-static mf_status_t read_arrays(mf_arrays_t *arrays, int64_t *offset, int64_t *size, FILE *stream);
-static mf_status_t read_data(FILE *stream, const mf_arrays_t *desc, const mf_sum_block_query_t *query, mf_data_t *data,
-                             int64_t offset);
+// Files are parsed either from a stdio stream or directly from a memory mapping; source_t hides the difference from
+// the parsing routines
+typedef struct {
+  FILE *stream;
+  const char *map;
+  int64_t map_size;
+  int64_t pos;
+  // Parsing statistics
+  int64_t bytes_read;
+  double arrays_seconds;
+} source_t;
+
+// Copy of one requested property out of fixed-size records
+typedef struct {
+  int32_t req_idx;
+  int32_t size;
+  int64_t offset;
+  bool is_double;
+} copy_op_t;
+
+// Requested properties resolved against the descriptors of a block
+typedef struct {
+  int32_t num_items;
+  int32_t *req_indices;
+  int *element_sizes;
+  int32_t phst_idx;
+  bool fixed_stride;
+  int64_t record_size;
+  copy_op_t *ops;
+  int32_t num_ops;
+} block_layout_t;
+
+// Location of a block inside an open file
+typedef struct {
+  const mf_arrays_t *desc;
+  int64_t offset;
+  int64_t size;
+  uint64_t layout;
+} block_ref_t;
+
+typedef struct {
+  bool used;
+  uint64_t layout;
+  block_layout_t resolved;
+} plan_block_t;
+
+struct mf_sum_decode_plan {
+  plan_block_t blocks[NUM_BLOCKS];
+};
+
+static double monotonic_seconds(void);
+static int seek_stream(FILE *stream, int64_t offset, int whence);
+static int64_t tell_stream(FILE *stream);
+static mf_status_t map_file(const char *filename, const char **map, int64_t *size);
+static void unmap_file(const char *map, int64_t size);
+static mf_status_t source_read(source_t *src, void *dst, int64_t size);
+static mf_status_t source_skip(source_t *src, int64_t size);
+static int64_t source_tell(const source_t *src);
+static mf_status_t open_sum(mf_sum_file_t *sum_file, source_t *src);
+static mf_status_t open_mvs(mf_mvs_file_t *mvs_file, source_t *src);
+static mf_status_t read_header(header_t *h, source_t *src);
+static mf_status_t read_file_format(mf_file_format_t *format, source_t *src);
+static mf_status_t read_time(mf_time_t *t, source_t *src);
+static mf_status_t read_date(mf_date_t *d, source_t *src);
+static mf_status_t read_arrays(mf_arrays_t *arrays, int64_t *offset, int64_t *size, uint64_t *layout, source_t *src);
+static mf_status_t resolve_query(const mf_arrays_t *desc, const mf_sum_block_query_t *query, block_layout_t *layout);
+static void free_layout(block_layout_t *layout);
+static block_ref_t block_ref(const mf_sum_file_t *file, int block);
+static const mf_sum_block_query_t *block_query(const mf_sum_read_request_t *request, int block);
+static mf_data_t *block_data(const mf_sum_attachment_t *attachment, int block);
+static mf_sum_file_t *new_sum_file(const mf_sum_file_t *sum_file);
+static mf_status_t read_at(const mf_sum_file_t *file, void *dst, int64_t size, int64_t offset);
+static void add_read_stats(mf_sum_file_t *file, double read_seconds, double decode_seconds, int64_t bytes);
+static void lock_file(const mf_sum_file_t *file);
+static void unlock_file(const mf_sum_file_t *file);
+static const int64_t *cached_record_index(const mf_sum_file_t *file, int block);
+static mf_status_t get_record_index(mf_sum_file_t *file, int block, const char *records, const int64_t **offsets);
+static mf_status_t index_records(const mf_sum_file_t *file, const mf_arrays_t *desc, const char *records,
+                                 int64_t offset, int64_t size, int64_t **offsets, int64_t *bytes_read);
+static mf_status_t decode_records(const char *records, const int64_t *offsets, const mf_arrays_t *desc,
+                                  const block_layout_t *layout, int32_t count, mf_data_t *data);
+static mf_status_t read_block(mf_sum_file_t *file, int block, const block_layout_t *layout, mf_data_t *data,
+                              int32_t first);
+static mf_status_t read_data(mf_sum_file_t *file, int block, const mf_sum_block_query_t *query, mf_data_t *data,
+                             int32_t first);
+static mf_status_t read_cells(mf_sum_file_t *file, int block, const block_layout_t *layout, const int32_t *objects,
+                              int32_t num_objects, mf_data_t *data);
+static mf_status_t view_data(const mf_sum_file_t *file, const mf_arrays_t *desc, const mf_sum_block_query_t *query,
+                             mf_data_t *data, int64_t offset);
 static void free_sum_description(mf_sum_description_t *desc);
-static void write_block(FILE *stream, const char *name, const mf_arrays_t *arr, mf_data_t *data);
+static mf_status_t write_block(FILE *stream, const char *name, const mf_arrays_t *arr, const mf_data_t *data);
+static mf_status_t open_sum_text(mf_sum_file_t *sum_file, source_t *src);
+static mf_status_t open_mvs_text(mf_mvs_file_t *mvs_file, source_t *src);
+static mf_status_t read_text_block(mf_sum_file_t *file, const mf_arrays_t *desc, const block_layout_t *layout,
+                                   mf_data_t *data, int64_t offset, int64_t size, int32_t first, int32_t max_count);
+static mf_status_t read_text_mvs(const mf_mvs_file_t *file, mf_mvs_attachment_t *data);
+static bool text_ends_with_endfile(const char *text, int64_t size);
 
 mf_status_t mf_open_sum_file(mf_sum_file_t **file, const char *filename) {
   assert(file);
@@ -80,90 +228,183 @@ mf_status_t mf_open_sum_file(mf_sum_file_t **file, const char *filename) {
     return MF_ERROR_FAILED_IO_OPERATION;
   }
 
-  mf_sum_file_t sum_file;
+  mf_sum_file_t sum_file = {0};
   sum_file.stream = stream;
+#ifdef MF_HAVE_PREAD
+  sum_file.fd = fileno(stream);
+#endif
+  source_t src = {.stream = stream};
 
-  mf_status_t err = read_file_format(&sum_file.format, stream);
+  mf_status_t err = open_sum(&sum_file, &src);
   if (err != MF_OK) {
-    fprintf(stderr, "Error: failed to read file format\n");
     fclose(stream);
     return err;
   }
 
-  if (sum_file.format != MF_BINARY) {
-    fprintf(stderr, "Error: only binary file format is currently supported\n");
-    fclose(stream);
-    return MF_ERROR_UNSUPPORTED_FEATURE_REQUIRED;
+  *file = new_sum_file(&sum_file);
+  return MF_OK;
+}
+
+mf_status_t mf_open_sum_file_mmap(mf_sum_file_t **file, const char *filename) {
+  assert(file);
+  assert(filename);
+
+  mf_sum_file_t sum_file = {0};
+  mf_status_t err = map_file(filename, &sum_file.map, &sum_file.map_size);
+  if (err != MF_OK) {
+    return err;
+  }
+  source_t src = {.map = sum_file.map, .map_size = sum_file.map_size};
+
+  err = open_sum(&sum_file, &src);
+  if (err != MF_OK) {
+    unmap_file(sum_file.map, sum_file.map_size);
+    return err;
+  }
+
+  *file = new_sum_file(&sum_file);
+  return MF_OK;
+}
+
+mf_sum_file_t *new_sum_file(const mf_sum_file_t *sum_file) {
+  mf_sum_file_t *file = malloc(sizeof(mf_sum_file_t));
+  memcpy(file, sum_file, sizeof(mf_sum_file_t));
+#ifdef MF_HAVE_THREADS
+  pthread_mutex_init(&file->lock, NULL);
+#endif
+  return file;
+}
+
+mf_status_t open_sum(mf_sum_file_t *sum_file, source_t *src) {
+  double start = monotonic_seconds();
+  mf_status_t err = read_file_format(&sum_file->format, src);
+  if (err != MF_OK) {
+    fprintf(stderr, "Error: failed to read file format\n");
+    return err;
+  }
+
+  if (sum_file->format == MF_ASCII) {
+    err = open_sum_text(sum_file, src);
+    sum_file->stats.open_seconds = monotonic_seconds() - start;
+    return err;
   }
 
   mf_sum_description_t *desc = calloc(1, sizeof(mf_sum_description_t));
 
   while (true) {
-    if (ferror(stream)) {
+    header_t header;
+    err = read_header(&header, src);
+    if (err == MF_ERROR_FAILED_IO_OPERATION) {
       fprintf(stderr, "Error: failed to perform read operation\n");
       perror("System error");
-      err = MF_ERROR_FAILED_IO_OPERATION;
       goto on_error;
     }
-    if (feof(stream)) {
+    if (err != MF_OK) {
       fprintf(stderr, "Error: unexpected end of file\n");
-      err = MF_ERROR_INVALID_FILE;
       goto on_error;
     }
 
-    header_t header;
-    checked(read_header(&header, stream), err);
-
     if (!memcmp(header.name, "TIME    ", 8)) {
       desc->time = malloc(sizeof(mf_time_t));
-      checked(read_time(desc->time, stream), err);
+      checked(read_time(desc->time, src), err);
     } else if (!memcmp(header.name, "DATE    ", 8)) {
       desc->date = malloc(sizeof(mf_date_t));
-      checked(read_date(desc->date, stream), err);
+      checked(read_date(desc->date, src), err);
     } else if (!memcmp(header.name, "CELLDATA", 8)) {
       desc->celldata = malloc(sizeof(mf_arrays_t));
-      checked(read_arrays(desc->celldata, &sum_file.celldata_offset, &sum_file.celldata_size, stream), err);
+      checked(read_arrays(desc->celldata, &sum_file->celldata_offset, &sum_file->celldata_size,
+                          &sum_file->celldata_layout, src),
+              err);
     } else if (!memcmp(header.name, "CONNDATA", 8)) {
       desc->conndata = malloc(sizeof(mf_arrays_t));
-      checked(read_arrays(desc->conndata, &sum_file.conndata_offset, &sum_file.conndata_size, stream), err);
+      checked(read_arrays(desc->conndata, &sum_file->conndata_offset, &sum_file->conndata_size,
+                          &sum_file->conndata_layout, src),
+              err);
     } else if (!memcmp(header.name, "SRCDATA ", 8)) {
       desc->srcdata = malloc(sizeof(mf_arrays_t));
-      checked(read_arrays(desc->srcdata, &sum_file.srcdata_offset, &sum_file.srcdata_size, stream), err);
+      checked(read_arrays(desc->srcdata, &sum_file->srcdata_offset, &sum_file->srcdata_size,
+                          &sum_file->srcdata_layout, src),
+              err);
     } else if (!memcmp(header.name, "FPCEDATA", 8)) {
       desc->fpcedata = malloc(sizeof(mf_arrays_t));
-      checked(read_arrays(desc->fpcedata, &sum_file.fpcedata_offset, &sum_file.fpcedata_size, stream), err);
+      checked(read_arrays(desc->fpcedata, &sum_file->fpcedata_offset, &sum_file->fpcedata_size,
+                          &sum_file->fpcedata_layout, src),
+              err);
     } else if (!memcmp(header.name, "FPCODATA", 8)) {
       desc->fpcodata = malloc(sizeof(mf_arrays_t));
-      checked(read_arrays(desc->fpcodata, &sum_file.fpcodata_offset, &sum_file.fpcodata_size, stream), err);
+      checked(read_arrays(desc->fpcodata, &sum_file->fpcodata_offset, &sum_file->fpcodata_size,
+                          &sum_file->fpcodata_layout, src),
+              err);
     } else if (!strcmp(header.name, "ENDFILE ")) {
       break;
     } else {
 #ifdef _DEBUG
       fprintf(stderr, "Warning: unknown keyword '%s' (%lld bytes), skipping\n", header.name, header.size);
 #endif
-      fseek(sum_file.stream, (long)header.size, SEEK_CUR);
+      checked(source_skip(src, header.size), err);
     }
   }
 
-  sum_file.description = desc;
-  *file = malloc(sizeof(mf_sum_file_t));
-  memcpy(*file, &sum_file, sizeof(mf_sum_file_t));
+  sum_file->description = desc;
+  sum_file->stats.open_seconds = monotonic_seconds() - start;
+  sum_file->stats.arrays_seconds = src->arrays_seconds;
+  sum_file->stats.header_bytes = src->bytes_read;
   return MF_OK;
 
 on_error:
   free_sum_description(desc);
-  fclose(stream);
   return err;
 }
 
 void mf_close_sum_file(mf_sum_file_t *file) {
-  fclose(file->stream);
+  if (file->map) {
+    unmap_file(file->map, file->map_size);
+  } else {
+    fclose(file->stream);
+  }
   if (file->description) {
     free_sum_description(file->description);
   }
+  free(file->owned_text);
+  for (int block = 0; block < NUM_BLOCKS; ++block) {
+    free(file->record_offsets[block]);
+  }
+#ifdef MF_HAVE_THREADS
+  pthread_mutex_destroy(&file->lock);
+#endif
   free(file);
 }
 
+mf_status_t mf_probe_sum_file(const char *filename) {
+  FILE *stream = fopen(filename, "rb");
+  if (stream == NULL) {
+    return MF_ERROR_FAILED_IO_OPERATION;
+  }
+
+  // Binary files end with the ENDFILE record, ASCII ones with the ENDFILE keyword and maybe a line break
+  static const char endfile[16] = {'E', 'N', 'D', 'F', 'I', 'L', 'E', ' '};
+  char tail[64];
+  int64_t size = seek_stream(stream, 0, SEEK_END) == 0 ? tell_stream(stream) : -1;
+  int64_t length = size < (int64_t)sizeof(tail) ? size : (int64_t)sizeof(tail);
+  bool complete = length >= 16 && seek_stream(stream, size - length, SEEK_SET) == 0 &&
+                  fread(tail, 1, length, stream) == (size_t)length &&
+                  (!memcmp(tail + length - 16, endfile, 16) || text_ends_with_endfile(tail, length));
+  fclose(stream);
+  return complete ? MF_OK : MF_ERROR_INVALID_FILE;
+}
+
+void mf_get_sum_file_stats(const mf_sum_file_t *file, mf_sum_file_stats_t *stats) {
+  assert(file);
+#ifdef MF_HAVE_THREADS
+  pthread_mutex_t *lock = (pthread_mutex_t *)&file->lock;
+  pthread_mutex_lock(lock);
+  *stats = file->stats;
+  pthread_mutex_unlock(lock);
+#else
+  *stats = file->stats;
+#endif
+}
+
 mf_sum_description_t *mf_get_sum_description(const mf_sum_file_t *file) {
   assert(file);
   return file->description;
@@ -171,35 +412,161 @@ mf_sum_description_t *mf_get_sum_description(const mf_sum_file_t *file) {
 
 mf_status_t mf_read_sum_file(mf_sum_file_t *file, const mf_sum_read_request_t *request,
                              mf_sum_attachment_t *attachment) {
-  const mf_sum_description_t *desc = file->description;
-  FILE *h = file->stream;
-  mf_status_t err;
-  if (request->celldata) {
-    err = read_data(h, desc->celldata, request->celldata, attachment->celldata, file->celldata_offset);
-    if (err != MF_OK) {
-      return err;
+  for (int block = 0; block < NUM_BLOCKS; ++block) {
+    const mf_sum_block_query_t *query = block_query(request, block);
+    if (query) {
+      mf_status_t err = read_data(file, block, query, block_data(attachment, block), 0);
+      if (err != MF_OK) {
+        return err;
+      }
     }
   }
-  if (request->conndata) {
-    err = read_data(h, desc->conndata, request->conndata, attachment->conndata, file->conndata_offset);
-    if (err != MF_OK) {
-      return err;
+  return MF_OK;
+}
+
+mf_status_t mf_read_sum_block(mf_sum_file_t *file, mf_sum_block_t block, const mf_sum_block_query_t *query,
+                              int32_t first, mf_data_t *data) {
+  assert(file);
+  assert(query);
+  block_ref_t ref = block_ref(file, block);
+  if (!ref.desc) {
+    fprintf(stderr, "Error: file doesn't contain requested block\n");
+    return MF_ERROR_MISSING_PROPERTY;
+  }
+  if (first < 0 || first > ref.desc->num_objects) {
+    fprintf(stderr, "Error: first object %d is outside of the block of %d objects\n", first, ref.desc->num_objects);
+    return MF_ERROR_INVALID_READ_REQUEST;
+  }
+  return read_data(file, block, query, data, first);
+}
+
+mf_status_t mf_index_sum_block(mf_sum_file_t *file, mf_sum_block_t block, const int64_t **offsets) {
+  assert(file);
+  assert(offsets);
+  if (file->text) {
+    fprintf(stderr, "Error: record offsets are available only for binary files\n");
+    return MF_ERROR_UNSUPPORTED_FEATURE_REQUIRED;
+  }
+  block_ref_t ref = block_ref(file, block);
+  if (!ref.desc) {
+    fprintf(stderr, "Error: file doesn't contain requested block\n");
+    return MF_ERROR_MISSING_PROPERTY;
+  }
+  return get_record_index(file, block, file->map ? file->map + ref.offset : NULL, offsets);
+}
+
+mf_status_t mf_read_sum_cells(mf_sum_file_t *file, const mf_sum_block_query_t *query, const int32_t *objects,
+                              int32_t num_objects, mf_data_t *data) {
+  assert(file);
+  assert(query);
+  assert(num_objects >= 0);
+  if (file->text) {
+    fprintf(stderr, "Error: reading single objects is available only for binary files\n");
+    return MF_ERROR_UNSUPPORTED_FEATURE_REQUIRED;
+  }
+  const mf_arrays_t *desc = file->description->celldata;
+  if (!desc) {
+    fprintf(stderr, "Error: file doesn't contain requested block\n");
+    return MF_ERROR_MISSING_PROPERTY;
+  }
+  for (int32_t idx = 0; idx < num_objects; ++idx) {
+    if (objects[idx] < 0 || objects[idx] >= desc->num_objects) {
+      fprintf(stderr, "Error: object %d is outside of the block of %d objects\n", objects[idx], desc->num_objects);
+      return MF_ERROR_INVALID_READ_REQUEST;
     }
   }
-  if (request->srcdata) {
-    err = read_data(h, desc->srcdata, request->srcdata, attachment->srcdata, file->srcdata_offset);
-    if (err != MF_OK) {
-      return err;
+  if (query->num_items == 0 || num_objects == 0) {
+    return MF_OK;
+  }
+
+  block_layout_t layout;
+  mf_status_t err = resolve_query(desc, query, &layout);
+  if (err != MF_OK) {
+    return err;
+  }
+  err = read_cells(file, CELLDATA, &layout, objects, num_objects, data);
+  free_layout(&layout);
+  return err;
+}
+
+mf_status_t mf_view_sum_file(const mf_sum_file_t *file, const mf_sum_read_request_t *request,
+                             mf_sum_attachment_t *attachment) {
+  assert(file);
+  if (!file->map || file->text) {
+    fprintf(stderr, "Error: views are available only for binary files opened with mf_open_sum_file_mmap\n");
+    return MF_ERROR_INVALID_READ_REQUEST;
+  }
+  for (int block = 0; block < NUM_BLOCKS; ++block) {
+    const mf_sum_block_query_t *query = block_query(request, block);
+    if (query) {
+      block_ref_t ref = block_ref(file, block);
+      mf_status_t err = view_data(file, ref.desc, query, block_data(attachment, block), ref.offset);
+      if (err != MF_OK) {
+        return err;
+      }
     }
   }
-  if (request->fpcedata) {
-    err = read_data(h, desc->fpcedata, request->fpcedata, attachment->fpcedata, file->fpcedata_offset);
+  return MF_OK;
+}
+
+mf_status_t mf_compile_sum_plan(mf_sum_decode_plan_t **plan, const mf_sum_file_t *file,
+                                const mf_sum_read_request_t *request) {
+  assert(plan);
+  assert(file);
+  mf_sum_decode_plan_t *result = calloc(1, sizeof(mf_sum_decode_plan_t));
+  if (!result) {
+    fprintf(stderr, "Error: failed to allocate decode plan\n");
+    return MF_ERROR_FAILED_IO_OPERATION;
+  }
+  for (int block = 0; block < NUM_BLOCKS; ++block) {
+    const mf_sum_block_query_t *query = block_query(request, block);
+    if (!query || query->num_items == 0) {
+      continue;
+    }
+    block_ref_t ref = block_ref(file, block);
+    if (!ref.desc) {
+      fprintf(stderr, "Error: file doesn't contain requested block\n");
+      mf_free_sum_plan(result);
+      return MF_ERROR_MISSING_PROPERTY;
+    }
+    mf_status_t err = resolve_query(ref.desc, query, &result->blocks[block].resolved);
     if (err != MF_OK) {
+      mf_free_sum_plan(result);
       return err;
     }
+    result->blocks[block].used = true;
+    result->blocks[block].layout = ref.layout;
+  }
+  *plan = result;
+  return MF_OK;
+}
+
+mf_status_t mf_check_sum_plan(const mf_sum_decode_plan_t *plan, const mf_sum_file_t *file) {
+  assert(plan);
+  assert(file);
+  for (int block = 0; block < NUM_BLOCKS; ++block) {
+    if (!plan->blocks[block].used) {
+      continue;
+    }
+    block_ref_t ref = block_ref(file, block);
+    if (!ref.desc || ref.layout != plan->blocks[block].layout) {
+      return MF_ERROR_INVALID_READ_REQUEST;
+    }
   }
-  if (request->fpcodata) {
-    err = read_data(h, desc->fpcodata, request->fpcodata, attachment->fpcodata, file->fpcodata_offset);
+  return MF_OK;
+}
+
+mf_status_t mf_read_sum_file_with_plan(mf_sum_file_t *file, const mf_sum_decode_plan_t *plan,
+                                       mf_sum_attachment_t *attachment) {
+  if (mf_check_sum_plan(plan, file) != MF_OK) {
+    fprintf(stderr, "Error: record layout of the file differs from the one the plan was compiled for\n");
+    return MF_ERROR_INVALID_READ_REQUEST;
+  }
+  for (int block = 0; block < NUM_BLOCKS; ++block) {
+    if (!plan->blocks[block].used) {
+      continue;
+    }
+    mf_status_t err = read_block(file, block, &plan->blocks[block].resolved, block_data(attachment, block), 0);
     if (err != MF_OK) {
       return err;
     }
@@ -207,6 +574,16 @@ mf_status_t mf_read_sum_file(mf_sum_file_t *file, const mf_sum_read_request_t *r
   return MF_OK;
 }
 
+void mf_free_sum_plan(mf_sum_decode_plan_t *plan) {
+  if (!plan) {
+    return;
+  }
+  for (int block = 0; block < NUM_BLOCKS; ++block) {
+    free_layout(&plan->blocks[block].resolved);
+  }
+  free(plan);
+}
+
 mf_status_t mf_open_mvs_file(mf_mvs_file_t **file, const char *filename) {
   assert(file);
 
@@ -217,26 +594,59 @@ mf_status_t mf_open_mvs_file(mf_mvs_file_t **file, const char *filename) {
     return MF_ERROR_FAILED_IO_OPERATION;
   }
 
-  mf_mvs_file_t mvs_file;
+  mf_mvs_file_t mvs_file = {0};
   mvs_file.stream = stream;
+  source_t src = {.stream = stream};
 
-  mf_status_t err = read_file_format(&mvs_file.format, stream);
+  mf_status_t err = open_mvs(&mvs_file, &src);
   if (err != MF_OK) {
-    fprintf(stderr, "Error: failed to read file format\n");
     fclose(stream);
     return err;
   }
 
-  if (mvs_file.format != MF_BINARY) {
-    fprintf(stderr, "Error: only binary file format is currently supported\n");
-    fclose(stream);
-    return MF_ERROR_UNSUPPORTED_FEATURE_REQUIRED;
+  (*file) = malloc(sizeof(mf_mvs_file_t));
+  memcpy(*file, &mvs_file, sizeof(mf_mvs_file_t));
+
+  return MF_OK;
+}
+
+mf_status_t mf_open_mvs_file_mmap(mf_mvs_file_t **file, const char *filename) {
+  assert(file);
+
+  mf_mvs_file_t mvs_file = {0};
+  mf_status_t err = map_file(filename, &mvs_file.map, &mvs_file.map_size);
+  if (err != MF_OK) {
+    return err;
+  }
+  source_t src = {.map = mvs_file.map, .map_size = mvs_file.map_size};
+
+  err = open_mvs(&mvs_file, &src);
+  if (err != MF_OK) {
+    unmap_file(mvs_file.map, mvs_file.map_size);
+    return err;
+  }
+
+  (*file) = malloc(sizeof(mf_mvs_file_t));
+  memcpy(*file, &mvs_file, sizeof(mf_mvs_file_t));
+
+  return MF_OK;
+}
+
+mf_status_t open_mvs(mf_mvs_file_t *mvs_file, source_t *src) {
+  mf_status_t err = read_file_format(&mvs_file->format, src);
+  if (err != MF_OK) {
+    fprintf(stderr, "Error: failed to read file format\n");
+    return err;
+  }
+
+  if (mvs_file->format == MF_ASCII) {
+    return open_mvs_text(mvs_file, src);
   }
 
   mf_mvs_description_t *desc = calloc(1, sizeof(mf_mvs_description_t));
 
   header_t header;
-  checked(read_header(&header, stream), err);
+  checked(read_header(&header, src), err);
 
   if (memcmp(header.name, "GRIDDATA", 8)) {
     fprintf(stderr, "Error: expected 'GRIDDATA' block, got '%s'\n", header.name);
@@ -244,43 +654,46 @@ mf_status_t mf_open_mvs_file(mf_mvs_file_t **file, const char *filename) {
     goto on_error;
   }
 
-  checked(read_header(&header, stream), err);
+  checked(read_header(&header, src), err);
   if (memcmp(header.name, "GRIDSIZE", 8)) {
     fprintf(stderr, "Error: expected 'GRIDSIZE' record, got '%s'\n", header.name);
     err = MF_ERROR_INVALID_FILE;
     goto on_error;
   }
 
-  fread(&(desc->num_vertices), sizeof(int32_t), 1, stream);
-  fread(&(desc->num_cells), sizeof(int32_t), 1, stream);
+  checked(source_read(src, &desc->num_vertices, sizeof(int32_t)), err);
+  checked(source_read(src, &desc->num_cells, sizeof(int32_t)), err);
 
   assert(desc->num_vertices >= 0);
   assert(desc->num_cells >= 0);
 
-  mvs_file.description = desc;
-
-  checked(read_header(&header, stream), err);
+  checked(read_header(&header, src), err);
   if (memcmp(header.name, "POINTS  ", 8)) {
     fprintf(stderr, "Error: expected 'POINTS' record, got '%s'\n", header.name);
     err = MF_ERROR_INVALID_FILE;
     goto on_error;
   }
 
-  mvs_file.vertices_offset = ftell(stream);
-  fseek(stream, (long)header.size, SEEK_CUR);
+  mvs_file->vertices_offset = source_tell(src);
+  checked(source_skip(src, header.size), err);
 
-  checked(read_header(&header, stream), err);
+  checked(read_header(&header, src), err);
   if (memcmp(header.name, "CELLS   ", 8)) {
     fprintf(stderr, "Error: expected 'CELLS' record, got '%s'\n", header.name);
     err = MF_ERROR_INVALID_FILE;
     goto on_error;
   }
 
-  mvs_file.cells_offset = ftell(stream);
+  mvs_file->cells_offset = source_tell(src);
 
-  (*file) = malloc(sizeof(mf_mvs_file_t));
-  memcpy(*file, &mvs_file, sizeof(mf_mvs_file_t));
+  if (src->map && (mvs_file->vertices_offset + (int64_t)desc->num_vertices * 24 > src->map_size ||
+                   mvs_file->cells_offset + (int64_t)desc->num_cells * 36 > src->map_size)) {
+    fprintf(stderr, "Error: grid records exceed file size\n");
+    err = MF_ERROR_INVALID_FILE;
+    goto on_error;
+  }
 
+  mvs_file->description = desc;
   return MF_OK;
 
 on_error:
@@ -290,7 +703,12 @@ on_error:
 
 void mf_close_mvs_file(mf_mvs_file_t *file) {
   assert(file);
-  fclose(file->stream);
+  if (file->map) {
+    unmap_file(file->map, file->map_size);
+  } else {
+    fclose(file->stream);
+  }
+  free(file->owned_text);
   free(file->description);
   free(file);
 }
@@ -306,12 +724,30 @@ mf_status_t mf_read_mvs_file(mf_mvs_file_t *file, mf_mvs_attachment_t *data) {
 
   const mf_mvs_description_t *desc = file->description;
 
-  fseek(file->stream, (long)file->vertices_offset, SEEK_SET);
+  if (file->text) {
+    return read_text_mvs(file, data);
+  }
+  if (file->map) {
+    memcpy(data->points, file->map + file->vertices_offset, desc->num_vertices * 3 * sizeof(double));
+    const char *cell = file->map + file->cells_offset;
+    for (int32_t cell_idx = 0; cell_idx < desc->num_cells; ++cell_idx) {
+      memcpy(data->cell_ids + cell_idx, cell, sizeof(int32_t));
+      memcpy(data->cells + cell_idx, cell + sizeof(int32_t), 8 * sizeof(int32_t));
+      cell += 9 * sizeof(int32_t);
+    }
+    return MF_OK;
+  }
+
+  if (seek_stream(file->stream, file->vertices_offset, SEEK_SET) != 0) {
+    return MF_ERROR_FAILED_IO_OPERATION;
+  }
   for (int32_t vert_idx = 0; vert_idx < desc->num_vertices; ++vert_idx) {
     fread(data->points + vert_idx, 3 * sizeof(double), 1, file->stream);
   }
 
-  fseek(file->stream, (long)file->cells_offset, SEEK_SET);
+  if (seek_stream(file->stream, file->cells_offset, SEEK_SET) != 0) {
+    return MF_ERROR_FAILED_IO_OPERATION;
+  }
   for (int32_t cell_idx = 0; cell_idx < desc->num_cells; ++cell_idx) {
     fread(data->cell_ids + cell_idx, sizeof(int32_t), 1, file->stream);
     fread(data->cells + cell_idx, 8 * sizeof(int32_t), 1, file->stream);
@@ -320,148 +756,422 @@ mf_status_t mf_read_mvs_file(mf_mvs_file_t *file, mf_mvs_attachment_t *data) {
   return MF_OK;
 }
 
+// Records are interleaved into a staging buffer which is written in chunks of about this size
+#define WRITE_CHUNK_SIZE (1 << 20)
+
 mf_status_t mf_write_sum_file(FILE *stream, const mf_sum_description_t *desc, mf_sum_attachment_t *data) {
   assert(stream);
   assert(desc);
   assert(data);
 
   int64_t record_size;
+  mf_status_t err = MF_OK;
 
   fwrite("BINARY  ", 1, 8, stream);
   record_size = 0;
   fwrite(&record_size, 8, 1, stream);
 
+  if (desc->time) {
+    char record[16];
+    memcpy(record, &desc->time->value, 8);
+    memset(record + 8, ' ', 8);
+    memcpy(record + 8, desc->time->dimension, strnlen(desc->time->dimension, 8));
+    fwrite("TIME    ", 1, 8, stream);
+    record_size = 16;
+    fwrite(&record_size, 8, 1, stream);
+    fwrite(record, 1, 16, stream);
+  }
+
+  if (desc->date) {
+    char record[16];
+    memcpy(record, &desc->date->day, 4);
+    memset(record + 4, ' ', 8);
+    memcpy(record + 4, desc->date->month, strnlen(desc->date->month, 8));
+    memcpy(record + 12, &desc->date->year, 4);
+    fwrite("DATE    ", 1, 8, stream);
+    record_size = 16;
+    fwrite(&record_size, 8, 1, stream);
+    fwrite(record, 1, 16, stream);
+  }
+
   if (desc->celldata) {
-    write_block(stream, "CELLDATA", desc->celldata, data->celldata);
+    checked(write_block(stream, "CELLDATA", desc->celldata, data->celldata), err);
   }
 
   if (desc->conndata) {
-    write_block(stream, "CONNDATA", desc->conndata, data->conndata);
+    checked(write_block(stream, "CONNDATA", desc->conndata, data->conndata), err);
   }
 
   if (desc->fpcedata) {
-    write_block(stream, "FPCEDATA", desc->fpcedata, data->fpcedata);
+    checked(write_block(stream, "FPCEDATA", desc->fpcedata, data->fpcedata), err);
   }
 
   if (desc->fpcodata) {
-    write_block(stream, "FPCODATA", desc->fpcodata, data->fpcodata);
+    checked(write_block(stream, "FPCODATA", desc->fpcodata, data->fpcodata), err);
   }
 
   if (desc->srcdata) {
-    write_block(stream, "SRCDATA ", desc->srcdata, data->srcdata);
+    checked(write_block(stream, "SRCDATA ", desc->srcdata, data->srcdata), err);
   }
 
   fwrite("ENDFILE ", 1, 8, stream);
   record_size = 0;
   fwrite(&record_size, 8, 1, stream);
 
-  return MF_OK;
+  return ferror(stream) ? MF_ERROR_FAILED_IO_OPERATION : MF_OK;
+
+on_error:
+  return err;
 }
 
 mf_status_t mf_write_mvs_file(FILE *stream, const mf_mvs_description_t *desc, mf_mvs_attachment_t *data) {
-  printf("Unsupported\n");
-  stream = NULL;
-  desc = NULL;
-  data = NULL;
-  return MF_ERROR_UNSUPPORTED_FEATURE_REQUIRED;
-}
+  assert(stream);
+  assert(desc);
+  assert(data);
+  assert(desc->num_vertices >= 0);
+  assert(desc->num_cells >= 0);
 
-mf_status_t read_header(header_t *h, FILE *stream) {
-  char buf[16];
-  fread(buf, 16, 1, stream);
-  check_state(stream);
-  memcpy(h->name, buf, 8);
-  h->name[8] = '\0';
-  memcpy(&h->size, buf + 8, 8);
-  return MF_OK;
-}
+  int64_t record_size = 0;
+  fwrite("BINARY  ", 1, 8, stream);
+  fwrite(&record_size, 8, 1, stream);
+  fwrite("GRIDDATA", 1, 8, stream);
+  fwrite(&record_size, 8, 1, stream);
 
-mf_status_t read_file_format(mf_file_format_t *format, FILE *stream) {
-  header_t header;
-  mf_status_t err = read_header(&header, stream);
-  if (err != MF_OK) {
-    return err;
+  record_size = 8;
+  fwrite("GRIDSIZE", 1, 8, stream);
+  fwrite(&record_size, 8, 1, stream);
+  fwrite(&desc->num_vertices, 4, 1, stream);
+  fwrite(&desc->num_cells, 4, 1, stream);
+
+  // Points are stored exactly as in the attachment
+  record_size = (int64_t)desc->num_vertices * 24;
+  fwrite("POINTS  ", 1, 8, stream);
+  fwrite(&record_size, 8, 1, stream);
+  if (desc->num_vertices > 0) {
+    fwrite(data->points, 3 * sizeof(double), desc->num_vertices, stream);
   }
-  if (header.size != 0) {
-    return MF_ERROR_INVALID_FILE;
+
+  // Every cell is its ID followed by eight vertex indices
+  record_size = (int64_t)desc->num_cells * 36;
+  fwrite("CELLS   ", 1, 8, stream);
+  fwrite(&record_size, 8, 1, stream);
+  int32_t chunk_cells = WRITE_CHUNK_SIZE / 36;
+  char *chunk = malloc((size_t)chunk_cells * 36);
+  if (!chunk) {
+    fprintf(stderr, "Error: failed to allocate buffer for writing cells\n");
+    return MF_ERROR_FAILED_IO_OPERATION;
   }
-  if (!memcmp(header.name, "BINARY  ", 8)) {
-    *format = MF_BINARY;
-  } else if (!memcmp(header.name, "ASCII   ", 8)) {
-    *format = MF_ASCII;
-  } else {
-    fprintf(stderr, "Error: unrecognized file format '%s'\n", header.name);
-    return MF_ERROR_INVALID_FILE;
+  for (int32_t first = 0; first < desc->num_cells; first += chunk_cells) {
+    int32_t count = desc->num_cells - first < chunk_cells ? desc->num_cells - first : chunk_cells;
+    for (int32_t cell_idx = 0; cell_idx < count; ++cell_idx) {
+      memcpy(chunk + 36 * cell_idx, data->cell_ids + first + cell_idx, sizeof(int32_t));
+      memcpy(chunk + 36 * cell_idx + 4, data->cells[first + cell_idx], 8 * sizeof(int32_t));
+    }
+    fwrite(chunk, 36, count, stream);
   }
-  return MF_OK;
-}
+  free(chunk);
 
-mf_status_t read_time(mf_time_t *t, FILE *stream) {
-  char buf[16];
-  fread(buf, 16, 1, stream);
-  check_state(stream);
-  memcpy(&t->value, buf, 8);
-  memcpy(t->dimension, buf + 8, 8);
-  t->dimension[8] = '\0';
-  return MF_OK;
+  return ferror(stream) ? MF_ERROR_FAILED_IO_OPERATION : MF_OK;
 }
 
-mf_status_t read_date(mf_date_t *d, FILE *stream) {
-  char buf[16];
-  fread(buf, 16, 1, stream);
-  check_state(stream);
-  memcpy(&d->day, buf, 4);
-  memcpy(d->month, buf + 4, 8);
-  d->month[8] = '\0';
-  memcpy(&d->year, buf + 12, 4);
-  return MF_OK;
+double monotonic_seconds(void) {
+#ifdef CLOCK_MONOTONIC
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + 1e-9 * ts.tv_nsec;
+#else
+  return (double)clock() / CLOCKS_PER_SEC;
+#endif
 }
 
-mf_status_t read_arrays(mf_arrays_t *arrays, int64_t *offset, int64_t *size, FILE *stream) {
-  header_t header;
-  mf_status_t err = MF_OK;
-  checked(read_header(&header, stream), err);
+// long is 32 bits wide on Windows and on 32-bit platforms, so fseek and ftell cannot address large files there
+int seek_stream(FILE *stream, int64_t offset, int whence) {
+#ifdef _WIN32
+  return _fseeki64(stream, offset, whence);
+#else
+  return fseeko(stream, (off_t)offset, whence);
+#endif
+}
 
-  assert(!memcmp(header.name, "ARRAYS  ", 8));
-  char *buf = malloc(header.size);
-  assert(buf);
+int64_t tell_stream(FILE *stream) {
+#ifdef _WIN32
+  return _ftelli64(stream);
+#else
+  return ftello(stream);
+#endif
+}
 
-  fread(buf, header.size, 1, stream);
-  if (ferror(stream)) {
-    err = MF_ERROR_FAILED_IO_OPERATION;
-    goto on_buf_error;
+mf_status_t map_file(const char *filename, const char **map, int64_t *size) {
+#ifdef MF_HAVE_MMAP
+  int fd = open(filename, O_RDONLY);
+  if (fd < 0) {
+    fprintf(stderr, "Error: failed to open file '%s'\n", filename);
+    perror("System error");
+    return MF_ERROR_FAILED_IO_OPERATION;
   }
-  if (feof(stream)) {
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    fprintf(stderr, "Error: failed to query size of file '%s'\n", filename);
+    perror("System error");
+    close(fd);
+    return MF_ERROR_FAILED_IO_OPERATION;
+  }
+  if (st.st_size == 0) {
+    fprintf(stderr, "Error: file '%s' is empty\n", filename);
+    close(fd);
+    return MF_ERROR_INVALID_FILE;
+  }
+  if ((off_t)(size_t)st.st_size != st.st_size) {
+    fprintf(stderr, "Error: file '%s' is too large to be mapped into the address space\n", filename);
+    close(fd);
+    return MF_ERROR_UNSUPPORTED_FEATURE_REQUIRED;
+  }
+  void *addr = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  // The mapping keeps its own reference to the file
+  close(fd);
+  if (addr == MAP_FAILED) {
+    fprintf(stderr, "Error: failed to map file '%s'\n", filename);
+    perror("System error");
+    return MF_ERROR_FAILED_IO_OPERATION;
+  }
+  *map = addr;
+  *size = st.st_size;
+  return MF_OK;
+#else
+  (void)filename;
+  (void)map;
+  (void)size;
+  fprintf(stderr, "Error: memory-mapped files are not supported on this platform\n");
+  return MF_ERROR_UNSUPPORTED_FEATURE_REQUIRED;
+#endif
+}
+
+void unmap_file(const char *map, int64_t size) {
+#ifdef MF_HAVE_MMAP
+  munmap((void *)map, (size_t)size);
+#else
+  (void)map;
+  (void)size;
+#endif
+}
+
+mf_status_t source_read(source_t *src, void *dst, int64_t size) {
+  if (src->map) {
+    if (size > src->map_size - src->pos) {
+      src->pos = src->map_size;
+      return MF_ERROR_INVALID_FILE;
+    }
+    memcpy(dst, src->map + src->pos, size);
+    src->pos += size;
+    src->bytes_read += size;
+    return MF_OK;
+  }
+  fread(dst, size, 1, src->stream);
+  check_state(src->stream);
+  src->bytes_read += size;
+  return MF_OK;
+}
+
+mf_status_t source_skip(source_t *src, int64_t size) {
+  if (src->map) {
+    if (size < 0 || size > src->map_size - src->pos) {
+      return MF_ERROR_INVALID_FILE;
+    }
+    src->pos += size;
+    return MF_OK;
+  }
+  if (seek_stream(src->stream, size, SEEK_CUR) != 0) {
+    return MF_ERROR_FAILED_IO_OPERATION;
+  }
+  return MF_OK;
+}
+
+int64_t source_tell(const source_t *src) { return src->map ? src->pos : tell_stream(src->stream); }
+
+mf_status_t read_header(header_t *h, source_t *src) {
+  char buf[16];
+  mf_status_t err = source_read(src, buf, 16);
+  if (err != MF_OK) {
+    return err;
+  }
+  memcpy(h->name, buf, 8);
+  h->name[8] = '\0';
+  memcpy(&h->size, buf + 8, 8);
+  return MF_OK;
+}
+
+mf_status_t read_file_format(mf_file_format_t *format, source_t *src) {
+  header_t header;
+  mf_status_t err = read_header(&header, src);
+  if (err != MF_OK) {
+    return err;
+  }
+  // ASCII files are text throughout, so the size field holds the following characters
+  if (!memcmp(header.name, "ASCII", 5) && (unsigned char)header.name[5] <= ' ') {
+    *format = MF_ASCII;
+    return MF_OK;
+  }
+  if (header.size != 0) {
+    return MF_ERROR_INVALID_FILE;
+  }
+  if (!memcmp(header.name, "BINARY  ", 8)) {
+    *format = MF_BINARY;
+  } else {
+    fprintf(stderr, "Error: unrecognized file format '%s'\n", header.name);
+    return MF_ERROR_INVALID_FILE;
+  }
+  return MF_OK;
+}
+
+mf_status_t read_time(mf_time_t *t, source_t *src) {
+  char buf[16];
+  mf_status_t err = source_read(src, buf, 16);
+  if (err != MF_OK) {
+    return err;
+  }
+  memcpy(&t->value, buf, 8);
+  memcpy(t->dimension, buf + 8, 8);
+  t->dimension[8] = '\0';
+  return MF_OK;
+}
+
+mf_status_t read_date(mf_date_t *d, source_t *src) {
+  char buf[16];
+  mf_status_t err = source_read(src, buf, 16);
+  if (err != MF_OK) {
+    return err;
+  }
+  memcpy(&d->day, buf, 4);
+  memcpy(d->month, buf + 4, 8);
+  d->month[8] = '\0';
+  memcpy(&d->year, buf + 12, 4);
+  return MF_OK;
+}
+
+#define FNV_OFFSET 14695981039346656037ULL
+
+static uint64_t hash_bytes(uint64_t hash, const char *bytes, int64_t size) {
+  for (int64_t idx = 0; idx < size; ++idx) {
+    hash = (hash ^ (unsigned char)bytes[idx]) * 1099511628211ULL;
+  }
+  return hash;
+}
+
+enum { TAG_KNOWN, TAG_END, TAG_UNKNOWN };
+
+// Tags are told apart by their first letter, so every tag costs at most two 8-byte comparisons
+static int parse_tag(const char *tag, mf_property_t *prop) {
+  switch (tag[0]) {
+  case 'I':
+    if (!memcmp(tag, "INT1    ", 8)) {
+      prop->data_type = MF_INT1;
+    } else if (!memcmp(tag, "INT2    ", 8)) {
+      prop->data_type = MF_INT2;
+    } else if (!memcmp(tag, "INT4    ", 8)) {
+      prop->data_type = MF_INT4;
+    } else {
+      return TAG_UNKNOWN;
+    }
+    return TAG_KNOWN;
+  case 'R':
+    if (!memcmp(tag, "REAL4   ", 8)) {
+      prop->data_type = MF_REAL4;
+    } else if (!memcmp(tag, "REAL8   ", 8)) {
+      prop->data_type = MF_REAL8;
+    } else {
+      return TAG_UNKNOWN;
+    }
+    return TAG_KNOWN;
+  case 'C':
+    if (!memcmp(tag, "CHAR4   ", 8)) {
+      prop->data_type = MF_CHAR4;
+    } else if (!memcmp(tag, "CHAR8   ", 8)) {
+      prop->data_type = MF_CHAR8;
+    } else {
+      return TAG_UNKNOWN;
+    }
+    return TAG_KNOWN;
+  case 'S':
+    if (!memcmp(tag, "SINGLE  ", 8)) {
+      prop->output_mode = MF_SINGLE;
+    } else if (!memcmp(tag, "STATE0  ", 8)) {
+      prop->phase_state = MF_STATE0;
+    } else if (!memcmp(tag, "STATE1  ", 8)) {
+      prop->phase_state = MF_STATE1;
+    } else {
+      return TAG_UNKNOWN;
+    }
+    return TAG_KNOWN;
+  case 'D':
+    if (!memcmp(tag, "DOUBLE  ", 8)) {
+      prop->output_mode = MF_DOUBLE;
+      return TAG_KNOWN;
+    }
+    return TAG_UNKNOWN;
+  case 'E':
+    return memcmp(tag, "ENDITEM ", 8) ? TAG_UNKNOWN : TAG_END;
+  default:
+    return TAG_UNKNOWN;
+  }
+}
+
+// Reads the next `size` bytes of an ARRAYS record of which `*left` bytes remain
+static mf_status_t read_arrays_bytes(source_t *src, void *dst, int64_t size, int64_t *left) {
+  if (*left < size) {
+    fprintf(stderr, "Error: ARRAYS record is truncated\n");
+    return MF_ERROR_INVALID_FILE;
+  }
+  *left -= size;
+  return source_read(src, dst, size);
+}
+
+// Property descriptors are parsed while they are read, so the record is never loaded as a whole
+mf_status_t read_arrays(mf_arrays_t *arrays, int64_t *offset, int64_t *size, uint64_t *layout, source_t *src) {
+  double start = monotonic_seconds();
+  header_t header;
+  mf_status_t err = MF_OK;
+  checked(read_header(&header, src), err);
+
+  assert(!memcmp(header.name, "ARRAYS  ", 8));
+  if (header.size < 8) {
     err = MF_ERROR_INVALID_FILE;
-    goto on_buf_error;
+    goto on_error;
   }
 
-  memcpy(&arrays->num_properties, buf, 4);
-  memcpy(&arrays->num_objects, buf + 4, 4);
+  int64_t left = header.size;
+  char counts[8];
+  checked(read_arrays_bytes(src, counts, 8, &left), err);
+  memcpy(&arrays->num_properties, counts, 4);
+  memcpy(&arrays->num_objects, counts + 4, 4);
 
   assert(arrays->num_properties >= 0);
   assert(arrays->num_objects >= 0);
 
   if (arrays->num_properties == 0) {
-    free(buf);
+    checked(source_skip(src, left), err);
     arrays->properties = NULL;
+    *layout = FNV_OFFSET;
+    src->arrays_seconds += monotonic_seconds() - start;
     return MF_OK;
   }
 
   arrays->properties = calloc(arrays->num_properties, sizeof(mf_property_t));
   assert(arrays->properties);
 
-  char *prop_buf = buf + 8;
+  uint64_t hash = hash_bytes(FNV_OFFSET, counts, 4);
   for (int32_t i = 0; i < arrays->num_properties; ++i) {
     mf_property_t *prop = arrays->properties + i;
+    // Mnemonic, dimension and up to three tags followed by ENDITEM
+    char prop_buf[16 + 4 * 8];
+    err = read_arrays_bytes(src, prop_buf, 16, &left);
+    if (err != MF_OK) {
+      goto on_prop_error;
+    }
     memcpy(&prop->name, prop_buf, 8);
     prop->name[8] = '\0';
 
     memcpy(prop->dimension, prop_buf + 8, 8);
 
-    char tag[9];
-    tag[8] = '\0';
-
     // Defaults
     prop->data_type = MF_REAL8;
     prop->output_mode = MF_SINGLE;
@@ -469,43 +1179,37 @@ mf_status_t read_arrays(mf_arrays_t *arrays, int64_t *offset, int64_t *size, FIL
 
     int tag_idx = 0;
     for (; tag_idx < 3; ++tag_idx) {
-      memcpy(tag, prop_buf + 16 + tag_idx * 8, 8);
-
-      if (!strcmp(tag, "INT1    ")) {
-        prop->data_type = MF_INT1;
-      } else if (!strcmp(tag, "INT2    ")) {
-        prop->data_type = MF_INT2;
-      } else if (!strcmp(tag, "INT4    ")) {
-        prop->data_type = MF_INT4;
-      } else if (!strcmp(tag, "REAL4   ")) {
-        prop->data_type = MF_REAL4;
-      } else if (!strcmp(tag, "REAL8   ")) {
-        prop->data_type = MF_REAL8;
-      } else if (!strcmp(tag, "CHAR4   ")) {
-        prop->data_type = MF_CHAR4;
-      } else if (!strcmp(tag, "CHAR8   ")) {
-        prop->data_type = MF_CHAR8;
-      } else if (!strcmp(tag, "SINGLE  ")) {
-        prop->output_mode = MF_SINGLE;
-      } else if (!strcmp(tag, "DOUBLE  ")) {
-        prop->output_mode = MF_DOUBLE;
-      } else if (!strcmp(tag, "STATE0  ")) {
-        prop->phase_state = MF_STATE0;
-      } else if (!strcmp(tag, "STATE1  ")) {
-        prop->phase_state = MF_STATE1;
-      } else if (!strcmp(tag, "ENDITEM ")) {
+      char *tag = prop_buf + 16 + tag_idx * 8;
+      err = read_arrays_bytes(src, tag, 8, &left);
+      if (err != MF_OK) {
+        goto on_prop_error;
+      }
+      int kind = parse_tag(tag, prop);
+      if (kind == TAG_END) {
         break;
-      } else {
-        fprintf(stderr, "Error: unknown tag '%s'\n", tag);
+      }
+      if (kind == TAG_UNKNOWN) {
+        fprintf(stderr, "Error: unknown tag '%.8s'\n", tag);
         err = MF_ERROR_INVALID_FILE;
         goto on_prop_error;
       }
     }
+    // ENDITEM after three tags
+    if (tag_idx == 3) {
+      err = read_arrays_bytes(src, prop_buf + 40, 8, &left);
+      if (err != MF_OK) {
+        goto on_prop_error;
+      }
+    }
 
-    prop_buf += 16 + (tag_idx + 1) * 8;
+    hash = hash_bytes(hash, prop_buf, 16 + (tag_idx + 1) * 8);
   }
+  *layout = hash;
 
-  err = read_header(&header, stream);
+  err = source_skip(src, left);
+  if (err == MF_OK) {
+    err = read_header(&header, src);
+  }
   if (err != MF_OK) {
     goto on_prop_error;
   }
@@ -513,22 +1217,22 @@ mf_status_t read_arrays(mf_arrays_t *arrays, int64_t *offset, int64_t *size, FIL
   assert(!strcmp(header.name, "DATA    "));
   assert(header.size >= 0);
 
-  *offset = ftell(stream);
+  *offset = source_tell(src);
   *size = header.size;
 
-  fseek(stream, (long)header.size + 16, SEEK_CUR);
-
-  free(buf);
+  err = source_skip(src, header.size + 16);
+  if (err != MF_OK) {
+    fprintf(stderr, "Error: DATA record exceeds file size\n");
+    goto on_prop_error;
+  }
 
+  src->arrays_seconds += monotonic_seconds() - start;
   return MF_OK;
 
 on_prop_error:
   free(arrays->properties);
   arrays->properties = NULL;
 
-on_buf_error:
-  free(buf);
-
 on_error:
   return err;
 }
@@ -562,6 +1266,7 @@ void free_sum_description(mf_sum_description_t *desc) {
   if (desc->fpcodata) {
     free_arrays(desc->fpcodata);
   }
+  free(desc);
 }
 
 static int elem_size(mf_data_type_t type) {
@@ -581,24 +1286,227 @@ static int elem_size(mf_data_type_t type) {
   return -1;
 }
 
-static mf_status_t read_data(FILE *stream, const mf_arrays_t *desc, const mf_sum_block_query_t *query, mf_data_t *data,
-                             int64_t offset) {
+#ifdef MF_HAVE_X86_SIMD
+// Gather kernels extract one column of fixed-size records into a contiguous array and return the number of elements
+// copied, the rest is left to the scalar loop. Elements of 1 and 2 bytes are gathered as 4-byte words and narrowed,
+// so the last elements, whose words would extend past the last element, are never gathered
+__attribute__((target("avx2"))) static int32_t gather_avx2(char *dst, const char *src, size_t src_stride, int size,
+                                                           int32_t count) {
+  int32_t s = (int32_t)src_stride;
+  int32_t idx = 0;
+  if (size == 8) {
+    __m128i offsets = _mm_setr_epi32(0, s, 2 * s, 3 * s);
+    for (; idx + 4 <= count; idx += 4) {
+      __m256i v = _mm256_i32gather_epi64((const long long *)(src + idx * src_stride), offsets, 1);
+      _mm256_storeu_si256((__m256i *)(dst + idx * 8), v);
+    }
+    return idx;
+  }
+
+  __m256i offsets = _mm256_setr_epi32(0, s, 2 * s, 3 * s, 4 * s, 5 * s, 6 * s, 7 * s);
+  int32_t limit = count - (4 - size + s - 1) / s;
+  for (; idx + 8 <= limit; idx += 8) {
+    __m256i v = _mm256_i32gather_epi32((const int *)(src + idx * src_stride), offsets, 1);
+    if (size == 4) {
+      _mm256_storeu_si256((__m256i *)(dst + idx * 4), v);
+    } else if (size == 2) {
+      // Low halves of the words are packed within both 128-bit lanes, then the lanes are joined
+      v = _mm256_shuffle_epi8(v, _mm256_setr_epi8(0, 1, 4, 5, 8, 9, 12, 13, -1, -1, -1, -1, -1, -1, -1, -1, 0, 1, 4,
+                                                  5, 8, 9, 12, 13, -1, -1, -1, -1, -1, -1, -1, -1));
+      v = _mm256_permute4x64_epi64(v, 0x08);
+      _mm_storeu_si128((__m128i *)(dst + idx * 2), _mm256_castsi256_si128(v));
+    } else {
+      v = _mm256_shuffle_epi8(v, _mm256_setr_epi8(0, 4, 8, 12, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 0, 4,
+                                                  8, 12, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1));
+      v = _mm256_permutevar8x32_epi32(v, _mm256_setr_epi32(0, 4, 1, 1, 1, 1, 1, 1));
+      _mm_storel_epi64((__m128i *)(dst + idx), _mm256_castsi256_si128(v));
+    }
+  }
+  return idx;
+}
+
+__attribute__((target("avx512f"))) static int32_t gather_avx512(char *dst, const char *src, size_t src_stride,
+                                                                int size, int32_t count) {
+  int32_t s = (int32_t)src_stride;
+  int32_t idx = 0;
+  if (size == 8) {
+    __m256i offsets = _mm256_setr_epi32(0, s, 2 * s, 3 * s, 4 * s, 5 * s, 6 * s, 7 * s);
+    for (; idx + 8 <= count; idx += 8) {
+      __m512i v = _mm512_i32gather_epi64(offsets, src + idx * src_stride, 1);
+      _mm512_storeu_si512(dst + idx * 8, v);
+    }
+    return idx;
+  }
+
+  __m512i offsets = _mm512_mullo_epi32(_mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15),
+                                       _mm512_set1_epi32(s));
+  int32_t limit = count - (4 - size + s - 1) / s;
+  for (; idx + 16 <= limit; idx += 16) {
+    __m512i v = _mm512_i32gather_epi32(offsets, src + idx * src_stride, 1);
+    if (size == 4) {
+      _mm512_storeu_si512(dst + idx * 4, v);
+    } else if (size == 2) {
+      _mm256_storeu_si256((__m256i *)(dst + idx * 2), _mm512_cvtepi32_epi16(v));
+    } else {
+      _mm_storeu_si128((__m128i *)(dst + idx), _mm512_cvtepi32_epi8(v));
+    }
+  }
+  return idx;
+}
+#endif
+
+// Copies `count` elements of `size` bytes between two strided arrays; constant-size memcpy calls let the compiler
+// turn each case into plain loads and stores
+static void copy_strided(char *dst, size_t dst_stride, const char *src, size_t src_stride, int size, int32_t count) {
+#ifdef MF_HAVE_X86_SIMD
+  // Offsets of a whole vector of records must fit into 32-bit gather indices
+  if (dst_stride == (size_t)size && src_stride <= INT32_MAX / 16 &&
+      (size == 1 || size == 2 || size == 4 || size == 8)) {
+    int32_t done = 0;
+    if (__builtin_cpu_supports("avx512f")) {
+      done = gather_avx512(dst, src, src_stride, size, count);
+    } else if (__builtin_cpu_supports("avx2")) {
+      done = gather_avx2(dst, src, src_stride, size, count);
+    }
+    dst += done * dst_stride;
+    src += done * src_stride;
+    count -= done;
+  }
+#endif
+  switch (size) {
+  case 1:
+    for (int32_t idx = 0; idx < count; ++idx) {
+      dst[idx * dst_stride] = src[idx * src_stride];
+    }
+    break;
+  case 2:
+    for (int32_t idx = 0; idx < count; ++idx) {
+      memcpy(dst + idx * dst_stride, src + idx * src_stride, 2);
+    }
+    break;
+  case 4:
+    for (int32_t idx = 0; idx < count; ++idx) {
+      memcpy(dst + idx * dst_stride, src + idx * src_stride, 4);
+    }
+    break;
+  case 8:
+    for (int32_t idx = 0; idx < count; ++idx) {
+      memcpy(dst + idx * dst_stride, src + idx * src_stride, 8);
+    }
+    break;
+  default:
+    for (int32_t idx = 0; idx < count; ++idx) {
+      memcpy(dst + idx * dst_stride, src + idx * src_stride, size);
+    }
+    break;
+  }
+}
+
+// Every property of the block is STATE0, so all records have the same size and each requested property is a strided
+// array inside the block
+static void decode_fixed(const char *block, const block_layout_t *layout, int32_t num_objects, mf_data_t *data) {
+  for (int32_t op_idx = 0; op_idx < layout->num_ops; ++op_idx) {
+    const copy_op_t *op = &layout->ops[op_idx];
+    mf_data_t *dst = &data[op->req_idx];
+    int32_t count = dst->count < num_objects ? dst->count : num_objects;
+    if (op->is_double) {
+      char **bytes = dst->bytes;
+      copy_strided(bytes[0], dst->stride, block + op->offset, layout->record_size, op->size, count);
+      copy_strided(bytes[1], dst->stride, block + op->offset + op->size, layout->record_size, op->size, count);
+    } else {
+      copy_strided(dst->bytes, dst->stride, block + op->offset, layout->record_size, op->size, count);
+    }
+  }
+}
+
+// Decodes the record at `*pos` and moves `*pos` past it. Requested properties go to element `dst_idx` of their
+// destinations, records with a negative `dst_idx` are only skipped
+static mf_status_t decode_record(const char **pos, const char *end, const mf_arrays_t *desc,
+                                 const block_layout_t *layout, int32_t obj_idx, int32_t dst_idx, mf_data_t *data) {
+  int8_t phst = -1;
+  for (int32_t prop_idx = 0; prop_idx < desc->num_properties; ++prop_idx) {
+    const mf_property_t *prop = &desc->properties[prop_idx];
+    if (prop_idx == layout->phst_idx) {
+      if (*pos >= end) {
+        return MF_ERROR_INVALID_FILE;
+      }
+      phst = *(const int8_t *)*pos;
+      if (phst <= 0) {
+        phst = 1;
+      }
+    }
+
+    size_t bytes_per_item = layout->element_sizes[prop_idx];
+    if (prop->phase_state == MF_STATE1) {
+      if (phst < 0) {
+        fprintf(stderr, "Error: property '%s' is defined per phase, but PHST is not known\n", prop->name);
+        return MF_ERROR_INVALID_FILE;
+      }
+      bytes_per_item *= phst;
+    }
+    size_t bytes_total = prop->output_mode == MF_DOUBLE ? 2 * bytes_per_item : bytes_per_item;
+    if ((size_t)(end - *pos) < bytes_total) {
+      fprintf(stderr, "Error: data block is truncated at object %d\n", obj_idx);
+      return MF_ERROR_INVALID_FILE;
+    }
+
+    int32_t req_idx = layout->req_indices[prop_idx];
+    if (req_idx >= 0 && dst_idx >= 0 && dst_idx < data[req_idx].count) {
+      // Destinations of STATE1 properties must reserve room for all phases of an object
+      if (bytes_per_item > data[req_idx].stride && prop->phase_state == MF_STATE1) {
+        fprintf(stderr, "Error: property '%s' has %d phases at object %d, destination stride is %zu bytes\n",
+                prop->name, phst, obj_idx, data[req_idx].stride);
+        return MF_ERROR_INVALID_READ_REQUEST;
+      }
+      size_t dst_pos = data[req_idx].stride * dst_idx;
+      if (prop->output_mode == MF_DOUBLE) {
+        char **dst = data[req_idx].bytes;
+        memcpy(dst[0] + dst_pos, *pos, bytes_per_item);
+        memcpy(dst[1] + dst_pos, *pos + bytes_per_item, bytes_per_item);
+      } else {
+        char *dst = data[req_idx].bytes;
+        memcpy(dst + dst_pos, *pos, bytes_per_item);
+      }
+    }
+    *pos += bytes_total;
+  }
+  return MF_OK;
+}
+
+// Some properties are STATE1, so record sizes depend on the value of PHST of each object and records have to be
+// walked one by one; records before `first` are only skipped
+static mf_status_t decode_variable(const char *block, int64_t block_size, const mf_arrays_t *desc,
+                                   const block_layout_t *layout, int32_t first, int32_t max_count, mf_data_t *data) {
+  const char *pos = block;
+  const char *end = block + block_size;
+  for (int32_t obj_idx = 0; obj_idx < first + max_count; ++obj_idx) {
+    mf_status_t err = decode_record(&pos, end, desc, layout, obj_idx, obj_idx - first, data);
+    if (err != MF_OK) {
+      return err;
+    }
+  }
+  return MF_OK;
+}
+
+mf_status_t resolve_query(const mf_arrays_t *desc, const mf_sum_block_query_t *query, block_layout_t *layout) {
   if (desc->num_properties < query->num_items) {
     fprintf(stderr, "Error: number of requested properties exceeds number of "
                     "properties inside block\n");
     return MF_ERROR_INVALID_READ_REQUEST;
   }
-  assert(query->num_items >= 0);
-  if (query->num_items == 0) {
-    return MF_OK;
-  }
 
-  int32_t *req_indices = calloc(desc->num_properties, sizeof(int32_t));
-  fill_array(req_indices, desc->num_properties, -1);
-  int *element_sizes = calloc(desc->num_properties, sizeof(int));
+  layout->num_items = query->num_items;
+  layout->req_indices = calloc(desc->num_properties + 1, sizeof(int32_t));
+  layout->element_sizes = calloc(desc->num_properties + 1, sizeof(int));
+  layout->ops = calloc(query->num_items + 1, sizeof(copy_op_t));
+  layout->num_ops = 0;
+  if (!layout->req_indices || !layout->element_sizes || !layout->ops) {
+    fprintf(stderr, "Error: failed to allocate layout of %d properties\n", desc->num_properties);
+    free_layout(layout);
+    return MF_ERROR_FAILED_IO_OPERATION;
+  }
+  fill_array(layout->req_indices, desc->num_properties, -1);
 
-  mf_status_t err = MF_OK;
-  int32_t max_count = 0;
   for (int32_t req_idx = 0; req_idx < query->num_items; ++req_idx) {
     bool found = false;
     for (int32_t prop_idx = 0; prop_idx < desc->num_properties; ++prop_idx) {
@@ -606,185 +1514,2253 @@ static mf_status_t read_data(FILE *stream, const mf_arrays_t *desc, const mf_sum
       if (memcmp(query->names[req_idx], prop->name, 8)) {
         continue;
       }
-      req_indices[prop_idx] = req_idx;
+      layout->req_indices[prop_idx] = req_idx;
       found = true;
       break;
     }
     if (!found) {
       fprintf(stderr, "Error: file doesn't contain property '%s'\n", query->names[req_idx]);
-      err = MF_ERROR_MISSING_PROPERTY;
-      goto on_error;
+      free_layout(layout);
+      return MF_ERROR_MISSING_PROPERTY;
     }
-    max_count = max_count > data[req_idx].count ? max_count : data[req_idx].count;
   }
-  max_count = max_count < desc->num_objects ? max_count : desc->num_objects;
 
-  int32_t phst_idx = -1;
+  layout->phst_idx = -1;
+  layout->fixed_stride = true;
+  layout->record_size = 0;
   for (int32_t prop_idx = 0; prop_idx < desc->num_properties; ++prop_idx) {
-    if (!memcmp(desc->properties[prop_idx].name, "PHST    ", 8)) {
-      phst_idx = prop_idx;
+    const mf_property_t *prop = &desc->properties[prop_idx];
+    if (!memcmp(prop->name, "PHST    ", 8)) {
+      layout->phst_idx = prop_idx;
     }
-    element_sizes[prop_idx] = elem_size(desc->properties[prop_idx].data_type);
-    assert(element_sizes[prop_idx] > 0);
-  }
-
-  fseek(stream, (long)offset, SEEK_SET);
-  int8_t phst;
-  for (int32_t obj_idx = 0; obj_idx < max_count; ++obj_idx) {
-    phst = -1;
-    for (int32_t prop_idx = 0; prop_idx < desc->num_properties; ++prop_idx) {
-      const mf_property_t *prop = &desc->properties[prop_idx];
-      if (prop_idx == phst_idx) {
-        fread(&phst, sizeof(int8_t), 1, stream);
-        fseek(stream, -1l, SEEK_CUR);
-        if (phst <= 0) {
-          phst = 1;
-        }
-      }
-
-      int32_t req_idx = req_indices[prop_idx];
-      if (req_idx < 0 || obj_idx >= data[req_idx].count) {
-        size_t bytes_to_skip = element_sizes[prop_idx];
-        if (prop->output_mode == MF_DOUBLE) {
-          bytes_to_skip *= 2;
-        }
-        if (prop->phase_state == MF_STATE1) {
-          bytes_to_skip *= phst;
-        }
-        fseek(stream, (long)bytes_to_skip, SEEK_CUR);
-        continue;
-      }
-
-      int64_t pos = data[req_idx].stride * obj_idx;
-      size_t bytes_to_read = element_sizes[prop_idx];
-      if (prop->phase_state == MF_STATE1) {
-        bytes_to_read *= phst;
-      }
-
-      if (prop->output_mode == MF_DOUBLE) {
-        char **dst = data[req_idx].bytes;
-        fread(dst[0] + pos, bytes_to_read, 1, stream);
-        fread(dst[1] + pos, bytes_to_read, 1, stream);
-      } else {
-        char *dst = data[req_idx].bytes;
-        fread(dst + pos, bytes_to_read, 1, stream);
-      }
+    int size = elem_size(prop->data_type);
+    assert(size > 0);
+    layout->element_sizes[prop_idx] = size;
+    if (prop->phase_state == MF_STATE1) {
+      layout->fixed_stride = false;
+    }
+    // Offsets of requested properties inside a record are only meaningful while every record has the same size
+    if (layout->req_indices[prop_idx] >= 0) {
+      layout->ops[layout->num_ops++] = (copy_op_t){.req_idx = layout->req_indices[prop_idx],
+                                                   .size = size,
+                                                   .offset = layout->record_size,
+                                                   .is_double = prop->output_mode == MF_DOUBLE};
     }
+    layout->record_size += prop->output_mode == MF_DOUBLE ? 2 * size : size;
   }
-
-on_error:
-  free(element_sizes);
-  free(req_indices);
-  return err;
+  return MF_OK;
 }
 
-static const char *data_type_string(mf_data_type_t type) {
-  static const char *strs[7] = {
-      "INT1", "INT2", "INT4", "REAL4", "REAL8", "CHAR4", "CHAR8",
-  };
-  return strs[type];
+void free_layout(block_layout_t *layout) {
+  free(layout->element_sizes);
+  free(layout->req_indices);
+  free(layout->ops);
+  layout->element_sizes = NULL;
+  layout->req_indices = NULL;
+  layout->ops = NULL;
 }
 
-static const char *output_mode_string(mf_output_mode_t mode) { return mode == MF_SINGLE ? "SINGLE" : "DOUBLE"; }
-
-static const char *phase_state_string(mf_phase_state_t state) { return state == MF_STATE0 ? "STATE0" : "STATE1"; }
-
-void write_block(FILE *stream, const char *name, const mf_arrays_t *arr, mf_data_t *data) {
-  printf("Info: writing block '%s'\n", name);
+block_ref_t block_ref(const mf_sum_file_t *file, int block) {
+  const mf_sum_description_t *desc = file->description;
+  switch (block) {
+  case CELLDATA:
+    return (block_ref_t){desc->celldata, file->celldata_offset, file->celldata_size, file->celldata_layout};
+  case CONNDATA:
+    return (block_ref_t){desc->conndata, file->conndata_offset, file->conndata_size, file->conndata_layout};
+  case SRCDATA:
+    return (block_ref_t){desc->srcdata, file->srcdata_offset, file->srcdata_size, file->srcdata_layout};
+  case FPCEDATA:
+    return (block_ref_t){desc->fpcedata, file->fpcedata_offset, file->fpcedata_size, file->fpcedata_layout};
+  default:
+    return (block_ref_t){desc->fpcodata, file->fpcodata_offset, file->fpcodata_size, file->fpcodata_layout};
+  }
+}
 
-  int64_t block_size;
+const mf_sum_block_query_t *block_query(const mf_sum_read_request_t *request, int block) {
+  const mf_sum_block_query_t *queries[NUM_BLOCKS] = {request->celldata, request->conndata, request->srcdata,
+                                                     request->fpcedata, request->fpcodata};
+  return queries[block];
+}
 
-  // Arrays + Arrays size
-  block_size = 8 + 8;
+mf_data_t *block_data(const mf_sum_attachment_t *attachment, int block) {
+  mf_data_t *data[NUM_BLOCKS] = {attachment->celldata, attachment->conndata, attachment->srcdata,
+                                 attachment->fpcedata, attachment->fpcodata};
+  return data[block];
+}
 
-  // Number of properties + number of objects
-  int64_t arrays_size = 4 + 4;
+// Large blocks of variable-size records, ASCII sections and connectivity graphs are processed by up to MAX_THREADS
+// threads, each getting a task of at least `grain` units of work
 
-  // Mnemonic + dimension + tags + ENDITEM
-  int64_t property_size = 8 + 8 + 3 * 8 + 8;
-  arrays_size += arr->num_properties * property_size;
+#define MAX_THREADS 16
 
-  block_size += arrays_size;
+// Limit set by mf_set_max_threads, 0 - number of processors
+static int max_threads = 0;
 
-  // Data + data size
-  block_size += 8 + 8;
+void mf_set_max_threads(int num_threads) { max_threads = num_threads > 0 ? num_threads : 0; }
 
-  int *element_sizes = malloc(arr->num_properties * sizeof(int));
-  assert(element_sizes);
+static int num_tasks(int64_t amount, int64_t grain) {
+  int64_t threads = amount / grain;
+#ifdef MF_HAVE_THREADS
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  if (threads > cpus) {
+    threads = cpus;
+  }
+  if (max_threads > 0 && threads > max_threads) {
+    threads = max_threads;
+  }
+#else
+  threads = 1;
+#endif
+  if (threads > MAX_THREADS) {
+    threads = MAX_THREADS;
+  }
+  return threads < 1 ? 1 : (int)threads;
+}
 
-  int64_t data_size = 0;
-  for (int32_t idx = 0; idx < arr->num_properties; ++idx) {
-    element_sizes[idx] = elem_size(arr->properties[idx].data_type);
-    if (arr->properties[idx].output_mode == MF_SINGLE) {
-      data_size += arr->num_objects * element_sizes[idx];
+// Runs `work` on every task of an array, the first one on the calling thread
+static void run_tasks(void *tasks, size_t task_size, int count, void *(*work)(void *)) {
+  char *task = tasks;
+#ifdef MF_HAVE_THREADS
+  pthread_t threads[MAX_THREADS];
+  bool started[MAX_THREADS] = {false};
+  for (int idx = 1; idx < count; ++idx) {
+    started[idx] = pthread_create(&threads[idx], NULL, work, task + idx * task_size) == 0;
+  }
+  work(task);
+  for (int idx = 1; idx < count; ++idx) {
+    if (started[idx]) {
+      pthread_join(threads[idx], NULL);
     } else {
-      data_size += arr->num_objects * element_sizes[idx] * 2;
+      work(task + idx * task_size);
     }
   }
+#else
+  for (int idx = 0; idx < count; ++idx) {
+    work(task + idx * task_size);
+  }
+#endif
+}
 
-  block_size += data_size;
-
-  // Enddata + enddata size
-  block_size += 8 + 8;
-
-  fwrite(name, 1, 8, stream);
-  fwrite(&block_size, 8, 1, stream);
+// Objects before `first` are skipped, object `first` goes to the first element of every destination
+mf_status_t read_block(mf_sum_file_t *file, int block, const block_layout_t *layout, mf_data_t *data,
+                       int32_t first) {
+  block_ref_t ref = block_ref(file, block);
+  const mf_arrays_t *desc = ref.desc;
+  int32_t max_count = 0;
+  for (int32_t req_idx = 0; req_idx < layout->num_items; ++req_idx) {
+    if (data[req_idx].count > max_count) {
+      max_count = data[req_idx].count;
+    }
+  }
+  if (max_count > desc->num_objects - first) {
+    max_count = desc->num_objects - first;
+  }
+  if (file->text) {
+    return read_text_block(file, desc, layout, data, ref.offset, ref.size, first, max_count);
+  }
+  if (max_count == 0) {
+    return MF_OK;
+  }
+
+  // Without STATE1 properties only the records that are actually requested have to be loaded. Otherwise they are
+  // located by the record index of the block; a block without one is loaded as a whole and indexed in memory
+  mf_status_t err = MF_OK;
+  double start = monotonic_seconds();
+  const int64_t *offsets = NULL;
+  int64_t begin = 0;
+  int64_t end = ref.size;
+  if (layout->fixed_stride) {
+    begin = layout->record_size * first;
+    end = begin + layout->record_size * max_count;
+  } else if (file->map) {
+    err = get_record_index(file, block, file->map + ref.offset, &offsets);
+  } else {
+    offsets = cached_record_index(file, block);
+  }
+  if (err != MF_OK) {
+    return err;
+  }
+  if (offsets) {
+    begin = offsets[first];
+    end = offsets[first + max_count];
+  }
+  if (end > ref.size) {
+    fprintf(stderr, "Error: data block is smaller than declared by its properties\n");
+    return MF_ERROR_INVALID_FILE;
+  }
+  int64_t bytes_to_read = end - begin;
+  if (bytes_to_read == 0) {
+    return MF_OK;
+  }
 
-  fwrite("ARRAYS  ", 1, 8, stream);
-  fwrite(&arrays_size, 8, 1, stream);
+  char *owned_block = NULL;
+  const char *records;
+  if (file->map) {
+    records = file->map + ref.offset + begin;
+  } else {
+    if ((int64_t)(size_t)bytes_to_read != bytes_to_read) {
+      fprintf(stderr, "Error: data block of %lld bytes does not fit into the address space\n",
+              (long long)bytes_to_read);
+      return MF_ERROR_UNSUPPORTED_FEATURE_REQUIRED;
+    }
+    owned_block = malloc(bytes_to_read);
+    if (!owned_block) {
+      fprintf(stderr, "Error: failed to allocate %lld bytes for data block\n", (long long)bytes_to_read);
+      return MF_ERROR_FAILED_IO_OPERATION;
+    }
+    err = read_at(file, owned_block, bytes_to_read, ref.offset + begin);
+    if (err != MF_OK) {
+      goto on_error;
+    }
+    records = owned_block;
+  }
+  // Pages of a mapping are loaded while decoding, so with mmap only indexing is counted as reading
+  double loaded = monotonic_seconds();
 
-  fwrite(&arr->num_properties, 4, 1, stream);
-  fwrite(&arr->num_objects, 4, 1, stream);
+  if (layout->fixed_stride) {
+    decode_fixed(records, layout, max_count, data);
+  } else {
+    if (!offsets) {
+      err = get_record_index(file, block, records, &offsets);
+    }
+    if (err == MF_OK) {
+      err = decode_records(records + (offsets[first] - begin), offsets + first, desc, layout, max_count, data);
+    }
+  }
+  add_read_stats(file, loaded - start, monotonic_seconds() - loaded, bytes_to_read);
 
-  for (int32_t idx = 0; idx < arr->num_properties; ++idx) {
-    fwrite(arr->properties[idx].name, 1, 8, stream);
-    char mnem[9];
-    const char *str;
-
-    fwrite(arr->properties[idx].dimension, 1, 8, stream);
-
-    str = data_type_string(arr->properties[idx].data_type);
-    memset(mnem, ' ', 8);
-    strcpy(mnem, str);
-    mnem[strlen(str)] = ' ';
-    fwrite(mnem, 1, 8, stream);
-
-    str = output_mode_string(arr->properties[idx].output_mode);
-    memset(mnem, ' ', 8);
-    strcpy(mnem, str);
-    mnem[strlen(str)] = ' ';
-    fwrite(mnem, 1, 8, stream);
-
-    str = phase_state_string(arr->properties[idx].phase_state);
-    memset(mnem, ' ', 8);
-    strcpy(mnem, str);
-    mnem[strlen(str)] = ' ';
-    fwrite(mnem, 1, 8, stream);
-
-    fwrite("ENDITEM ", 1, 8, stream);
-  }
-
-  fwrite("DATA    ", 1, 8, stream);
-  fwrite(&data_size, 8, 1, stream);
-
-  for (int32_t obj_idx = 0; obj_idx < arr->num_objects; ++obj_idx) {
-    for (int32_t prop_idx = 0; prop_idx < arr->num_properties; ++prop_idx) {
-      if (arr->properties[prop_idx].output_mode == MF_SINGLE) {
-        void *buf = data[prop_idx].bytes;
-        int64_t pos = obj_idx * data[prop_idx].stride;
-        fwrite((char *)buf + pos, element_sizes[prop_idx], 1, stream);
+on_error:
+  free(owned_block);
+  return err;
+}
+
+// Reads `size` bytes at `offset` without moving the stream, so that reads of one handle do not interfere
+mf_status_t read_at(const mf_sum_file_t *file, void *dst, int64_t size, int64_t offset) {
+#ifdef MF_HAVE_PREAD
+  char *pos = dst;
+  while (size > 0) {
+    // Large reads are split, some systems limit a single read to less than 2 GB
+    size_t length = size < (1 << 30) ? (size_t)size : (size_t)1 << 30;
+    ssize_t done = pread(file->fd, pos, length, (off_t)offset);
+    if (done < 0 && errno == EINTR) {
+      continue;
+    }
+    if (done <= 0) {
+      return done < 0 ? MF_ERROR_FAILED_IO_OPERATION : MF_ERROR_INVALID_FILE;
+    }
+    pos += done;
+    offset += done;
+    size -= done;
+  }
+  return MF_OK;
+#else
+  // Without positional reads the stream is shared, so concurrent reads of one handle are not supported
+  if (seek_stream(file->stream, offset, SEEK_SET) != 0 || fread(dst, size, 1, file->stream) != 1) {
+    return ferror(file->stream) ? MF_ERROR_FAILED_IO_OPERATION : MF_ERROR_INVALID_FILE;
+  }
+  return MF_OK;
+#endif
+}
+
+// The lock guards only fields that reads change, so it is taken on const handles as well
+void lock_file(const mf_sum_file_t *file) {
+#ifdef MF_HAVE_THREADS
+  pthread_mutex_lock((pthread_mutex_t *)&file->lock);
+#else
+  (void)file;
+#endif
+}
+
+void unlock_file(const mf_sum_file_t *file) {
+#ifdef MF_HAVE_THREADS
+  pthread_mutex_unlock((pthread_mutex_t *)&file->lock);
+#else
+  (void)file;
+#endif
+}
+
+void add_read_stats(mf_sum_file_t *file, double read_seconds, double decode_seconds, int64_t bytes) {
+  lock_file(file);
+  file->stats.read_seconds += read_seconds;
+  file->stats.decode_seconds += decode_seconds;
+  file->stats.data_bytes += bytes;
+  unlock_file(file);
+}
+
+const int64_t *cached_record_index(const mf_sum_file_t *file, int block) {
+  lock_file(file);
+  const int64_t *offsets = file->record_offsets[block];
+  unlock_file(file);
+  return offsets;
+}
+
+// Returns the cached index of a block or builds it, from the records of the whole block if they are given and
+// otherwise by reading the file, which counts as reading data. Threads asking for the same index wait for the one
+// building it
+mf_status_t get_record_index(mf_sum_file_t *file, int block, const char *records, const int64_t **offsets) {
+  mf_status_t err = MF_OK;
+  lock_file(file);
+  if (!file->record_offsets[block]) {
+    block_ref_t ref = block_ref(file, block);
+    int64_t bytes_read = 0;
+    err = index_records(file, ref.desc, records, ref.offset, ref.size, &file->record_offsets[block], &bytes_read);
+    file->stats.data_bytes += bytes_read;
+  }
+  *offsets = file->record_offsets[block];
+  unlock_file(file);
+  return err;
+}
+
+#define INDEX_WINDOW_SIZE (1 << 20)
+
+// A record consists of a part of fixed size and a part of `phase_size` bytes per phase, so the offset of every record
+// follows from the one before and its PHST, which precedes all STATE1 properties; the index is thus a prefix sum of
+// record sizes that reads one byte per record. Without records in memory, PHST bytes are read through a window
+mf_status_t index_records(const mf_sum_file_t *file, const mf_arrays_t *desc, const char *records, int64_t offset,
+                          int64_t size, int64_t **offsets, int64_t *bytes_read) {
+  int64_t fixed_size = 0;
+  int64_t phase_size = 0;
+  int64_t phst_offset = -1;
+  for (int32_t prop_idx = 0; prop_idx < desc->num_properties; ++prop_idx) {
+    const mf_property_t *prop = &desc->properties[prop_idx];
+    int64_t prop_size = elem_size(prop->data_type) * (prop->output_mode == MF_DOUBLE ? 2 : 1);
+    if (!memcmp(prop->name, "PHST    ", 8) && phase_size == 0) {
+      phst_offset = fixed_size;
+    }
+    if (prop->phase_state == MF_STATE1) {
+      if (phst_offset < 0) {
+        fprintf(stderr, "Error: property '%s' is defined per phase, but PHST is not known\n", prop->name);
+        return MF_ERROR_INVALID_FILE;
+      }
+      phase_size += prop_size;
+    } else {
+      fixed_size += prop_size;
+    }
+  }
+
+  int64_t *result = malloc(((int64_t)desc->num_objects + 1) * sizeof(int64_t));
+  if (!result) {
+    fprintf(stderr, "Error: failed to allocate record index of %d objects\n", desc->num_objects);
+    return MF_ERROR_FAILED_IO_OPERATION;
+  }
+  char *window = NULL;
+  int64_t window_begin = 0;
+  int64_t window_end = 0;
+  int64_t pos = 0;
+  mf_status_t err = MF_OK;
+  for (int32_t obj_idx = 0; obj_idx < desc->num_objects; ++obj_idx) {
+    result[obj_idx] = pos;
+    int64_t phases = 1;
+    if (phase_size > 0) {
+      int64_t phst_pos = pos + phst_offset;
+      if (phst_pos >= size) {
+        fprintf(stderr, "Error: data block is truncated at object %d\n", obj_idx);
+        err = MF_ERROR_INVALID_FILE;
+        break;
+      }
+      int8_t phst;
+      if (records) {
+        phst = (int8_t)records[phst_pos];
       } else {
-        void **buf = data[prop_idx].bytes;
-        int64_t pos = obj_idx * data[prop_idx].stride;
-        fwrite((char *)(buf[0]) + pos, element_sizes[prop_idx], 1, stream);
-        fwrite((char *)(buf[1]) + pos, element_sizes[prop_idx], 1, stream);
+        if (phst_pos >= window_end) {
+          window = window ? window : malloc(INDEX_WINDOW_SIZE);
+          if (!window) {
+            fprintf(stderr, "Error: failed to allocate %d bytes for record index\n", INDEX_WINDOW_SIZE);
+            err = MF_ERROR_FAILED_IO_OPERATION;
+            break;
+          }
+          window_begin = phst_pos;
+          window_end = size - phst_pos < INDEX_WINDOW_SIZE ? size : phst_pos + INDEX_WINDOW_SIZE;
+          err = read_at(file, window, window_end - window_begin, offset + window_begin);
+          if (err != MF_OK) {
+            break;
+          }
+          *bytes_read += window_end - window_begin;
+        }
+        phst = (int8_t)window[phst_pos - window_begin];
+      }
+      phases = phst > 1 ? phst : 1;
+    }
+    pos += fixed_size + phases * phase_size;
+    if (pos > size) {
+      fprintf(stderr, "Error: data block is truncated at object %d\n", obj_idx);
+      err = MF_ERROR_INVALID_FILE;
+      break;
+    }
+  }
+  result[desc->num_objects] = pos;
+  free(window);
+  if (err != MF_OK) {
+    free(result);
+    return err;
+  }
+  *offsets = result;
+  return MF_OK;
+}
+
+#define DECODE_TASK_SIZE (1 << 22)
+
+// Range of records decoded by one thread into destinations shifted to its first object
+typedef struct {
+  const char *records;
+  const int64_t *offsets;
+  const mf_arrays_t *desc;
+  const block_layout_t *layout;
+  int32_t begin;
+  int32_t end;
+  const mf_data_t *data;
+  mf_status_t err;
+} decode_task_t;
+
+static void *decode_task(void *arg) {
+  decode_task_t *task = arg;
+  const block_layout_t *layout = task->layout;
+  mf_data_t *data = calloc(layout->num_items + 1, sizeof(mf_data_t));
+  char **components = calloc(2 * layout->num_items + 1, sizeof(char *));
+  if (!data || !components) {
+    fprintf(stderr, "Error: failed to allocate destinations of decoding thread\n");
+    free(components);
+    free(data);
+    task->err = MF_ERROR_FAILED_IO_OPERATION;
+    return NULL;
+  }
+  for (int32_t prop_idx = 0; prop_idx < task->desc->num_properties; ++prop_idx) {
+    int32_t req_idx = layout->req_indices[prop_idx];
+    if (req_idx < 0) {
+      continue;
+    }
+    const mf_data_t *src = &task->data[req_idx];
+    mf_data_t *dst = &data[req_idx];
+    *dst = *src;
+    dst->count = src->count > task->begin ? src->count - task->begin : 0;
+    size_t shift = dst->count > 0 ? src->stride * task->begin : 0;
+    if (task->desc->properties[prop_idx].output_mode == MF_DOUBLE) {
+      components[2 * req_idx] = ((char **)src->bytes)[0] + shift;
+      components[2 * req_idx + 1] = ((char **)src->bytes)[1] + shift;
+      dst->bytes = &components[2 * req_idx];
+    } else {
+      dst->bytes = (char *)src->bytes + shift;
+    }
+  }
+  int64_t skipped = task->offsets[task->begin] - task->offsets[0];
+  task->err = decode_variable(task->records + skipped, task->offsets[task->end] - task->offsets[task->begin],
+                              task->desc, task->layout, 0, task->end - task->begin, data);
+  free(components);
+  free(data);
+  return NULL;
+}
+
+// Decodes `count` records starting at `records`, whose offsets relative to the block are `offsets[0..count]`; ranges
+// of records are decoded by several threads
+mf_status_t decode_records(const char *records, const int64_t *offsets, const mf_arrays_t *desc,
+                           const block_layout_t *layout, int32_t count, mf_data_t *data) {
+  decode_task_t tasks[MAX_THREADS];
+  int num = num_tasks(offsets[count] - offsets[0], DECODE_TASK_SIZE);
+  if (num > count) {
+    num = count > 0 ? count : 1;
+  }
+  for (int task_idx = 0; task_idx < num; ++task_idx) {
+    tasks[task_idx] = (decode_task_t){.records = records,
+                                      .offsets = offsets,
+                                      .desc = desc,
+                                      .layout = layout,
+                                      .begin = (int32_t)((int64_t)count * task_idx / num),
+                                      .end = (int32_t)((int64_t)count * (task_idx + 1) / num),
+                                      .data = data};
+  }
+  run_tasks(tasks, sizeof(decode_task_t), num, decode_task);
+  for (int task_idx = 0; task_idx < num; ++task_idx) {
+    if (tasks[task_idx].err != MF_OK) {
+      return tasks[task_idx].err;
+    }
+  }
+  return MF_OK;
+}
+
+mf_status_t read_data(mf_sum_file_t *file, int block, const mf_sum_block_query_t *query, mf_data_t *data,
+                      int32_t first) {
+  assert(query->num_items >= 0);
+  if (query->num_items == 0) {
+    return MF_OK;
+  }
+
+  block_layout_t layout;
+  mf_status_t err = resolve_query(block_ref(file, block).desc, query, &layout);
+  if (err != MF_OK) {
+    return err;
+  }
+  err = read_block(file, block, &layout, data, first);
+  free_layout(&layout);
+  return err;
+}
+
+// Records of single objects closer to each other than this are read together, which is cheaper than another read
+#define PROBE_GAP_SIZE (16 << 10)
+
+// Requested object and the element of the destinations it goes to
+typedef struct {
+  int32_t obj_idx;
+  int32_t dst_idx;
+} probe_t;
+
+static int probe_cmp(const void *v1, const void *v2) {
+  const probe_t *p1 = v1;
+  const probe_t *p2 = v2;
+  if (p1->obj_idx != p2->obj_idx) {
+    return p1->obj_idx < p2->obj_idx ? -1 : 1;
+  }
+  return (p1->dst_idx > p2->dst_idx) - (p1->dst_idx < p2->dst_idx);
+}
+
+static int64_t record_offset(const block_layout_t *layout, const int64_t *offsets, int32_t obj_idx) {
+  return offsets ? offsets[obj_idx] : layout->record_size * obj_idx;
+}
+
+// Records are located by the record size or by the record index of the block and visited in the order of the file,
+// so that records close to each other are loaded by a single read; mapped records are decoded in place
+mf_status_t read_cells(mf_sum_file_t *file, int block, const block_layout_t *layout, const int32_t *objects,
+                       int32_t num_objects, mf_data_t *data) {
+  block_ref_t ref = block_ref(file, block);
+  double start = monotonic_seconds();
+  const int64_t *offsets = NULL;
+  if (!layout->fixed_stride) {
+    mf_status_t err = get_record_index(file, block, file->map ? file->map + ref.offset : NULL, &offsets);
+    if (err != MF_OK) {
+      return err;
+    }
+  }
+  double read_seconds = monotonic_seconds() - start;
+  double decode_seconds = 0;
+  int64_t bytes_read = 0;
+
+  probe_t *probes = malloc((num_objects + 1) * sizeof(probe_t));
+  if (!probes) {
+    fprintf(stderr, "Error: failed to allocate %d cell probes\n", num_objects);
+    return MF_ERROR_FAILED_IO_OPERATION;
+  }
+  for (int32_t idx = 0; idx < num_objects; ++idx) {
+    probes[idx] = (probe_t){objects[idx], idx};
+  }
+  qsort(probes, num_objects, sizeof(probe_t), probe_cmp);
+
+  char *buffer = NULL;
+  int64_t capacity = 0;
+  mf_status_t err = MF_OK;
+  int32_t run_end;
+  for (int32_t run_begin = 0; run_begin < num_objects && err == MF_OK; run_begin = run_end) {
+    int64_t begin = record_offset(layout, offsets, probes[run_begin].obj_idx);
+    int64_t end = record_offset(layout, offsets, probes[run_begin].obj_idx + 1);
+    for (run_end = run_begin + 1; run_end < num_objects; ++run_end) {
+      int32_t obj_idx = probes[run_end].obj_idx;
+      if (record_offset(layout, offsets, obj_idx) - end > PROBE_GAP_SIZE) {
+        break;
+      }
+      end = record_offset(layout, offsets, obj_idx + 1);
+    }
+    if (end > ref.size) {
+      fprintf(stderr, "Error: data block is smaller than declared by its properties\n");
+      err = MF_ERROR_INVALID_FILE;
+      break;
+    }
+
+    double loading = monotonic_seconds();
+    const char *records;
+    if (file->map) {
+      records = file->map + ref.offset + begin;
+    } else {
+      if (end - begin > capacity) {
+        free(buffer);
+        capacity = end - begin;
+        buffer = (int64_t)(size_t)capacity == capacity ? malloc(capacity) : NULL;
+        if (!buffer) {
+          fprintf(stderr, "Error: failed to allocate %lld bytes for data block\n", (long long)capacity);
+          err = MF_ERROR_FAILED_IO_OPERATION;
+          break;
+        }
+      }
+      err = read_at(file, buffer, end - begin, ref.offset + begin);
+      if (err != MF_OK) {
+        break;
+      }
+      records = buffer;
+    }
+    bytes_read += end - begin;
+    double loaded = monotonic_seconds();
+
+    for (int32_t idx = run_begin; idx < run_end && err == MF_OK; ++idx) {
+      const probe_t *probe = &probes[idx];
+      const char *pos = records + (record_offset(layout, offsets, probe->obj_idx) - begin);
+      const char *record_end = records + (record_offset(layout, offsets, probe->obj_idx + 1) - begin);
+      err = decode_record(&pos, record_end, ref.desc, layout, probe->obj_idx, probe->dst_idx, data);
+    }
+    read_seconds += loaded - loading;
+    decode_seconds += monotonic_seconds() - loaded;
+  }
+  add_read_stats(file, read_seconds, decode_seconds, bytes_read);
+
+  free(buffer);
+  free(probes);
+  return err;
+}
+
+mf_status_t view_data(const mf_sum_file_t *file, const mf_arrays_t *desc, const mf_sum_block_query_t *query,
+                      mf_data_t *data, int64_t offset) {
+  assert(query->num_items >= 0);
+  if (query->num_items == 0) {
+    return MF_OK;
+  }
+
+  block_layout_t layout;
+  mf_status_t err = resolve_query(desc, query, &layout);
+  if (err != MF_OK) {
+    return err;
+  }
+  if (!layout.fixed_stride) {
+    fprintf(stderr, "Error: block contains properties defined per phase, its records have no fixed stride\n");
+    free_layout(&layout);
+    return MF_ERROR_INVALID_READ_REQUEST;
+  }
+
+  for (int32_t op_idx = 0; op_idx < layout.num_ops; ++op_idx) {
+    const copy_op_t *op = &layout.ops[op_idx];
+    mf_data_t *view = &data[op->req_idx];
+    const char *record = file->map + offset + op->offset;
+    if (op->is_double) {
+      const char **components = view->bytes;
+      components[0] = record;
+      components[1] = record + op->size;
+    } else {
+      view->bytes = (void *)record;
+    }
+    view->stride = layout.record_size;
+    view->count = desc->num_objects;
+  }
+
+  free_layout(&layout);
+  return MF_OK;
+}
+
+static const char *data_type_string(mf_data_type_t type) {
+  static const char *strs[7] = {
+      "INT1", "INT2", "INT4", "REAL4", "REAL8", "CHAR4", "CHAR8",
+  };
+  return strs[type];
+}
+
+static const char *output_mode_string(mf_output_mode_t mode) { return mode == MF_SINGLE ? "SINGLE" : "DOUBLE"; }
+
+static const char *phase_state_string(mf_phase_state_t state) { return state == MF_STATE0 ? "STATE0" : "STATE1"; }
+
+// Properties are given as columns, i.e. every property of every object is at `bytes + stride * object`, with all
+// phases of a STATE1 property stored contiguously as in mf_read_sum_file. Blocks without STATE1 properties consist of
+// fixed-size records, which are interleaved column by column for a whole chunk of objects; otherwise records are
+// assembled object by object, using the number of phases from PHST
+mf_status_t write_block(FILE *stream, const char *name, const mf_arrays_t *arr, const mf_data_t *data) {
+  int32_t phst_idx = -1;
+  int64_t record_size = 0;
+  int64_t phase_size = 0;
+  for (int32_t idx = 0; idx < arr->num_properties; ++idx) {
+    const mf_property_t *prop = &arr->properties[idx];
+    int64_t size = elem_size(prop->data_type) * (prop->output_mode == MF_DOUBLE ? 2 : 1);
+    if (data[idx].count < arr->num_objects) {
+      fprintf(stderr, "Error: property '%s' has %d objects, block has %d objects\n", prop->name, data[idx].count,
+              arr->num_objects);
+      return MF_ERROR_INVALID_READ_REQUEST;
+    }
+    // Names may be given either padded with spaces or terminated early
+    char padded[8];
+    memset(padded, ' ', 8);
+    memcpy(padded, prop->name, strnlen(prop->name, 8));
+    if (!memcmp(padded, "PHST    ", 8) && prop->data_type == MF_INT1 && prop->output_mode == MF_SINGLE) {
+      phst_idx = idx;
+    }
+    if (prop->phase_state == MF_STATE1) {
+      // Readers learn the number of phases of an object from PHST, so it has to come first
+      if (phst_idx < 0) {
+        fprintf(stderr, "Error: property '%s' is defined per phase, but PHST does not precede it\n", prop->name);
+        return MF_ERROR_MISSING_PROPERTY;
+      }
+      phase_size += size;
+    } else {
+      record_size += size;
+    }
+  }
+
+  // Every object has at least one phase
+  int64_t num_phases = arr->num_objects;
+  int max_phases = 1;
+  if (phase_size > 0) {
+    num_phases = 0;
+    const char *phst = data[phst_idx].bytes;
+    for (int32_t obj_idx = 0; obj_idx < arr->num_objects; ++obj_idx) {
+      int8_t value = *(const int8_t *)(phst + obj_idx * data[phst_idx].stride);
+      int phases = value > 1 ? value : 1;
+      max_phases = phases > max_phases ? phases : max_phases;
+      num_phases += phases;
+    }
+    for (int32_t idx = 0; idx < arr->num_properties; ++idx) {
+      const mf_property_t *prop = &arr->properties[idx];
+      if (prop->phase_state == MF_STATE1 && data[idx].stride < (size_t)elem_size(prop->data_type) * max_phases) {
+        fprintf(stderr, "Error: property '%s' has up to %d phases, source stride is %zu bytes\n", prop->name,
+                max_phases, data[idx].stride);
+        return MF_ERROR_INVALID_READ_REQUEST;
+      }
+    }
+  }
+
+  // Mnemonic + dimension + tags + ENDITEM
+  int64_t property_size = 8 + 8 + 3 * 8 + 8;
+  // Number of properties + number of objects
+  int64_t arrays_size = 4 + 4 + arr->num_properties * property_size;
+  int64_t data_size = record_size * arr->num_objects + phase_size * num_phases;
+  // Arrays + arrays size, data + data size, enddata + enddata size
+  int64_t block_size = 16 + arrays_size + 16 + data_size + 16;
+
+  int64_t max_record_size = record_size + phase_size * max_phases;
+  int64_t capacity = WRITE_CHUNK_SIZE;
+  capacity = 16 + 16 + arrays_size + 16 > capacity ? 16 + 16 + arrays_size + 16 : capacity;
+  capacity = max_record_size > capacity ? max_record_size : capacity;
+  char *chunk = malloc(capacity);
+  if (!chunk) {
+    fprintf(stderr, "Error: failed to allocate %lld bytes for writing block\n", (long long)capacity);
+    return MF_ERROR_FAILED_IO_OPERATION;
+  }
+
+  char *pos = chunk;
+  memcpy(pos, name, 8);
+  memcpy(pos + 8, &block_size, 8);
+  memcpy(pos + 16, "ARRAYS  ", 8);
+  memcpy(pos + 24, &arrays_size, 8);
+  memcpy(pos + 32, &arr->num_properties, 4);
+  memcpy(pos + 36, &arr->num_objects, 4);
+  pos += 40;
+  for (int32_t idx = 0; idx < arr->num_properties; ++idx) {
+    const mf_property_t *prop = &arr->properties[idx];
+    const char *tags[3] = {data_type_string(prop->data_type), output_mode_string(prop->output_mode),
+                           phase_state_string(prop->phase_state)};
+    memset(pos, ' ', property_size - 8);
+    memcpy(pos, prop->name, strnlen(prop->name, 8));
+    memcpy(pos + 8, prop->dimension, strnlen(prop->dimension, 8));
+    for (int tag_idx = 0; tag_idx < 3; ++tag_idx) {
+      memcpy(pos + 16 + 8 * tag_idx, tags[tag_idx], strlen(tags[tag_idx]));
+    }
+    memcpy(pos + 40, "ENDITEM ", 8);
+    pos += property_size;
+  }
+  memcpy(pos, "DATA    ", 8);
+  memcpy(pos + 8, &data_size, 8);
+  fwrite(chunk, 1, pos + 16 - chunk, stream);
+
+  if (phase_size == 0 && record_size > 0) {
+    int32_t chunk_objects = (int32_t)(capacity / record_size);
+    for (int32_t first = 0; first < arr->num_objects; first += chunk_objects) {
+      int32_t count = arr->num_objects - first < chunk_objects ? arr->num_objects - first : chunk_objects;
+      int64_t offset = 0;
+      for (int32_t idx = 0; idx < arr->num_properties; ++idx) {
+        const mf_property_t *prop = &arr->properties[idx];
+        int size = elem_size(prop->data_type);
+        size_t src_offset = first * data[idx].stride;
+        if (prop->output_mode == MF_DOUBLE) {
+          char *const *bytes = data[idx].bytes;
+          copy_strided(chunk + offset, record_size, bytes[0] + src_offset, data[idx].stride, size, count);
+          copy_strided(chunk + offset + size, record_size, bytes[1] + src_offset, data[idx].stride, size, count);
+          offset += 2 * size;
+        } else {
+          copy_strided(chunk + offset, record_size, (const char *)data[idx].bytes + src_offset, data[idx].stride,
+                       size, count);
+          offset += size;
+        }
+      }
+      fwrite(chunk, record_size, count, stream);
+    }
+  } else if (phase_size > 0) {
+    const char *phst = data[phst_idx].bytes;
+    pos = chunk;
+    for (int32_t obj_idx = 0; obj_idx < arr->num_objects; ++obj_idx) {
+      if (pos - chunk + max_record_size > capacity) {
+        fwrite(chunk, 1, pos - chunk, stream);
+        pos = chunk;
+      }
+      int8_t value = *(const int8_t *)(phst + obj_idx * data[phst_idx].stride);
+      int phases = value > 1 ? value : 1;
+      for (int32_t idx = 0; idx < arr->num_properties; ++idx) {
+        const mf_property_t *prop = &arr->properties[idx];
+        int size = elem_size(prop->data_type);
+        int count = prop->phase_state == MF_STATE1 ? phases : 1;
+        size_t src_offset = obj_idx * data[idx].stride;
+        if (prop->output_mode == MF_DOUBLE) {
+          char *const *bytes = data[idx].bytes;
+          copy_strided(pos, size, bytes[0] + src_offset, size, size, count);
+          pos += size * count;
+          copy_strided(pos, size, bytes[1] + src_offset, size, size, count);
+          pos += size * count;
+        } else {
+          copy_strided(pos, size, (const char *)data[idx].bytes + src_offset, size, size, count);
+          pos += size * count;
+        }
       }
     }
+    fwrite(chunk, 1, pos - chunk, stream);
   }
 
-  free(element_sizes);
+  free(chunk);
 
   fwrite("ENDDATA ", 1, 8, stream);
   block_size = 0;
   fwrite(&block_size, 8, 1, stream);
+  return ferror(stream) ? MF_ERROR_FAILED_IO_OPERATION : MF_OK;
+}
+
+// ASCII files hold the same records as binary ones, written as whitespace-separated tokens without record sizes. The
+// whole file is kept in memory, DATA records are located while opening and their values are parsed only when read.
+// Numbers are parsed by hand, and sections larger than TEXT_CHUNK_SIZE are split at whitespace into chunks which are
+// parsed by several threads
+
+#define TEXT_CHUNK_SIZE (4 << 20)
+
+typedef struct {
+  const char *pos;
+  const char *end;
+} text_cursor_t;
+
+// Destination of one value of every record, i.e. of one component of a property; values of the first `skip` records,
+// of records past `skip + count` and values without destination are skipped
+typedef struct {
+  mf_data_type_t type;
+  char *dst;
+  size_t stride;
+  int64_t count;
+  int64_t skip;
+} text_field_t;
+
+// Part of a section parsed by one thread; `first_token` is the index of its first token within the section
+typedef struct {
+  const char *begin;
+  const char *end;
+  const text_field_t *fields;
+  int num_fields;
+  int64_t max_tokens;
+  int64_t first_token;
+  int64_t num_tokens;
+  mf_status_t err;
+} text_chunk_t;
+
+static const char *const block_keywords[NUM_BLOCKS] = {"CELLDATA", "CONNDATA", "SRCDATA", "FPCEDATA", "FPCODATA"};
+
+static bool is_blank(char c) { return (unsigned char)c <= ' '; }
+
+static bool next_token(text_cursor_t *cur, const char **token, int64_t *length) {
+  while (cur->pos < cur->end && is_blank(*cur->pos)) {
+    ++cur->pos;
+  }
+  if (cur->pos == cur->end) {
+    return false;
+  }
+  *token = cur->pos;
+  while (cur->pos < cur->end && !is_blank(*cur->pos)) {
+    ++cur->pos;
+  }
+  *length = cur->pos - *token;
+  return true;
+}
+
+static bool token_is(const char *token, int64_t length, const char *keyword) {
+  return length == (int64_t)strlen(keyword) && !memcmp(token, keyword, length);
+}
+
+static bool expect_keyword(text_cursor_t *cur, const char *keyword) {
+  const char *token;
+  int64_t length;
+  if (!next_token(cur, &token, &length) || !token_is(token, length, keyword)) {
+    fprintf(stderr, "Error: expected '%s' record\n", keyword);
+    return false;
+  }
+  return true;
+}
+
+// Reads the next token as a space-padded mnemonic of 8 characters
+static bool next_mnemonic(text_cursor_t *cur, char *mnemonic) {
+  const char *token;
+  int64_t length;
+  if (!next_token(cur, &token, &length) || length > 8) {
+    return false;
+  }
+  memcpy(mnemonic, token, length);
+  memset(mnemonic + length, ' ', 8 - length);
+  return true;
+}
+
+// Finds `keyword` standing as a whole token. Numbers contain E and D exponents, so candidates are looked up by the last
+// letter of the keyword
+static const char *find_keyword(const char *begin, const char *end, const char *keyword) {
+  int64_t length = strlen(keyword);
+  if (end - begin < length) {
+    return NULL;
+  }
+  const char *pos = begin + length - 1;
+  while (pos < end && (pos = memchr(pos, keyword[length - 1], end - pos)) != NULL) {
+    const char *start = pos - (length - 1);
+    if (!memcmp(start, keyword, length) && (start == begin || is_blank(start[-1])) &&
+        (pos + 1 == end || is_blank(pos[1]))) {
+      return start;
+    }
+    ++pos;
+  }
+  return NULL;
+}
+
+bool text_ends_with_endfile(const char *text, int64_t size) {
+  while (size > 0 && is_blank(text[size - 1])) {
+    --size;
+  }
+  return size >= 7 && !memcmp(text + size - 7, "ENDFILE", 7) && (size == 7 || is_blank(text[size - 8]));
+}
+
+static bool parse_integer(const char *token, int64_t length, int64_t *value) {
+  const char *pos = token;
+  const char *end = token + length;
+  bool negative = false;
+  if (pos < end && (*pos == '+' || *pos == '-')) {
+    negative = *pos++ == '-';
+  }
+  if (pos == end || end - pos > 18) {
+    return false;
+  }
+  int64_t result = 0;
+  for (; pos < end; ++pos) {
+    unsigned digit = (unsigned char)*pos - '0';
+    if (digit > 9) {
+      return false;
+    }
+    result = result * 10 + digit;
+  }
+  *value = negative ? -result : result;
+  return true;
+}
+
+static bool next_integer(text_cursor_t *cur, int64_t *value) {
+  const char *token;
+  int64_t length;
+  return next_token(cur, &token, &length) && parse_integer(token, length, value);
+}
+
+// Fortran exponents are turned into C ones, i.e. 1.5D+03 and 1.5+103 into 1.5e+03 and 1.5e+103
+static bool parse_real_slow(const char *token, int64_t length, double *value) {
+  char buf[64];
+  if (length > (int64_t)sizeof(buf) - 2) {
+    return false;
+  }
+  int pos = 0;
+  for (int64_t idx = 0; idx < length; ++idx) {
+    char c = token[idx];
+    if (c == 'd' || c == 'D') {
+      c = 'e';
+    } else if ((c == '+' || c == '-') && idx > 0 && (unsigned)(token[idx - 1] - '0') <= 9) {
+      buf[pos++] = 'e';
+    }
+    buf[pos++] = c;
+  }
+  buf[pos] = '\0';
+  char *parsed;
+  *value = strtod(buf, &parsed);
+  return parsed == buf + pos;
+}
+
+// Powers of ten that are exact in double precision
+static const double exact_powers[23] = {1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+                                        1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22};
+
+// Decimal mantissas of up to 53 bits scaled by exact powers of ten are converted with a single correctly rounded
+// multiplication or division; longer mantissas, larger exponents, NaN and infinities are left to strtod
+static bool parse_real(const char *token, int64_t length, double *value) {
+  const char *pos = token;
+  const char *end = token + length;
+  bool negative = false;
+  if (pos < end && (*pos == '+' || *pos == '-')) {
+    negative = *pos++ == '-';
+  }
+
+  uint64_t mantissa = 0;
+  int num_digits = 0;
+  int exponent = 0;
+  bool exact = true;
+  bool has_digits = false;
+  for (; pos < end && (unsigned)(*pos - '0') <= 9; ++pos) {
+    has_digits = true;
+    if (num_digits < 19) {
+      mantissa = mantissa * 10 + (*pos - '0');
+      num_digits += mantissa != 0;
+    } else {
+      ++exponent;
+      exact &= *pos == '0';
+    }
+  }
+  if (pos < end && *pos == '.') {
+    for (++pos; pos < end && (unsigned)(*pos - '0') <= 9; ++pos) {
+      has_digits = true;
+      if (num_digits < 19) {
+        mantissa = mantissa * 10 + (*pos - '0');
+        num_digits += mantissa != 0;
+        --exponent;
+      } else {
+        exact &= *pos == '0';
+      }
+    }
+  }
+  if (!has_digits) {
+    return parse_real_slow(token, length, value);
+  }
+
+  if (pos < end) {
+    if (*pos == 'e' || *pos == 'E' || *pos == 'd' || *pos == 'D') {
+      ++pos;
+    } else if (*pos != '+' && *pos != '-') {
+      return false;
+    }
+    bool negative_exponent = false;
+    if (pos < end && (*pos == '+' || *pos == '-')) {
+      negative_exponent = *pos++ == '-';
+    }
+    if (pos == end) {
+      return false;
+    }
+    int value_exponent = 0;
+    for (; pos < end; ++pos) {
+      unsigned digit = (unsigned char)*pos - '0';
+      if (digit > 9) {
+        return false;
+      }
+      if (value_exponent < 100000) {
+        value_exponent = value_exponent * 10 + digit;
+      }
+    }
+    exponent += negative_exponent ? -value_exponent : value_exponent;
+  }
+
+  if (exact && mantissa <= (1ULL << 53) && exponent >= -22 && exponent <= 22) {
+    double result = (double)mantissa;
+    result = exponent < 0 ? result / exact_powers[-exponent] : result * exact_powers[exponent];
+    *value = negative ? -result : result;
+    return true;
+  }
+  return parse_real_slow(token, length, value);
+}
+
+static mf_status_t parse_value(const char *token, int64_t length, mf_data_type_t type, char *dst) {
+  int64_t integer;
+  double real;
+  switch (type) {
+  case MF_INT1:
+    if (parse_integer(token, length, &integer) && integer >= INT8_MIN && integer <= INT8_MAX) {
+      *(int8_t *)dst = (int8_t)integer;
+      return MF_OK;
+    }
+    break;
+  case MF_INT2:
+    if (parse_integer(token, length, &integer) && integer >= INT16_MIN && integer <= INT16_MAX) {
+      int16_t value = (int16_t)integer;
+      memcpy(dst, &value, sizeof(value));
+      return MF_OK;
+    }
+    break;
+  case MF_INT4:
+    if (parse_integer(token, length, &integer) && integer >= INT32_MIN && integer <= INT32_MAX) {
+      int32_t value = (int32_t)integer;
+      memcpy(dst, &value, sizeof(value));
+      return MF_OK;
+    }
+    break;
+  case MF_REAL4:
+    if (parse_real(token, length, &real)) {
+      float value = (float)real;
+      memcpy(dst, &value, sizeof(value));
+      return MF_OK;
+    }
+    break;
+  case MF_REAL8:
+    if (parse_real(token, length, &real)) {
+      memcpy(dst, &real, sizeof(real));
+      return MF_OK;
+    }
+    break;
+  case MF_CHAR4:
+  case MF_CHAR8:
+    if (length <= elem_size(type)) {
+      memcpy(dst, token, length);
+      memset(dst + length, ' ', elem_size(type) - length);
+      return MF_OK;
+    }
+    break;
+  }
+  fprintf(stderr, "Error: invalid %s value '%.*s'\n", data_type_string(type), length < 32 ? (int)length : 32, token);
+  return MF_ERROR_INVALID_FILE;
+}
+
+static void *count_chunk(void *arg) {
+  text_chunk_t *chunk = arg;
+  const char *text = chunk->begin;
+  int64_t size = chunk->end - chunk->begin;
+  int64_t count = size > 0 && !is_blank(text[0]);
+  for (int64_t idx = 1; idx < size; ++idx) {
+    count += !is_blank(text[idx]) & is_blank(text[idx - 1]);
+  }
+  chunk->num_tokens = count;
+  return NULL;
+}
+
+static void *parse_chunk(void *arg) {
+  text_chunk_t *chunk = arg;
+  int64_t token_idx = chunk->first_token;
+  int64_t record = token_idx / chunk->num_fields;
+  int field_idx = (int)(token_idx % chunk->num_fields);
+  text_cursor_t cur = {chunk->begin, chunk->end};
+  const char *token;
+  int64_t length;
+  while (token_idx < chunk->max_tokens && next_token(&cur, &token, &length)) {
+    const text_field_t *field = &chunk->fields[field_idx];
+    if (field->dst && record >= field->skip && record - field->skip < field->count) {
+      chunk->err = parse_value(token, length, field->type, field->dst + field->stride * (record - field->skip));
+      if (chunk->err != MF_OK) {
+        return NULL;
+      }
+    }
+    ++token_idx;
+    if (++field_idx == chunk->num_fields) {
+      field_idx = 0;
+      ++record;
+    }
+  }
+  chunk->num_tokens = token_idx - chunk->first_token;
+  return NULL;
+}
+
+// Parses `num_records` records of `num_fields` values from a section. With several chunks, tokens of every chunk are
+// counted first, so that each chunk knows which record and field its first token belongs to
+static mf_status_t parse_text_records(const char *text, int64_t size, const text_field_t *fields, int num_fields,
+                                      int64_t num_records) {
+  int64_t max_tokens = num_records * num_fields;
+  if (max_tokens == 0) {
+    return MF_OK;
+  }
+
+  text_chunk_t chunks[MAX_THREADS];
+  int num_chunks = num_tasks(size, TEXT_CHUNK_SIZE);
+  const char *begin = text;
+  for (int idx = 0; idx < num_chunks; ++idx) {
+    const char *end = text + size / num_chunks * (idx + 1);
+    if (idx + 1 == num_chunks) {
+      end = text + size;
+    }
+    if (end < begin) {
+      end = begin;
+    }
+    while (end < text + size && !is_blank(*end)) {
+      ++end;
+    }
+    chunks[idx] = (text_chunk_t){
+        .begin = begin, .end = end, .fields = fields, .num_fields = num_fields, .max_tokens = max_tokens};
+    begin = end;
+  }
+
+  if (num_chunks > 1) {
+    run_tasks(chunks, sizeof(text_chunk_t), num_chunks, count_chunk);
+    int64_t first_token = 0;
+    for (int idx = 0; idx < num_chunks; ++idx) {
+      chunks[idx].first_token = first_token;
+      first_token += chunks[idx].num_tokens;
+    }
+  }
+  run_tasks(chunks, sizeof(text_chunk_t), num_chunks, parse_chunk);
+
+  int64_t num_tokens = 0;
+  for (int idx = 0; idx < num_chunks; ++idx) {
+    if (chunks[idx].err != MF_OK) {
+      return chunks[idx].err;
+    }
+    num_tokens += chunks[idx].num_tokens;
+  }
+  if (num_tokens < max_tokens) {
+    fprintf(stderr, "Error: record holds %lld values, %lld expected\n", (long long)num_tokens, (long long)max_tokens);
+    return MF_ERROR_INVALID_FILE;
+  }
+  return MF_OK;
+}
+
+// With STATE1 properties the number of values of every object depends on its PHST, so objects are parsed one by one
+// into the binary layout, which decode_variable then reads
+static mf_status_t parse_text_variable(const char *text, int64_t size, const mf_arrays_t *desc,
+                                       const block_layout_t *layout, int32_t max_count, char **block,
+                                       int64_t *block_size) {
+  text_cursor_t cur = {text, text + size};
+  int64_t capacity = layout->record_size * max_count;
+  int64_t used = 0;
+  char *buf = malloc(capacity);
+  if (!buf) {
+    fprintf(stderr, "Error: failed to allocate %lld bytes for data block\n", (long long)capacity);
+    return MF_ERROR_FAILED_IO_OPERATION;
+  }
+  mf_status_t err = MF_OK;
+  for (int32_t obj_idx = 0; obj_idx < max_count; ++obj_idx) {
+    int8_t phst = -1;
+    for (int32_t prop_idx = 0; prop_idx < desc->num_properties; ++prop_idx) {
+      const mf_property_t *prop = &desc->properties[prop_idx];
+      int element_size = layout->element_sizes[prop_idx];
+      int64_t num_values = prop->output_mode == MF_DOUBLE ? 2 : 1;
+      if (prop->phase_state == MF_STATE1) {
+        if (phst < 0) {
+          fprintf(stderr, "Error: property '%s' is defined per phase, but PHST is not known\n", prop->name);
+          err = MF_ERROR_INVALID_FILE;
+          goto on_error;
+        }
+        num_values *= phst;
+      }
+      if (used + num_values * element_size > capacity) {
+        capacity = 2 * capacity + num_values * element_size;
+        char *grown = realloc(buf, capacity);
+        if (!grown) {
+          fprintf(stderr, "Error: failed to allocate %lld bytes for data block\n", (long long)capacity);
+          err = MF_ERROR_FAILED_IO_OPERATION;
+          goto on_error;
+        }
+        buf = grown;
+      }
+      for (int64_t value_idx = 0; value_idx < num_values; ++value_idx) {
+        const char *token;
+        int64_t length;
+        if (!next_token(&cur, &token, &length)) {
+          fprintf(stderr, "Error: data block is truncated at object %d\n", obj_idx);
+          err = MF_ERROR_INVALID_FILE;
+          goto on_error;
+        }
+        err = parse_value(token, length, prop->data_type, buf + used);
+        if (err != MF_OK) {
+          goto on_error;
+        }
+        used += element_size;
+      }
+      if (prop_idx == layout->phst_idx) {
+        phst = *(const int8_t *)(buf + used - num_values * element_size);
+        if (phst <= 0) {
+          phst = 1;
+        }
+      }
+    }
+  }
+  *block = buf;
+  *block_size = used;
+  return MF_OK;
+
+on_error:
+  free(buf);
+  return err;
+}
+
+// The text is already in memory, so parsing is counted as decoding
+mf_status_t read_text_block(mf_sum_file_t *file, const mf_arrays_t *desc, const block_layout_t *layout,
+                            mf_data_t *data, int64_t offset, int64_t size, int32_t first, int32_t max_count) {
+  if (max_count == 0) {
+    return MF_OK;
+  }
+
+  double start = monotonic_seconds();
+  const char *text = file->text + offset;
+  mf_status_t err;
+  if (layout->fixed_stride) {
+    // Values of requested properties are parsed straight into their destinations, other values are only skipped
+    int num_fields = 0;
+    for (int32_t prop_idx = 0; prop_idx < desc->num_properties; ++prop_idx) {
+      num_fields += desc->properties[prop_idx].output_mode == MF_DOUBLE ? 2 : 1;
+    }
+    text_field_t *fields = calloc(num_fields, sizeof(text_field_t));
+    if (!fields) {
+      fprintf(stderr, "Error: failed to allocate %d text fields\n", num_fields);
+      return MF_ERROR_FAILED_IO_OPERATION;
+    }
+    int field_idx = 0;
+    for (int32_t prop_idx = 0; prop_idx < desc->num_properties; ++prop_idx) {
+      const mf_property_t *prop = &desc->properties[prop_idx];
+      int32_t req_idx = layout->req_indices[prop_idx];
+      int num_components = prop->output_mode == MF_DOUBLE ? 2 : 1;
+      for (int component = 0; component < num_components; ++component) {
+        text_field_t *field = &fields[field_idx++];
+        field->type = prop->data_type;
+        if (req_idx >= 0) {
+          mf_data_t *dst = &data[req_idx];
+          field->dst = prop->output_mode == MF_DOUBLE ? ((char **)dst->bytes)[component] : dst->bytes;
+          field->stride = dst->stride;
+          field->count = dst->count;
+          field->skip = first;
+        }
+      }
+    }
+    err = parse_text_records(text, size, fields, num_fields, (int64_t)first + max_count);
+    free(fields);
+  } else {
+    char *block;
+    int64_t block_size;
+    err = parse_text_variable(text, size, desc, layout, first + max_count, &block, &block_size);
+    if (err == MF_OK) {
+      err = decode_variable(block, block_size, desc, layout, first, max_count, data);
+      free(block);
+    }
+  }
+  add_read_stats(file, 0.0, monotonic_seconds() - start, size);
+  return err;
+}
+
+// Mapped files are parsed in place, otherwise the file is read as a whole
+static mf_status_t load_text(source_t *src, const char **text, int64_t *size, char **owned) {
+  if (src->map) {
+    *text = src->map;
+    *size = src->map_size;
+    return MF_OK;
+  }
+
+  int64_t file_size = -1;
+  if (seek_stream(src->stream, 0, SEEK_END) == 0) {
+    file_size = tell_stream(src->stream);
+  }
+  if (file_size < 0 || seek_stream(src->stream, 0, SEEK_SET) != 0) {
+    fprintf(stderr, "Error: failed to determine file size\n");
+    return MF_ERROR_FAILED_IO_OPERATION;
+  }
+  if ((int64_t)(size_t)file_size != file_size) {
+    fprintf(stderr, "Error: file of %lld bytes does not fit into the address space\n", (long long)file_size);
+    return MF_ERROR_UNSUPPORTED_FEATURE_REQUIRED;
+  }
+  *owned = malloc(file_size);
+  if (!*owned) {
+    fprintf(stderr, "Error: failed to allocate %lld bytes for file\n", (long long)file_size);
+    return MF_ERROR_FAILED_IO_OPERATION;
+  }
+  if (fread(*owned, 1, file_size, src->stream) != (size_t)file_size) {
+    fprintf(stderr, "Error: failed to perform read operation\n");
+    free(*owned);
+    *owned = NULL;
+    return MF_ERROR_FAILED_IO_OPERATION;
+  }
+  *text = *owned;
+  *size = file_size;
+  return MF_OK;
+}
+
+static mf_status_t read_text_time(mf_time_t *t, text_cursor_t *cur) {
+  const char *token;
+  int64_t length;
+  if (!next_token(cur, &token, &length) || !parse_real(token, length, &t->value) || !next_mnemonic(cur, t->dimension)) {
+    fprintf(stderr, "Error: invalid TIME record\n");
+    return MF_ERROR_INVALID_FILE;
+  }
+  t->dimension[8] = '\0';
+  return MF_OK;
+}
+
+static mf_status_t read_text_date(mf_date_t *d, text_cursor_t *cur) {
+  int64_t day;
+  int64_t year;
+  if (!next_integer(cur, &day) || !next_mnemonic(cur, d->month) || !next_integer(cur, &year) || day < INT32_MIN ||
+      day > INT32_MAX || year < INT32_MIN || year > INT32_MAX) {
+    fprintf(stderr, "Error: invalid DATE record\n");
+    return MF_ERROR_INVALID_FILE;
+  }
+  d->day = (int32_t)day;
+  d->month[8] = '\0';
+  d->year = (int32_t)year;
+  return MF_OK;
+}
+
+// Descriptors are hashed in their binary form, so that plans compiled from binary files also decode ASCII ones. The
+// dimension of a property may be omitted, in which case the token following the mnemonic is already a tag
+static mf_status_t read_text_arrays(text_cursor_t *cur, const char *text, mf_arrays_t *arrays, int64_t *offset,
+                                    int64_t *size, uint64_t *layout) {
+  int64_t num_properties;
+  int64_t num_objects;
+  arrays->properties = NULL;
+  if (!expect_keyword(cur, "ARRAYS")) {
+    return MF_ERROR_INVALID_FILE;
+  }
+  if (!next_integer(cur, &num_properties) || !next_integer(cur, &num_objects) || num_properties < 0 ||
+      num_properties > INT32_MAX || num_objects < 0 || num_objects > INT32_MAX) {
+    fprintf(stderr, "Error: invalid ARRAYS record\n");
+    return MF_ERROR_INVALID_FILE;
+  }
+  arrays->num_properties = (int32_t)num_properties;
+  arrays->num_objects = (int32_t)num_objects;
+
+  mf_status_t err = MF_OK;
+  uint64_t hash = FNV_OFFSET;
+  if (arrays->num_properties > 0) {
+    arrays->properties = calloc(arrays->num_properties, sizeof(mf_property_t));
+    hash = hash_bytes(hash, (const char *)&arrays->num_properties, 4);
+  }
+  int32_t i = 0;
+  for (; i < arrays->num_properties; ++i) {
+    mf_property_t *prop = arrays->properties + i;
+    // Mnemonic, dimension and up to three tags followed by ENDITEM, as in binary files
+    char prop_buf[16 + 4 * 8];
+    if (!next_mnemonic(cur, prop_buf) || !next_mnemonic(cur, prop_buf + 8)) {
+      goto on_invalid_prop;
+    }
+    memcpy(prop->name, prop_buf, 8);
+    prop->name[8] = '\0';
+
+    mf_property_t probe;
+    if (parse_tag(prop_buf + 8, &probe) != TAG_UNKNOWN) {
+      memcpy(prop_buf + 16, prop_buf + 8, 8);
+      memset(prop_buf + 8, ' ', 8);
+    } else if (!next_mnemonic(cur, prop_buf + 16)) {
+      goto on_invalid_prop;
+    }
+    memcpy(prop->dimension, prop_buf + 8, 8);
+    prop->dimension[8] = '\0';
+
+    prop->data_type = MF_REAL8;
+    prop->output_mode = MF_SINGLE;
+    prop->phase_state = MF_STATE0;
+
+    int tag_idx = 0;
+    while (true) {
+      char *tag = prop_buf + 16 + tag_idx * 8;
+      int kind = parse_tag(tag, prop);
+      if (kind == TAG_END) {
+        break;
+      }
+      if (kind == TAG_UNKNOWN) {
+        fprintf(stderr, "Error: unknown tag '%.8s'\n", tag);
+        err = MF_ERROR_INVALID_FILE;
+        goto on_error;
+      }
+      if (!next_mnemonic(cur, tag + 8)) {
+        goto on_invalid_prop;
+      }
+      if (++tag_idx == 3) {
+        if (memcmp(tag + 8, "ENDITEM ", 8)) {
+          goto on_invalid_prop;
+        }
+        break;
+      }
+    }
+
+    hash = hash_bytes(hash, prop_buf, 16 + (tag_idx + 1) * 8);
+  }
+  *layout = hash;
+
+  if (!expect_keyword(cur, "DATA")) {
+    err = MF_ERROR_INVALID_FILE;
+    goto on_error;
+  }
+  const char *end = find_keyword(cur->pos, cur->end, "ENDDATA");
+  if (!end) {
+    fprintf(stderr, "Error: DATA record is not terminated by ENDDATA\n");
+    err = MF_ERROR_INVALID_FILE;
+    goto on_error;
+  }
+  *offset = cur->pos - text;
+  *size = end - cur->pos;
+  cur->pos = end + 7;
+  return MF_OK;
+
+on_invalid_prop:
+  fprintf(stderr, "Error: invalid descriptor of property %d in ARRAYS record\n", i + 1);
+  err = MF_ERROR_INVALID_FILE;
+
+on_error:
+  free(arrays->properties);
+  arrays->properties = NULL;
+  return err;
+}
+
+static void set_block(mf_sum_file_t *file, mf_sum_description_t *desc, int block, mf_arrays_t *arrays, int64_t offset,
+                      int64_t size, uint64_t layout) {
+  switch (block) {
+  case CELLDATA:
+    desc->celldata = arrays;
+    file->celldata_offset = offset;
+    file->celldata_size = size;
+    file->celldata_layout = layout;
+    break;
+  case CONNDATA:
+    desc->conndata = arrays;
+    file->conndata_offset = offset;
+    file->conndata_size = size;
+    file->conndata_layout = layout;
+    break;
+  case SRCDATA:
+    desc->srcdata = arrays;
+    file->srcdata_offset = offset;
+    file->srcdata_size = size;
+    file->srcdata_layout = layout;
+    break;
+  case FPCEDATA:
+    desc->fpcedata = arrays;
+    file->fpcedata_offset = offset;
+    file->fpcedata_size = size;
+    file->fpcedata_layout = layout;
+    break;
+  default:
+    desc->fpcodata = arrays;
+    file->fpcodata_offset = offset;
+    file->fpcodata_size = size;
+    file->fpcodata_layout = layout;
+    break;
+  }
+}
+
+mf_status_t open_sum_text(mf_sum_file_t *sum_file, source_t *src) {
+  mf_status_t err = load_text(src, &sum_file->text, &sum_file->text_size, &sum_file->owned_text);
+  if (err != MF_OK) {
+    return err;
+  }
+
+  text_cursor_t cur = {sum_file->text, sum_file->text + sum_file->text_size};
+  const char *token;
+  int64_t length;
+  // ASCII keyword, checked by read_file_format
+  next_token(&cur, &token, &length);
+
+  mf_sum_description_t *desc = calloc(1, sizeof(mf_sum_description_t));
+  double arrays_seconds = 0;
+  while (true) {
+    if (!next_token(&cur, &token, &length)) {
+      fprintf(stderr, "Error: unexpected end of file\n");
+      err = MF_ERROR_INVALID_FILE;
+      goto on_error;
+    }
+
+    int block = 0;
+    while (block < NUM_BLOCKS && !token_is(token, length, block_keywords[block])) {
+      ++block;
+    }
+    if (token_is(token, length, "TIME")) {
+      desc->time = malloc(sizeof(mf_time_t));
+      checked(read_text_time(desc->time, &cur), err);
+    } else if (token_is(token, length, "DATE")) {
+      desc->date = malloc(sizeof(mf_date_t));
+      checked(read_text_date(desc->date, &cur), err);
+    } else if (block < NUM_BLOCKS) {
+      double start = monotonic_seconds();
+      mf_arrays_t *arrays = malloc(sizeof(mf_arrays_t));
+      int64_t offset;
+      int64_t size;
+      uint64_t layout;
+      err = read_text_arrays(&cur, sum_file->text, arrays, &offset, &size, &layout);
+      if (err != MF_OK) {
+        free(arrays);
+        goto on_error;
+      }
+      set_block(sum_file, desc, block, arrays, offset, size, layout);
+      arrays_seconds += monotonic_seconds() - start;
+    } else if (token_is(token, length, "ENDFILE")) {
+      break;
+    } else {
+#ifdef _DEBUG
+      fprintf(stderr, "Warning: unknown keyword '%.*s', skipping\n", (int)length, token);
+#endif
+    }
+  }
+
+  sum_file->description = desc;
+  sum_file->stats.arrays_seconds = arrays_seconds;
+  sum_file->stats.header_bytes = sum_file->text_size;
+  return MF_OK;
+
+on_error:
+  free_sum_description(desc);
+  free(sum_file->owned_text);
+  sum_file->owned_text = NULL;
+  return err;
+}
+
+mf_status_t open_mvs_text(mf_mvs_file_t *mvs_file, source_t *src) {
+  mf_status_t err = load_text(src, &mvs_file->text, &mvs_file->text_size, &mvs_file->owned_text);
+  if (err != MF_OK) {
+    return err;
+  }
+
+  text_cursor_t cur = {mvs_file->text, mvs_file->text + mvs_file->text_size};
+  const char *token;
+  int64_t length;
+  // ASCII keyword, checked by read_file_format
+  next_token(&cur, &token, &length);
+
+  int64_t num_vertices;
+  int64_t num_cells;
+  if (!expect_keyword(&cur, "GRIDDATA") || !expect_keyword(&cur, "GRIDSIZE")) {
+    err = MF_ERROR_INVALID_FILE;
+    goto on_error;
+  }
+  if (!next_integer(&cur, &num_vertices) || !next_integer(&cur, &num_cells) || num_vertices < 0 ||
+      num_vertices > INT32_MAX || num_cells < 0 || num_cells > INT32_MAX) {
+    fprintf(stderr, "Error: invalid GRIDSIZE record\n");
+    err = MF_ERROR_INVALID_FILE;
+    goto on_error;
+  }
+  if (!expect_keyword(&cur, "POINTS")) {
+    err = MF_ERROR_INVALID_FILE;
+    goto on_error;
+  }
+  const char *cells = find_keyword(cur.pos, cur.end, "CELLS");
+  if (!cells) {
+    fprintf(stderr, "Error: expected 'CELLS' record\n");
+    err = MF_ERROR_INVALID_FILE;
+    goto on_error;
+  }
+
+  mvs_file->vertices_offset = cur.pos - mvs_file->text;
+  mvs_file->vertices_size = cells - cur.pos;
+  mvs_file->cells_offset = cells + 5 - mvs_file->text;
+  mvs_file->cells_size = mvs_file->text_size - mvs_file->cells_offset;
+
+  mvs_file->description = malloc(sizeof(mf_mvs_description_t));
+  mvs_file->description->num_vertices = (int32_t)num_vertices;
+  mvs_file->description->num_cells = (int32_t)num_cells;
+  return MF_OK;
+
+on_error:
+  free(mvs_file->owned_text);
+  mvs_file->owned_text = NULL;
+  return err;
+}
+
+mf_status_t read_text_mvs(const mf_mvs_file_t *file, mf_mvs_attachment_t *data) {
+  const mf_mvs_description_t *desc = file->description;
+  text_field_t fields[9];
+  if (desc->num_vertices > 0) {
+    for (int idx = 0; idx < 3; ++idx) {
+      fields[idx] = (text_field_t){MF_REAL8, (char *)data->points + idx * sizeof(double), 3 * sizeof(double),
+                                   desc->num_vertices, 0};
+    }
+    mf_status_t err = parse_text_records(file->text + file->vertices_offset, file->vertices_size, fields, 3,
+                                         desc->num_vertices);
+    if (err != MF_OK) {
+      return err;
+    }
+  }
+  if (desc->num_cells > 0) {
+    fields[0] = (text_field_t){MF_INT4, (char *)data->cell_ids, sizeof(int32_t), desc->num_cells, 0};
+    for (int idx = 1; idx < 9; ++idx) {
+      fields[idx] = (text_field_t){MF_INT4, (char *)data->cells + (idx - 1) * sizeof(int32_t), 8 * sizeof(int32_t),
+                                   desc->num_cells, 0};
+    }
+    return parse_text_records(file->text + file->cells_offset, file->cells_size, fields, 9, desc->num_cells);
+  }
+  return MF_OK;
+}
+
+// Connectivity graphs. Cell IDs of every connection are looked up in the map of rows and connections between two
+// rows are compacted, then entries are placed by a counting sort: every task counts the entries of its range of
+// connections per row, the counts give each task its own positions within every row, and tasks fill their entries
+// without synchronization. Entries of a row are therefore ordered by connection for any number of threads
+
+#define GRAPH_TASK_SIZE (1 << 16)
+
+// Row of every cell ID: a table over the range of IDs when they are dense, pairs of ID and row sorted by ID otherwise
+typedef struct {
+  int32_t min_id;
+  int64_t num_ids;
+  int32_t *table;
+  int32_t (*sorted)[2];
+  int32_t num_cells;
+  int32_t num_rows;
+} row_lookup_t;
+
+typedef struct {
+  const row_lookup_t *lookup;
+  const int32_t *ids[2];
+  const mf_property_t *const *value_props;
+  char **raw_values;
+  mf_conn_graph_t *graph;
+} graph_build_t;
+
+typedef struct {
+  const graph_build_t *build;
+  int32_t begin;
+  int32_t end;
+  int32_t first_kept;
+  int32_t num_kept;
+  // Entries of the task in every row, turned into the position of its next entry before filling
+  int64_t *counts;
+} graph_task_t;
+
+static int id_row_cmp(const void *v1, const void *v2) {
+  int32_t id1 = *(const int32_t *)v1;
+  int32_t id2 = *(const int32_t *)v2;
+  return (id1 > id2) - (id1 < id2);
+}
+
+static mf_status_t build_row_lookup(const int32_t *cell_ids, const int32_t *rows, int32_t num_cells, int32_t num_rows,
+                                    row_lookup_t *lookup) {
+  memset(lookup, 0, sizeof(row_lookup_t));
+  lookup->num_cells = num_cells;
+  lookup->num_rows = num_rows;
+  if (num_cells <= 0) {
+    return MF_OK;
+  }
+
+  int32_t min_id = cell_ids[0];
+  int32_t max_id = cell_ids[0];
+  for (int32_t idx = 1; idx < num_cells; ++idx) {
+    min_id = cell_ids[idx] < min_id ? cell_ids[idx] : min_id;
+    max_id = cell_ids[idx] > max_id ? cell_ids[idx] : max_id;
+  }
+  int64_t range = (int64_t)max_id - min_id + 1;
+  if (range <= 4 * (int64_t)num_cells) {
+    lookup->min_id = min_id;
+    lookup->num_ids = range;
+    lookup->table = malloc(range * sizeof(int32_t));
+    if (!lookup->table) {
+      fprintf(stderr, "Error: failed to allocate row table of %lld cell IDs\n", (long long)range);
+      return MF_ERROR_FAILED_IO_OPERATION;
+    }
+    fill_array(lookup->table, range, -1);
+    for (int32_t idx = 0; idx < num_cells; ++idx) {
+      if (lookup->table[cell_ids[idx] - min_id] >= 0) {
+        fprintf(stderr, "Error: cell ID %d occurs more than once\n", cell_ids[idx]);
+        free(lookup->table);
+        lookup->table = NULL;
+        return MF_ERROR_INVALID_READ_REQUEST;
+      }
+      // Cells outside of the graph still get an entry, so that their IDs take part in the duplicate check
+      lookup->table[cell_ids[idx] - min_id] = rows[idx] >= 0 && rows[idx] < num_rows ? rows[idx] : INT32_MAX;
+    }
+    return MF_OK;
+  }
+
+  lookup->sorted = malloc(num_cells * sizeof(*lookup->sorted));
+  if (!lookup->sorted) {
+    fprintf(stderr, "Error: failed to allocate row table of %d cells\n", num_cells);
+    return MF_ERROR_FAILED_IO_OPERATION;
+  }
+  for (int32_t idx = 0; idx < num_cells; ++idx) {
+    lookup->sorted[idx][0] = cell_ids[idx];
+    lookup->sorted[idx][1] = rows[idx];
+  }
+  qsort(lookup->sorted, num_cells, sizeof(*lookup->sorted), id_row_cmp);
+  for (int32_t idx = 1; idx < num_cells; ++idx) {
+    if (lookup->sorted[idx][0] == lookup->sorted[idx - 1][0]) {
+      fprintf(stderr, "Error: cell ID %d occurs more than once\n", lookup->sorted[idx][0]);
+      free(lookup->sorted);
+      lookup->sorted = NULL;
+      return MF_ERROR_INVALID_READ_REQUEST;
+    }
+  }
+  return MF_OK;
+}
+
+// Returns -1 for IDs that are unknown or whose rows are outside of the graph
+static int32_t lookup_row(const row_lookup_t *lookup, int32_t id) {
+  int32_t row = -1;
+  if (lookup->table) {
+    int64_t idx = (int64_t)id - lookup->min_id;
+    if (idx >= 0 && idx < lookup->num_ids) {
+      row = lookup->table[idx];
+    }
+  } else if (lookup->sorted) {
+    int32_t lo = 0;
+    int32_t hi = lookup->num_cells;
+    while (lo < hi) {
+      int32_t mid = lo + (hi - lo) / 2;
+      if (lookup->sorted[mid][0] < id) {
+        lo = mid + 1;
+      } else {
+        hi = mid;
+      }
+    }
+    if (lo < lookup->num_cells && lookup->sorted[lo][0] == id) {
+      row = lookup->sorted[lo][1];
+    }
+  }
+  return row >= 0 && row < lookup->num_rows ? row : -1;
+}
+
+static double value_as_double(const char *src, mf_data_type_t type) {
+  int8_t int1;
+  int16_t int2;
+  int32_t int4;
+  float real4;
+  double real8;
+  switch (type) {
+  case MF_INT1:
+    memcpy(&int1, src, sizeof(int1));
+    return int1;
+  case MF_INT2:
+    memcpy(&int2, src, sizeof(int2));
+    return int2;
+  case MF_INT4:
+    memcpy(&int4, src, sizeof(int4));
+    return int4;
+  case MF_REAL4:
+    memcpy(&real4, src, sizeof(real4));
+    return real4;
+  default:
+    memcpy(&real8, src, sizeof(real8));
+    return real8;
+  }
+}
+
+static void *count_kept(void *arg) {
+  graph_task_t *task = arg;
+  const graph_build_t *build = task->build;
+  int32_t num_kept = 0;
+  for (int32_t conn = task->begin; conn < task->end; ++conn) {
+    num_kept +=
+        lookup_row(build->lookup, build->ids[0][conn]) >= 0 && lookup_row(build->lookup, build->ids[1][conn]) >= 0;
+  }
+  task->num_kept = num_kept;
+  return NULL;
+}
+
+static void *compact_conns(void *arg) {
+  graph_task_t *task = arg;
+  const graph_build_t *build = task->build;
+  mf_conn_graph_t *graph = build->graph;
+  int32_t kept = task->first_kept;
+  for (int32_t conn = task->begin; conn < task->end; ++conn) {
+    int32_t row0 = lookup_row(build->lookup, build->ids[0][conn]);
+    int32_t row1 = lookup_row(build->lookup, build->ids[1][conn]);
+    if (row0 < 0 || row1 < 0) {
+      continue;
+    }
+    graph->conn_rows[kept][0] = row0;
+    graph->conn_rows[kept][1] = row1;
+    for (int32_t value_idx = 0; value_idx < graph->num_values; ++value_idx) {
+      mf_data_type_t type = build->value_props[value_idx]->data_type;
+      graph->values[value_idx][kept] =
+          value_as_double(build->raw_values[value_idx] + (size_t)conn * elem_size(type), type);
+    }
+    task->counts[row0]++;
+    task->counts[row1]++;
+    kept++;
+  }
+  return NULL;
+}
+
+static void *fill_entries(void *arg) {
+  graph_task_t *task = arg;
+  mf_conn_graph_t *graph = task->build->graph;
+  for (int32_t conn = task->first_kept; conn < task->first_kept + task->num_kept; ++conn) {
+    int32_t row0 = graph->conn_rows[conn][0];
+    int32_t row1 = graph->conn_rows[conn][1];
+    int64_t pos = task->counts[row0]++;
+    graph->columns[pos] = row1;
+    graph->conns[pos] = conn;
+    pos = task->counts[row1]++;
+    graph->columns[pos] = row0;
+    graph->conns[pos] = conn;
+  }
+  return NULL;
+}
+
+static const mf_property_t *conn_property(const mf_arrays_t *conndata, const char *name) {
+  for (int32_t prop_idx = 0; prop_idx < conndata->num_properties; ++prop_idx) {
+    if (!memcmp(conndata->properties[prop_idx].name, name, 8)) {
+      return &conndata->properties[prop_idx];
+    }
+  }
+  fprintf(stderr, "Error: CONNDATA doesn't contain property '%s'\n", name);
+  return NULL;
+}
+
+mf_status_t mf_read_conn_graph(mf_sum_file_t *file, const char *ids_name, const mf_sum_block_query_t *values,
+                               const int32_t *cell_ids, const int32_t *rows, int32_t num_cells, int32_t num_rows,
+                               mf_conn_graph_t *graph) {
+  assert(file);
+  assert(graph);
+  assert(num_cells >= 0 && num_rows >= 0);
+  memset(graph, 0, sizeof(mf_conn_graph_t));
+  const mf_arrays_t *conndata = file->description->conndata;
+  if (!conndata) {
+    fprintf(stderr, "Error: CONNDATA is missing\n");
+    return MF_ERROR_MISSING_PROPERTY;
+  }
+
+  int32_t num_values = values ? values->num_items : 0;
+  const mf_property_t *ids_prop = conn_property(conndata, ids_name);
+  if (!ids_prop) {
+    return MF_ERROR_MISSING_PROPERTY;
+  }
+  if (ids_prop->data_type != MF_INT4 || ids_prop->output_mode != MF_DOUBLE || ids_prop->phase_state != MF_STATE0) {
+    fprintf(stderr, "Error: property '%s' must hold two 4-byte integer cell IDs\n", ids_name);
+    return MF_ERROR_INVALID_READ_REQUEST;
+  }
+  const mf_property_t **value_props = calloc(num_values + 1, sizeof(mf_property_t *));
+  if (!value_props) {
+    fprintf(stderr, "Error: failed to allocate %d connection properties\n", num_values);
+    return MF_ERROR_FAILED_IO_OPERATION;
+  }
+  for (int32_t value_idx = 0; value_idx < num_values; ++value_idx) {
+    const mf_property_t *prop = conn_property(conndata, values->names[value_idx]);
+    if (!prop) {
+      free(value_props);
+      return MF_ERROR_MISSING_PROPERTY;
+    }
+    if (prop->output_mode != MF_SINGLE || prop->phase_state != MF_STATE0 || prop->data_type == MF_CHAR4 ||
+        prop->data_type == MF_CHAR8) {
+      fprintf(stderr, "Error: property '%s' must be a single number per connection\n", prop->name);
+      free(value_props);
+      return MF_ERROR_INVALID_READ_REQUEST;
+    }
+    value_props[value_idx] = prop;
+  }
+
+  // Cell IDs come first, then values
+  int32_t num_conns = conndata->num_objects;
+  int32_t *ids[2] = {malloc((num_conns + 1) * sizeof(int32_t)), malloc((num_conns + 1) * sizeof(int32_t))};
+  char **raw_values = calloc(num_values + 1, sizeof(char *));
+  char(*names)[9] = calloc(num_values + 1, sizeof(*names));
+  mf_data_t *data = calloc(num_values + 1, sizeof(mf_data_t));
+  row_lookup_t lookup = {0};
+  graph_task_t tasks[MAX_THREADS];
+  int count = 0;
+  mf_status_t err = MF_OK;
+  bool allocated = ids[0] && ids[1] && raw_values && names && data;
+  for (int32_t value_idx = 0; allocated && value_idx < num_values; ++value_idx) {
+    int size = elem_size(value_props[value_idx]->data_type);
+    raw_values[value_idx] = malloc((size_t)(num_conns + 1) * size);
+    allocated = raw_values[value_idx] != NULL;
+    memcpy(names[value_idx + 1], value_props[value_idx]->name, 9);
+    data[value_idx + 1] = (mf_data_t){.bytes = raw_values[value_idx], .stride = size, .count = num_conns};
+  }
+  if (!allocated) {
+    fprintf(stderr, "Error: failed to allocate CONNDATA of %d connections\n", num_conns);
+    err = MF_ERROR_FAILED_IO_OPERATION;
+    goto on_error;
+  }
+  memcpy(names[0], ids_prop->name, 9);
+  data[0] = (mf_data_t){.bytes = ids, .stride = sizeof(int32_t), .count = num_conns};
+  mf_sum_block_query_t query = {.names = names, .num_items = num_values + 1};
+  err = read_data(file, CONNDATA, &query, data, 0);
+
+  if (err == MF_OK) {
+    err = build_row_lookup(cell_ids, rows, num_cells, num_rows, &lookup);
+  }
+  if (err != MF_OK) {
+    goto on_error;
+  }
+
+  graph_build_t build = {.lookup = &lookup,
+                         .ids = {ids[0], ids[1]},
+                         .value_props = value_props,
+                         .raw_values = raw_values,
+                         .graph = graph};
+  // Every task counts entries of all rows, so tasks get at least as many connections as there are rows; this bounds
+  // both the counts and the serial prefix sum over rows and tasks by the number of connections
+  int num = num_tasks(num_conns, GRAPH_TASK_SIZE);
+  if (num_rows > 0 && num > num_conns / num_rows) {
+    num = num_conns / num_rows > 1 ? num_conns / num_rows : 1;
+  }
+  for (; count < num; ++count) {
+    tasks[count] = (graph_task_t){.build = &build,
+                                  .begin = (int32_t)((int64_t)num_conns * count / num),
+                                  .end = (int32_t)((int64_t)num_conns * (count + 1) / num),
+                                  .counts = calloc(num_rows + 1, sizeof(int64_t))};
+    if (!tasks[count].counts) {
+      fprintf(stderr, "Error: failed to allocate entry counts of %d rows\n", num_rows);
+      err = MF_ERROR_FAILED_IO_OPERATION;
+      goto on_error;
+    }
+  }
+  run_tasks(tasks, sizeof(graph_task_t), count, count_kept);
+  int32_t num_kept = 0;
+  for (int task_idx = 0; task_idx < count; ++task_idx) {
+    tasks[task_idx].first_kept = num_kept;
+    num_kept += tasks[task_idx].num_kept;
+  }
+
+  graph->num_rows = num_rows;
+  graph->num_conns = num_kept;
+  graph->row_offsets = malloc((num_rows + 1) * sizeof(int64_t));
+  graph->columns = malloc((2 * (size_t)num_kept + 1) * sizeof(int32_t));
+  graph->conns = malloc((2 * (size_t)num_kept + 1) * sizeof(int32_t));
+  graph->conn_rows = malloc(((size_t)num_kept + 1) * sizeof(*graph->conn_rows));
+  graph->values = calloc(num_values + 1, sizeof(double *));
+  graph->num_values = graph->values ? num_values : 0;
+  allocated = graph->row_offsets && graph->columns && graph->conns && graph->conn_rows && graph->values;
+  for (int32_t value_idx = 0; allocated && value_idx < num_values; ++value_idx) {
+    graph->values[value_idx] = malloc(((size_t)num_kept + 1) * sizeof(double));
+    allocated = graph->values[value_idx] != NULL;
+  }
+  if (!allocated) {
+    fprintf(stderr, "Error: failed to allocate graph of %d rows and %d connections\n", num_rows, num_kept);
+    mf_free_conn_graph(graph);
+    err = MF_ERROR_FAILED_IO_OPERATION;
+    goto on_error;
+  }
+  run_tasks(tasks, sizeof(graph_task_t), count, compact_conns);
+
+  int64_t num_entries = 0;
+  for (int32_t row = 0; row < num_rows; ++row) {
+    graph->row_offsets[row] = num_entries;
+    for (int task_idx = 0; task_idx < count; ++task_idx) {
+      int64_t task_entries = tasks[task_idx].counts[row];
+      tasks[task_idx].counts[row] = num_entries;
+      num_entries += task_entries;
+    }
+  }
+  graph->row_offsets[num_rows] = num_entries;
+  run_tasks(tasks, sizeof(graph_task_t), count, fill_entries);
+
+on_error:
+  for (int task_idx = 0; task_idx < count; ++task_idx) {
+    free(tasks[task_idx].counts);
+  }
+  free(lookup.table);
+  free(lookup.sorted);
+  for (int32_t value_idx = 0; raw_values && value_idx < num_values; ++value_idx) {
+    free(raw_values[value_idx]);
+  }
+  free(raw_values);
+  free(names);
+  free(data);
+  free(ids[0]);
+  free(ids[1]);
+  free(value_props);
+  return err;
+}
+
+void mf_free_conn_graph(mf_conn_graph_t *graph) {
+  for (int32_t value_idx = 0; value_idx < graph->num_values; ++value_idx) {
+    free(graph->values[value_idx]);
+  }
+  free(graph->values);
+  free(graph->row_offsets);
+  free(graph->columns);
+  free(graph->conns);
+  free(graph->conn_rows);
+  memset(graph, 0, sizeof(mf_conn_graph_t));
+}
+
+// Field codec: LZMA-style binary range coder with 11-bit adaptive probabilities. Every byte is coded bit by bit along
+// a binary tree of 256 probabilities; separate trees are kept for every byte plane and for the four combinations of
+// whether the previous byte of the plane and the more significant byte of the same value are zero. Encoded fields
+// start with the mode byte; range-coded ones then have a byte with a bit set for every plane that is not entirely
+// zero, other planes are skipped
+
+#define RC_TOP (1u << 24)
+#define RC_PROB_BITS 11
+#define RC_PROB_INIT (1u << (RC_PROB_BITS - 1))
+#define RC_MOVE_BITS 5
+#define CODEC_STORED 0
+#define CODEC_RANGE 1
+
+typedef uint16_t plane_model_t[4][256];
+
+typedef struct {
+  uint64_t low;
+  uint32_t range;
+  uint8_t cache;
+  int64_t cache_size;
+  uint8_t *dst;
+  int64_t pos;
+  int64_t capacity;
+} rc_encoder_t;
+
+typedef struct {
+  uint32_t code;
+  uint32_t range;
+  const uint8_t *src;
+  int64_t pos;
+  int64_t size;
+} rc_decoder_t;
+
+static void init_models(plane_model_t *models) {
+  for (int plane = 0; plane < 8; ++plane) {
+    for (int ctx = 0; ctx < 4; ++ctx) {
+      for (int node = 0; node < 256; ++node) {
+        models[plane][ctx][node] = RC_PROB_INIT;
+      }
+    }
+  }
+}
+
+static uint64_t field_bits(const double *values, const double *base, int64_t idx) {
+  uint64_t bits;
+  memcpy(&bits, &values[idx], 8);
+  if (base) {
+    uint64_t base_bits;
+    memcpy(&base_bits, &base[idx], 8);
+    bits ^= base_bits;
+  }
+  return bits;
+}
+
+static void rc_shift_low(rc_encoder_t *rc) {
+  if ((uint32_t)rc->low < 0xFF000000u || (rc->low >> 32) != 0) {
+    uint8_t carry = (uint8_t)(rc->low >> 32);
+    uint8_t byte = rc->cache;
+    do {
+      // Writes past the capacity are dropped, the caller falls back to the stored mode
+      if (rc->pos < rc->capacity) {
+        rc->dst[rc->pos] = (uint8_t)(byte + carry);
+      }
+      rc->pos++;
+      byte = 0xFF;
+    } while (--rc->cache_size != 0);
+    rc->cache = (uint8_t)(rc->low >> 24);
+  }
+  rc->cache_size++;
+  rc->low = (rc->low & 0x00FFFFFFu) << 8;
+}
+
+static void rc_encode_byte(rc_encoder_t *rc, uint16_t *probs, unsigned byte) {
+  unsigned node = 1;
+  for (int bit_idx = 7; bit_idx >= 0; --bit_idx) {
+    unsigned bit = (byte >> bit_idx) & 1;
+    uint16_t *prob = &probs[node];
+    uint32_t bound = (rc->range >> RC_PROB_BITS) * *prob;
+    if (bit == 0) {
+      rc->range = bound;
+      *prob += ((1u << RC_PROB_BITS) - *prob) >> RC_MOVE_BITS;
+    } else {
+      rc->low += bound;
+      rc->range -= bound;
+      *prob -= *prob >> RC_MOVE_BITS;
+    }
+    while (rc->range < RC_TOP) {
+      rc->range <<= 8;
+      rc_shift_low(rc);
+    }
+    node = (node << 1) | bit;
+  }
+}
+
+static unsigned rc_decode_byte(rc_decoder_t *rc, uint16_t *probs) {
+  unsigned node = 1;
+  while (node < 256) {
+    uint16_t *prob = &probs[node];
+    uint32_t bound = (rc->range >> RC_PROB_BITS) * *prob;
+    if (rc->code < bound) {
+      rc->range = bound;
+      *prob += ((1u << RC_PROB_BITS) - *prob) >> RC_MOVE_BITS;
+      node <<= 1;
+    } else {
+      rc->code -= bound;
+      rc->range -= bound;
+      *prob -= *prob >> RC_MOVE_BITS;
+      node = (node << 1) | 1;
+    }
+    while (rc->range < RC_TOP) {
+      rc->range <<= 8;
+      // Reading past the end yields zeros; a truncated stream decodes to wrong values but never overruns the buffer
+      rc->code = (rc->code << 8) | (rc->pos < rc->size ? rc->src[rc->pos] : 0);
+      rc->pos++;
+    }
+  }
+  return node - 256;
+}
+
+static int byte_context(uint64_t prev_bits, uint64_t bits, int plane) {
+  int ctx = ((prev_bits >> (8 * plane)) & 0xFF) != 0;
+  if (plane < 7) {
+    ctx |= (((bits >> (8 * plane + 8)) & 0xFF) != 0) << 1;
+  }
+  return ctx;
+}
+
+int64_t mf_field_bound(int64_t count) { return 2 + 8 * count; }
+
+int64_t mf_encode_field(const double *values, const double *base, int64_t count, void *dst) {
+  uint8_t *out = dst;
+  int64_t capacity = mf_field_bound(count);
+  plane_model_t *models = malloc(8 * sizeof(plane_model_t));
+  assert(models);
+  init_models(models);
+
+  uint64_t nonzero = 0;
+  for (int64_t idx = 0; idx < count; ++idx) {
+    nonzero |= field_bits(values, base, idx);
+  }
+  uint8_t plane_mask = 0;
+  for (int plane = 0; plane < 8; ++plane) {
+    plane_mask |= (((nonzero >> (8 * plane)) & 0xFF) != 0) << plane;
+  }
+
+  rc_encoder_t rc = {.range = 0xFFFFFFFFu, .cache_size = 1, .dst = out + 2, .capacity = capacity - 2};
+  for (int plane = 7; plane >= 0; --plane) {
+    if (!(plane_mask & (1 << plane))) {
+      continue;
+    }
+    uint64_t prev_bits = 0;
+    for (int64_t idx = 0; idx < count; ++idx) {
+      uint64_t bits = field_bits(values, base, idx);
+      int ctx = byte_context(prev_bits, bits, plane);
+      rc_encode_byte(&rc, models[plane][ctx], (bits >> (8 * plane)) & 0xFF);
+      prev_bits = bits;
+    }
+    if (rc.pos >= rc.capacity) {
+      break;
+    }
+  }
+  for (int flush_idx = 0; flush_idx < 5; ++flush_idx) {
+    rc_shift_low(&rc);
+  }
+  free(models);
+
+  if (rc.pos < rc.capacity) {
+    out[0] = CODEC_RANGE;
+    out[1] = plane_mask;
+    return 2 + rc.pos;
+  }
+
+  out[0] = CODEC_STORED;
+  for (int64_t idx = 0; idx < count; ++idx) {
+    uint64_t bits = field_bits(values, base, idx);
+    memcpy(out + 1 + 8 * idx, &bits, 8);
+  }
+  return 1 + 8 * count;
+}
+
+mf_status_t mf_decode_field(const void *src, int64_t size, const double *base, int64_t count, double *values) {
+  const uint8_t *in = src;
+  if (size < 1) {
+    return MF_ERROR_INVALID_FILE;
+  }
+
+  if (in[0] == CODEC_STORED) {
+    if (size != 1 + 8 * count) {
+      return MF_ERROR_INVALID_FILE;
+    }
+    memcpy(values, in + 1, 8 * count);
+  } else if (in[0] == CODEC_RANGE && size >= 2) {
+    uint8_t plane_mask = in[1];
+    plane_model_t *models = malloc(8 * sizeof(plane_model_t));
+    assert(models);
+    init_models(models);
+
+    // The first byte written by the encoder is always zero
+    rc_decoder_t rc = {.range = 0xFFFFFFFFu, .src = in + 2, .size = size - 2};
+    for (int byte_idx = 0; byte_idx < 5; ++byte_idx) {
+      rc.code = (rc.code << 8) | (rc.pos < rc.size ? rc.src[rc.pos] : 0);
+      rc.pos++;
+    }
+    memset(values, 0, 8 * count);
+    for (int plane = 7; plane >= 0; --plane) {
+      if (!(plane_mask & (1 << plane))) {
+        continue;
+      }
+      uint64_t prev_bits = 0;
+      for (int64_t idx = 0; idx < count; ++idx) {
+        uint64_t bits;
+        memcpy(&bits, &values[idx], 8);
+        int ctx = byte_context(prev_bits, bits, plane);
+        bits |= (uint64_t)rc_decode_byte(&rc, models[plane][ctx]) << (8 * plane);
+        memcpy(&values[idx], &bits, 8);
+        prev_bits = bits;
+      }
+    }
+    free(models);
+    if (rc.pos > rc.size) {
+      return MF_ERROR_INVALID_FILE;
+    }
+  } else {
+    return MF_ERROR_INVALID_FILE;
+  }
+
+  if (base) {
+    for (int64_t idx = 0; idx < count; ++idx) {
+      uint64_t bits = field_bits(values, base, idx);
+      memcpy(&values[idx], &bits, 8);
+    }
+  }
+  return MF_OK;
 }
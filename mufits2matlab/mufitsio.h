@@ -24,8 +24,15 @@ typedef enum mf_status {
   MF_ERROR_UNSUPPORTED_FEATURE_REQUIRED
 } mf_status_t;
 
-// MUFITS files can be saved in either binary or text format; this lib currently
-// supports only binary format
+// MUFITS files can be saved in either binary or text format. Text (ASCII)
+// files start with the keyword ASCII and hold the same records as binary ones
+// as whitespace-separated tokens without record sizes, e.g. `TIME 1.5 DAY`,
+// `DATE 1 JAN 2000`, a block keyword followed by `ARRAYS <properties>
+// <objects>`, one `<name> [<dimension>] <tags> ENDITEM` item per property,
+// `DATA`, the values of all records in binary order and `ENDDATA`, and finally
+// `ENDFILE`. MVS files hold `GRIDDATA`, `GRIDSIZE <vertices> <cells>`, `POINTS`
+// and `CELLS`. Real numbers may use Fortran exponents such as 1.5D+03. Both
+// formats are read into the same structures; views require binary files
 typedef enum mf_file_format { MF_BINARY, MF_ASCII } mf_file_format_t;
 
 typedef enum mf_data_type {
@@ -47,7 +54,9 @@ typedef enum mf_phase_state { MF_STATE0, MF_STATE1 } mf_phase_state_t;
 
 // When reading or writing MUFITS files, data layout may not be contiguous for
 // each property, e.g. properties that are defined per phase usually are stored
-// in interleaved manner
+// in interleaved manner. When reading STATE1 properties, all phases of an
+// object are stored contiguously, so `stride` must hold as many elements as
+// the largest PHST in the file
 typedef struct mf_data {
   void *bytes;
   size_t stride;
@@ -57,6 +66,21 @@ typedef struct mf_data {
 // SUM file handle
 typedef struct mf_sum_file mf_sum_file_t;
 
+// Time spent and bytes read by the library for one SUM file since it was
+// opened. Opening parses record headers and ARRAYS records and skips DATA
+// records, reading loads DATA records and decodes the requested properties.
+// ASCII files are read as a whole while opening, and parsing DATA values
+// counts as decoding
+typedef struct mf_sum_file_stats {
+  double open_seconds;
+  // Part of open_seconds spent in ARRAYS records
+  double arrays_seconds;
+  double read_seconds;
+  double decode_seconds;
+  int64_t header_bytes;
+  int64_t data_bytes;
+} mf_sum_file_stats_t;
+
 typedef struct mf_time {
   double value;
   char dimension[9];
@@ -135,16 +159,148 @@ typedef struct mf_sum_read_request {
   mf_sum_block_query_t *fpcodata;
 } mf_sum_read_request_t;
 
+// Blocks of a SUM file
+typedef enum mf_sum_block {
+  MF_CELLDATA,
+  MF_CONNDATA,
+  MF_SRCDATA,
+  MF_FPCEDATA,
+  MF_FPCODATA
+} mf_sum_block_t;
+
+// Opened files are read with positional reads or from the mapping and the
+// handle does not change afterwards except for its statistics, which are
+// updated under a lock. Several threads can therefore read blocks or parts of
+// blocks of one handle at once with mf_read_sum_file,
+// mf_read_sum_file_with_plan, mf_read_sum_block and mf_read_sum_cells; only
+// closing the file must wait for all of them
 mf_status_t mf_open_sum_file(mf_sum_file_t **file, const char *filename);
+// Maps the whole file into memory and parses it in place; the file is read by the page cache instead of stdio
+mf_status_t mf_open_sum_file_mmap(mf_sum_file_t **file, const char *filename);
 void mf_close_sum_file(mf_sum_file_t *file);
 
+// Limits the number of threads a single call of the library starts for large
+// blocks of variable-size records, ASCII files and connectivity graphs; 0
+// restores the default, the number of processors. Applications that read
+// several files in parallel set it to their share of the processors before
+// starting to read
+void mf_set_max_threads(int num_threads);
+
+// Checks whether a SUM file is complete, i.e. ends with the ENDFILE record that
+// MUFITS writes last, without parsing it. Returns MF_OK for complete files,
+// MF_ERROR_INVALID_FILE for files that are still being written and
+// MF_ERROR_FAILED_IO_OPERATION if the file cannot be opened. Nothing is printed,
+// so the function can be used to poll files that do not exist yet
+mf_status_t mf_probe_sum_file(const char *filename);
+
 mf_sum_description_t *mf_get_sum_description(const mf_sum_file_t *file);
 
+void mf_get_sum_file_stats(const mf_sum_file_t *file, mf_sum_file_stats_t *stats);
+
 mf_status_t mf_read_sum_file(mf_sum_file_t *file,
                              const mf_sum_read_request_t *request,
                              mf_sum_attachment_t *attachment);
 
+// Reads a range of objects of one block: object `first` goes to the first
+// element of every destination and as many objects follow as the largest
+// `count` of the destinations asks for, up to the end of the block. Blocks of
+// fixed-size records are read only over the range, blocks with STATE1
+// properties too once their record index is built, see mf_index_sum_block
+mf_status_t mf_read_sum_block(mf_sum_file_t *file, mf_sum_block_t block,
+                              const mf_sum_block_query_t *query, int32_t first,
+                              mf_data_t *data);
+
+// Returns offsets of all records of a block of a binary file relative to the
+// start of its data: record i occupies [offsets[i], offsets[i + 1]). Records
+// of blocks with STATE1 properties vary in size with PHST, so their offsets
+// are found in one pass that reads only the PHST byte of every record and sums
+// up record sizes. The index is built once per handle, either by this function
+// or by the first read of the block, which then jumps straight to any range of
+// objects and splits decoding between threads. Offsets stay valid until the
+// file is closed
+mf_status_t mf_index_sum_block(mf_sum_file_t *file, mf_sum_block_t block,
+                               const int64_t **offsets);
+
+// Reads selected objects of CELLDATA, e.g. observation cells, without reading
+// the rest of the block: element k of every destination receives object
+// objects[k], as far as `count` of the destination allows. Objects are
+// positions of records in the block, which follow the order of CELLID, and may
+// be given in any order. Records are located by the record size or, with
+// STATE1 properties, by the record index, and only they are read with
+// positional reads or from the mapping; records close to each other are read
+// together. Binary files only
+mf_status_t mf_read_sum_cells(mf_sum_file_t *file, const mf_sum_block_query_t *query,
+                              const int32_t *objects, int32_t num_objects, mf_data_t *data);
+
+// Zero-copy alternative to mf_read_sum_file for files opened with
+// mf_open_sum_file_mmap: instead of copying data, every requested property is
+// described by a strided view into the mapping, i.e. `bytes` points to the
+// first element, `stride` is the record size and `count` is the number of
+// objects. For DOUBLE properties `bytes` must point to a caller-provided array
+// of two pointers which receive both components. Only blocks without STATE1
+// properties have fixed stride and can be viewed. Views are read-only and stay
+// valid until the file is closed
+mf_status_t mf_view_sum_file(const mf_sum_file_t *file,
+                             const mf_sum_read_request_t *request,
+                             mf_sum_attachment_t *attachment);
+
+// Decode plan handle. A plan resolves a read request against the property
+// descriptors of one SUM file once: requested names are matched, record sizes
+// and offsets of every requested property are computed and turned into a list
+// of copy operations. All SUM files of a run share the same descriptors, so a
+// plan compiled from the first file can decode every other one. Plans are
+// read-only after compilation and can be shared between threads
+typedef struct mf_sum_decode_plan mf_sum_decode_plan_t;
+
+mf_status_t mf_compile_sum_plan(mf_sum_decode_plan_t **plan, const mf_sum_file_t *file,
+                                const mf_sum_read_request_t *request);
+
+// Compares hashes of the property descriptors recorded while opening the file
+// with the ones the plan was compiled for. Returns MF_OK if the plan can decode
+// the file and MF_ERROR_INVALID_READ_REQUEST otherwise. Nothing is printed, so
+// callers can fall back to compiling a new plan
+mf_status_t mf_check_sum_plan(const mf_sum_decode_plan_t *plan, const mf_sum_file_t *file);
+
+// Same as mf_read_sum_file, but uses a compiled plan instead of resolving the
+// request again; the file is checked with mf_check_sum_plan first
+mf_status_t mf_read_sum_file_with_plan(mf_sum_file_t *file, const mf_sum_decode_plan_t *plan,
+                                       mf_sum_attachment_t *attachment);
+
+void mf_free_sum_plan(mf_sum_decode_plan_t *plan);
+
+// Connectivity graph of the cells, built from CONNDATA in compressed sparse row
+// form. Every connection between two cells of the graph gives an entry in the
+// row of each cell: `columns` holds the row of the other cell and `conns` the
+// connection, so entries of row r are [row_offsets[r], row_offsets[r + 1]) and
+// are ordered by connection. Connections are numbered in CONNDATA order after
+// dropping the ones to cells outside of the graph. `conn_rows` holds the rows of
+// the first and the second cell of every connection, which gives the direction
+// of fluxes, and `values[v][c]` the requested properties converted to double
+typedef struct mf_conn_graph {
+  int32_t num_rows;
+  int32_t num_conns;
+  int64_t *row_offsets;
+  int32_t *columns;
+  int32_t *conns;
+  int32_t (*conn_rows)[2];
+  int32_t num_values;
+  double **values;
+} mf_conn_graph_t;
+
+// Decodes CONNDATA into a connectivity graph. `ids_name` is the property holding
+// both cell IDs of a connection, e.g. "CONNID  ", `values` lists properties
+// with a single number per connection and may be NULL. Cell `cell_ids[i]` is
+// put into row `rows[i]`, cells whose rows are outside of [0, num_rows) and
+// cells missing from `cell_ids` are left out. Large blocks are processed by
+// several threads
+mf_status_t mf_read_conn_graph(mf_sum_file_t *file, const char *ids_name, const mf_sum_block_query_t *values,
+                               const int32_t *cell_ids, const int32_t *rows, int32_t num_cells, int32_t num_rows,
+                               mf_conn_graph_t *graph);
+
+void mf_free_conn_graph(mf_conn_graph_t *graph);
+
 mf_status_t mf_open_mvs_file(mf_mvs_file_t **file, const char *filename);
+mf_status_t mf_open_mvs_file_mmap(mf_mvs_file_t **file, const char *filename);
 void mf_close_mvs_file(mf_mvs_file_t *file);
 
 mf_mvs_description_t *mf_get_mvs_description(const mf_mvs_file_t *file);
@@ -153,10 +309,37 @@ mf_status_t mf_read_mvs_file(mf_mvs_file_t *file, mf_mvs_attachment_t *data);
 
 // Write API
 
+// Writes TIME, DATE and all blocks present in the description. Property data are
+// passed in the same columnar form mf_read_sum_file fills: for STATE1 properties
+// `stride` holds all phases of an object, and the number of phases written for
+// every object is taken from PHST, which has to precede them in the block.
+// Records are assembled in a staging buffer and written in large chunks
 mf_status_t mf_write_sum_file(FILE *stream, const mf_sum_description_t *desc,
                               mf_sum_attachment_t *data);
 
+// Writes the grid in the layout mf_read_mvs_file reads: GRIDSIZE, POINTS and
+// CELLS, each cell being its ID followed by eight vertex indices
 mf_status_t mf_write_mvs_file(FILE *stream, const mf_mvs_description_t *desc,
                               mf_mvs_attachment_t *data);
 
+// Field codec API
+
+// Lossless codec for fields of doubles. Every value is XORed with the value at
+// the same position of an optional base field, e.g. the previous time step, the
+// result is split into byte planes, from the most significant byte to the least
+// significant one, and the planes are entropy-coded with an adaptive binary
+// range coder. Slowly changing fields therefore turn into long runs of zero
+// bytes which cost almost nothing. Incompressible fields are stored verbatim,
+// so the encoded size never exceeds mf_field_bound(count)
+int64_t mf_field_bound(int64_t count);
+
+// Encodes `count` values into `dst`, which must hold at least
+// mf_field_bound(count) bytes, and returns the encoded size. `base` is either
+// NULL or a field of `count` values
+int64_t mf_encode_field(const double *values, const double *base, int64_t count, void *dst);
+
+// Restores the exact bits of `count` values encoded by mf_encode_field with the
+// same base field
+mf_status_t mf_decode_field(const void *src, int64_t size, const double *base, int64_t count, double *values);
+
 MF_END_DECL
@@ -0,0 +1,451 @@
+#pragma once
+
+// Header-only C++17 interface to mufitsio: RAII handles of SUM and MVS files and
+// typed reads of properties. Element types are mapped to mf_data_type_t at
+// compile time, e.g. `file.read<double>("PRES")` compiles only because double
+// is the type of REAL8 properties and throws if PRES is stored otherwise.
+// Values are returned as strided spans, either over buffers owned by a
+// `property` or, for mapped files, straight over the records of the mapping.
+// Errors of the library are turned into `mf::error`, which keeps the status
+
+#include "mufitsio.h"
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <iterator>
+#include <memory>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+namespace mf {
+
+class error : public std::runtime_error {
+public:
+  error(mf_status_t status, const std::string &what) : std::runtime_error(what), status_(status) {}
+  mf_status_t status() const noexcept { return status_; }
+
+private:
+  mf_status_t status_;
+};
+
+inline void check(mf_status_t status, const std::string &what) {
+  if (status != MF_OK) {
+    throw error(status, what);
+  }
+}
+
+// Elements of character properties
+struct char4 {
+  char value[4];
+};
+
+struct char8 {
+  char value[8];
+};
+
+// Element type of every data type and back. Only these types can be read, any other type fails to compile
+template <class T> struct data_type_of;
+template <> struct data_type_of<int8_t> : std::integral_constant<mf_data_type_t, MF_INT1> {};
+template <> struct data_type_of<int16_t> : std::integral_constant<mf_data_type_t, MF_INT2> {};
+template <> struct data_type_of<int32_t> : std::integral_constant<mf_data_type_t, MF_INT4> {};
+template <> struct data_type_of<float> : std::integral_constant<mf_data_type_t, MF_REAL4> {};
+template <> struct data_type_of<double> : std::integral_constant<mf_data_type_t, MF_REAL8> {};
+template <> struct data_type_of<char4> : std::integral_constant<mf_data_type_t, MF_CHAR4> {};
+template <> struct data_type_of<char8> : std::integral_constant<mf_data_type_t, MF_CHAR8> {};
+
+template <class T> inline constexpr mf_data_type_t data_type_v = data_type_of<T>::value;
+
+template <class T, class = void> struct is_element : std::false_type {};
+template <class T> struct is_element<T, std::void_t<decltype(data_type_of<T>::value)>> : std::true_type {};
+template <class T> inline constexpr bool is_element_v = is_element<T>::value;
+
+template <mf_data_type_t Type> struct element_of;
+template <> struct element_of<MF_INT1> { using type = int8_t; };
+template <> struct element_of<MF_INT2> { using type = int16_t; };
+template <> struct element_of<MF_INT4> { using type = int32_t; };
+template <> struct element_of<MF_REAL4> { using type = float; };
+template <> struct element_of<MF_REAL8> { using type = double; };
+template <> struct element_of<MF_CHAR4> { using type = char4; };
+template <> struct element_of<MF_CHAR8> { using type = char8; };
+
+template <mf_data_type_t Type> using element_t = typename element_of<Type>::type;
+
+// Calls `f` with a value of the element type of `type`, so that code handling properties whose type is known only at
+// run time switches once and is instantiated, with its loops inlined, for every element type
+template <class F> decltype(auto) dispatch(mf_data_type_t type, F &&f) {
+  switch (type) {
+  case MF_INT1:
+    return f(element_t<MF_INT1>{});
+  case MF_INT2:
+    return f(element_t<MF_INT2>{});
+  case MF_INT4:
+    return f(element_t<MF_INT4>{});
+  case MF_REAL4:
+    return f(element_t<MF_REAL4>{});
+  case MF_REAL8:
+    return f(element_t<MF_REAL8>{});
+  case MF_CHAR4:
+    return f(element_t<MF_CHAR4>{});
+  case MF_CHAR8:
+    break;
+  }
+  return f(element_t<MF_CHAR8>{});
+}
+
+// Read-only view of `size` elements placed `stride` bytes apart, e.g. one property of all records of a block or one
+// phase of a STATE1 property. Elements are loaded with memcpy of the fixed sizeof(T), which compiles to a plain load
+// and allows views into unaligned records of a mapped file
+template <class T> class strided_span {
+  static_assert(std::is_trivially_copyable_v<T>, "elements are copied bytewise");
+
+public:
+  class iterator {
+  public:
+    using iterator_category = std::forward_iterator_tag;
+    using value_type = T;
+    using difference_type = std::ptrdiff_t;
+    using pointer = const T *;
+    using reference = T;
+
+    iterator() = default;
+    iterator(const unsigned char *pos, size_t stride) : pos_(pos), stride_(stride) {}
+    T operator*() const noexcept {
+      T value;
+      std::memcpy(&value, pos_, sizeof(T));
+      return value;
+    }
+    iterator &operator++() noexcept {
+      pos_ += stride_;
+      return *this;
+    }
+    iterator operator++(int) noexcept {
+      iterator old = *this;
+      pos_ += stride_;
+      return old;
+    }
+    bool operator==(const iterator &other) const noexcept { return pos_ == other.pos_; }
+    bool operator!=(const iterator &other) const noexcept { return pos_ != other.pos_; }
+
+  private:
+    const unsigned char *pos_ = nullptr;
+    size_t stride_ = 0;
+  };
+
+  strided_span() = default;
+  strided_span(const void *data, size_t stride, size_t size)
+      : bytes_(static_cast<const unsigned char *>(data)), stride_(stride), size_(size) {}
+
+  const void *data() const noexcept { return bytes_; }
+  size_t stride() const noexcept { return stride_; }
+  size_t size() const noexcept { return size_; }
+  bool empty() const noexcept { return size_ == 0; }
+  // Contiguous spans can also be used as arrays of T through data()
+  bool contiguous() const noexcept { return stride_ == sizeof(T); }
+
+  T operator[](size_t idx) const noexcept {
+    T value;
+    std::memcpy(&value, bytes_ + idx * stride_, sizeof(T));
+    return value;
+  }
+
+  iterator begin() const noexcept { return iterator(bytes_, stride_); }
+  iterator end() const noexcept { return iterator(bytes_ + size_ * stride_, stride_); }
+
+  strided_span subspan(size_t offset, size_t count) const noexcept {
+    return strided_span(bytes_ + offset * stride_, stride_, count);
+  }
+
+  std::vector<T> to_vector() const {
+    std::vector<T> values(size_);
+    if (contiguous()) {
+      std::memcpy(values.data(), bytes_, size_ * sizeof(T));
+    } else {
+      for (size_t idx = 0; idx < size_; ++idx) {
+        values[idx] = (*this)[idx];
+      }
+    }
+    return values;
+  }
+
+private:
+  const unsigned char *bytes_ = nullptr;
+  size_t stride_ = 0;
+  size_t size_ = 0;
+};
+
+// Values of one property read into buffers owned by the object, one per component. A buffer holds `phases()`
+// elements per object: spans of STATE0 properties are contiguous, phases of STATE1 properties are strided and
+// elements of phases an object does not have are left zero
+template <class T> class property {
+  static_assert(is_element_v<T>, "properties are read as int8_t, int16_t, int32_t, float, double, char4 or char8");
+
+public:
+  const mf_property_t &info() const noexcept { return info_; }
+  int32_t size() const noexcept { return count_; }
+  int components() const noexcept { return info_.output_mode == MF_DOUBLE ? 2 : 1; }
+  int phases() const noexcept { return phases_; }
+
+  strided_span<T> span(int component = 0, int phase = 0) const &noexcept {
+    return strided_span<T>(values_[component].data() + phase, phases_ * sizeof(T), count_);
+  }
+  // Spans must not outlive the buffers
+  strided_span<T> span(int component = 0, int phase = 0) const && = delete;
+  T operator[](int32_t idx) const noexcept { return values_[0][(size_t)idx * phases_]; }
+
+private:
+  friend class sum_file;
+  mf_property_t info_{};
+  int32_t count_ = 0;
+  int phases_ = 1;
+  std::vector<T> values_[2];
+};
+
+// Grid of an MVS file, every cell being its ID and eight vertex indices
+struct grid {
+  std::vector<std::array<double, 3>> points;
+  std::vector<int32_t> cell_ids;
+  std::vector<std::array<int32_t, 8>> cells;
+};
+
+// Property names are given without the blanks MUFITS pads them with to 8 characters
+inline std::array<char, 9> padded_name(const char *name) {
+  size_t len = std::strlen(name);
+  if (len == 0 || len > 8) {
+    throw error(MF_ERROR_INVALID_READ_REQUEST, std::string("invalid property name '") + name + "'");
+  }
+  std::array<char, 9> padded;
+  std::memset(padded.data(), ' ', 8);
+  std::memcpy(padded.data(), name, len);
+  padded[8] = '\0';
+  return padded;
+}
+
+// SUM file handle. Reads do not modify the handle, so const member functions can be called from several threads at
+// once like the functions of the library
+class sum_file {
+public:
+  // Opens the file for positional reads
+  explicit sum_file(const std::string &path) {
+    mf_sum_file_t *file;
+    check(mf_open_sum_file(&file, path.c_str()), "failed to open SUM file '" + path + "'");
+    file_.reset(file);
+  }
+
+  // Maps the whole file into memory, which also makes views available
+  static sum_file mapped(const std::string &path) {
+    mf_sum_file_t *file;
+    check(mf_open_sum_file_mmap(&file, path.c_str()), "failed to map SUM file '" + path + "'");
+    return sum_file(file);
+  }
+
+  mf_sum_file_t *get() const noexcept { return file_.get(); }
+  const mf_sum_description_t &description() const noexcept { return *mf_get_sum_description(file_.get()); }
+
+  std::optional<mf_time_t> time() const {
+    const mf_time_t *time = description().time;
+    return time ? std::optional<mf_time_t>(*time) : std::nullopt;
+  }
+
+  std::optional<mf_date_t> date() const {
+    const mf_date_t *date = description().date;
+    return date ? std::optional<mf_date_t>(*date) : std::nullopt;
+  }
+
+  mf_sum_file_stats_t stats() const {
+    mf_sum_file_stats_t stats;
+    mf_get_sum_file_stats(file_.get(), &stats);
+    return stats;
+  }
+
+  // Descriptor of a block, nullptr if the file has none
+  const mf_arrays_t *arrays(mf_sum_block_t block) const noexcept {
+    const mf_sum_description_t &desc = description();
+    const mf_arrays_t *blocks[] = {desc.celldata, desc.conndata, desc.srcdata, desc.fpcedata, desc.fpcodata};
+    return blocks[block];
+  }
+
+  const mf_property_t &info(mf_sum_block_t block, const char *name) const {
+    std::array<char, 9> padded = padded_name(name);
+    const mf_arrays_t *desc = checked_arrays(block);
+    for (int32_t prop_idx = 0; prop_idx < desc->num_properties; ++prop_idx) {
+      if (!std::memcmp(desc->properties[prop_idx].name, padded.data(), 8)) {
+        return desc->properties[prop_idx];
+      }
+    }
+    throw error(MF_ERROR_MISSING_PROPERTY, std::string("file doesn't contain property '") + name + "'");
+  }
+
+  // Reads objects [first, first + count) of a block, all of them by default. For STATE1 properties PHST of the same
+  // objects is read first to size the buffers
+  template <class T>
+  property<T> read(mf_sum_block_t block, const char *name, int32_t first = 0, int32_t count = -1) const {
+    const mf_arrays_t *desc = checked_arrays(block);
+    if (first < 0 || first > desc->num_objects) {
+      throw error(MF_ERROR_INVALID_READ_REQUEST, "first object is outside of the block");
+    }
+    if (count < 0 || count > desc->num_objects - first) {
+      count = desc->num_objects - first;
+    }
+    int phases = 1;
+    if (info(block, name).phase_state == MF_STATE1) {
+      property<int8_t> phst = read<int8_t>(block, "PHST", first, count);
+      phases = max_phases(phst.span());
+    }
+    property<T> prop = make_property<T>(block, name, count, phases);
+    std::array<char, 9> padded = padded_name(name);
+    mf_sum_block_query_t query = {reinterpret_cast<char(*)[9]>(padded.data()), 1};
+    char *components[2];
+    mf_data_t data = destination(prop, components);
+    check(mf_read_sum_block(file_.get(), block, &query, first, &data), std::string("failed to read '") + name + "'");
+    return prop;
+  }
+
+  template <class T> property<T> read(const char *name) const { return read<T>(MF_CELLDATA, name); }
+
+  // Reads selected objects of CELLDATA, element k holding object objects[k]; binary files only
+  template <class T> property<T> read_cells(const char *name, const std::vector<int32_t> &objects) const {
+    int phases = 1;
+    if (info(MF_CELLDATA, name).phase_state == MF_STATE1) {
+      property<int8_t> phst = read_cells<int8_t>("PHST", objects);
+      phases = max_phases(phst.span());
+    }
+    property<T> prop = make_property<T>(MF_CELLDATA, name, (int32_t)objects.size(), phases);
+    std::array<char, 9> padded = padded_name(name);
+    mf_sum_block_query_t query = {reinterpret_cast<char(*)[9]>(padded.data()), 1};
+    char *components[2];
+    mf_data_t data = destination(prop, components);
+    check(mf_read_sum_cells(file_.get(), &query, objects.data(), (int32_t)objects.size(), &data),
+          std::string("failed to read cells of '") + name + "'");
+    return prop;
+  }
+
+  // Zero-copy view of one component of a property over the records of a file opened with mapped(); blocks with STATE1
+  // properties cannot be viewed. The view stays valid as long as the file is open
+  template <class T> strided_span<T> view(mf_sum_block_t block, const char *name, int component = 0) const {
+    const mf_property_t &prop = checked_info<T>(block, name);
+    if (component < 0 || component >= (prop.output_mode == MF_DOUBLE ? 2 : 1)) {
+      throw error(MF_ERROR_INVALID_READ_REQUEST, std::string("property '") + name + "' has no such component");
+    }
+    checked_arrays(block);
+    std::array<char, 9> padded = padded_name(name);
+    mf_sum_block_query_t query = {reinterpret_cast<char(*)[9]>(padded.data()), 1};
+    const char *components[2] = {nullptr, nullptr};
+    mf_data_t data = {prop.output_mode == MF_DOUBLE ? static_cast<void *>(components) : nullptr, 0, 0};
+    mf_sum_read_request_t request = {};
+    mf_sum_attachment_t attachment = {};
+    mf_sum_block_query_t **queries[] = {&request.celldata, &request.conndata, &request.srcdata, &request.fpcedata,
+                                        &request.fpcodata};
+    mf_data_t **destinations[] = {&attachment.celldata, &attachment.conndata, &attachment.srcdata,
+                                  &attachment.fpcedata, &attachment.fpcodata};
+    *queries[block] = &query;
+    *destinations[block] = &data;
+    check(mf_view_sum_file(file_.get(), &request, &attachment), std::string("failed to view '") + name + "'");
+    return strided_span<T>(prop.output_mode == MF_DOUBLE ? components[component] : data.bytes, data.stride,
+                           data.count);
+  }
+
+  template <class T> strided_span<T> view(const char *name, int component = 0) const {
+    return view<T>(MF_CELLDATA, name, component);
+  }
+
+private:
+  struct closer {
+    void operator()(mf_sum_file_t *file) const noexcept { mf_close_sum_file(file); }
+  };
+
+  explicit sum_file(mf_sum_file_t *file) : file_(file) {}
+
+  const mf_arrays_t *checked_arrays(mf_sum_block_t block) const {
+    const mf_arrays_t *desc = arrays(block);
+    if (!desc) {
+      throw error(MF_ERROR_MISSING_PROPERTY, "file doesn't contain requested block");
+    }
+    return desc;
+  }
+
+  template <class T> const mf_property_t &checked_info(mf_sum_block_t block, const char *name) const {
+    static_assert(is_element_v<T>, "properties are read as int8_t, int16_t, int32_t, float, double, char4 or char8");
+    const mf_property_t &prop = info(block, name);
+    if (prop.data_type != data_type_v<T>) {
+      throw error(MF_ERROR_INVALID_READ_REQUEST,
+                  std::string("property '") + name + "' is stored with another element type");
+    }
+    return prop;
+  }
+
+  // Values of PHST below one stand for a single phase
+  static int max_phases(const strided_span<int8_t> &phst) {
+    int phases = 1;
+    for (int8_t value : phst) {
+      phases = value > phases ? value : phases;
+    }
+    return phases;
+  }
+
+  template <class T>
+  property<T> make_property(mf_sum_block_t block, const char *name, int32_t count, int phases) const {
+    property<T> prop;
+    prop.info_ = checked_info<T>(block, name);
+    prop.count_ = count;
+    prop.phases_ = phases;
+    for (int component = 0; component < prop.components(); ++component) {
+      prop.values_[component].resize((size_t)count * phases);
+    }
+    return prop;
+  }
+
+  // DOUBLE properties are passed as an array of two pointers
+  template <class T> static mf_data_t destination(property<T> &prop, char *(&components)[2]) {
+    components[0] = reinterpret_cast<char *>(prop.values_[0].data());
+    components[1] = reinterpret_cast<char *>(prop.values_[1].data());
+    mf_data_t data;
+    data.bytes = prop.components() == 2 ? static_cast<void *>(components) : components[0];
+    data.stride = prop.phases_ * sizeof(T);
+    data.count = prop.count_;
+    return data;
+  }
+
+  std::unique_ptr<mf_sum_file_t, closer> file_;
+};
+
+// MVS file handle
+class mvs_file {
+public:
+  explicit mvs_file(const std::string &path, bool mapped = false) {
+    mf_mvs_file_t *file;
+    check(mapped ? mf_open_mvs_file_mmap(&file, path.c_str()) : mf_open_mvs_file(&file, path.c_str()),
+          "failed to open MVS file '" + path + "'");
+    file_.reset(file);
+  }
+
+  mf_mvs_file_t *get() const noexcept { return file_.get(); }
+  const mf_mvs_description_t &description() const noexcept { return *mf_get_mvs_description(file_.get()); }
+
+  grid read() const {
+    const mf_mvs_description_t &desc = description();
+    grid result;
+    result.points.resize(desc.num_vertices);
+    result.cell_ids.resize(desc.num_cells);
+    result.cells.resize(desc.num_cells);
+    mf_mvs_attachment_t data;
+    data.points = reinterpret_cast<double(*)[3]>(result.points.data());
+    data.cell_ids = result.cell_ids.data();
+    data.cells = reinterpret_cast<int32_t(*)[8]>(result.cells.data());
+    check(mf_read_mvs_file(file_.get(), &data), "failed to read MVS file");
+    return result;
+  }
+
+private:
+  struct closer {
+    void operator()(mf_mvs_file_t *file) const noexcept { mf_close_mvs_file(file); }
+  };
+
+  std::unique_ptr<mf_mvs_file_t, closer> file_;
+};
+
+} // namespace mf